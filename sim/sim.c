@@ -0,0 +1,642 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the multi-node propagation simulator.
+ *
+ * N nodes, each with its own blockchain, run in one process and talk over
+ * virtual links with a latency and a bandwidth. Time is simulated with an
+ * event queue, so a run is deterministic for a given seed and a hundred
+ * nodes take seconds instead of minutes.
+ *
+ * Nodes flood blocks: a block that is new to a node is relayed to every
+ * neighbour but the one it came from. The run has two phases:
+ *   sync         node 0 starts with sync blocks the others download
+ *   propagation  random nodes mine blocks at exponential intervals
+ *
+ * To build and run:
+ * make sim
+ * ./output/sim -n 50 -t random:4 -l 50 -b 1000000 -m 100
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "../src/blockchain/blockchain.h"
+#include "../src/blockchain/block_tree.h"
+
+#define SIM_MAX_NODES 100           // Largest network simulated
+#define SIM_MESSAGE_HEADER 8        // Message type and length before each block
+#define SIM_DATA_SIZE 128           // Payload of simulated blocks
+
+/***********************/
+/*   DATA STRUCTURES   */
+/***********************/
+
+typedef enum sim_event_type_t {
+    SIM_DELIVER,                    // A block arrives at a node
+    SIM_MINE                        // A node mines a block
+} sim_event_type_t;
+
+typedef struct sim_event_t {
+    uint64_t time_us;               // Simulated time of the event
+    uint64_t order;                 // Tie breaker, keeps events FIFO
+    sim_event_type_t type;          // What happens
+    int node;                       // Node the event happens at
+    int from;                       // Sender of a delivered block
+} sim_event_t;
+
+typedef struct sim_message_t {
+    uint64_t arrival_us;            // When the message reaches the receiver
+    char *data;                     // Block in binary encoding after a header
+    size_t length;                  // Bytes of data
+    struct sim_message_t *next;     // Next message on the same link
+} sim_message_t;
+
+// Messages on a link arrive in the order they were sent, so each link keeps
+// its own FIFO and only its first message sits in the event queue
+typedef struct sim_link_t {
+    int up;                         // Whether the nodes are neighbours
+    uint64_t latency_us;            // One way propagation delay
+    uint64_t busy_until_us;         // When the last queued message leaves
+    sim_message_t *head;            // Next message to arrive
+    sim_message_t *tail;            // Last message sent
+} sim_link_t;
+
+typedef struct sim_config_t {
+    int nodes;                      // Nodes in the network
+    char topology[32];              // mesh, ring, line, star or random:<degree>
+    double latency_ms;              // Mean one way link latency
+    double jitter_ms;               // Links differ from the mean by up to this
+    double bandwidth;               // Link bandwidth in bytes per second
+    int sync_blocks;                // Blocks node 0 starts with
+    int mined_blocks;               // Blocks mined in the propagation phase
+    double interval_ms;             // Mean time between mined blocks
+    unsigned int seed;              // Random seed
+} sim_config_t;
+
+/***********************/
+/*   SIMULATION STATE  */
+/***********************/
+
+sim_config_t config = {10, "random:4", 50, 10, 1000000, 100, 100, 1000, 1};
+blockchain_t *nodes[SIM_MAX_NODES];
+sim_link_t links[SIM_MAX_NODES][SIM_MAX_NODES];
+
+// Event queue, a binary heap ordered by time
+sim_event_t **queue;
+int queue_length;
+int queue_capacity;
+uint64_t queue_order;
+
+uint64_t now_us;
+uint64_t bytes_sent;
+uint64_t *node_height_reached_us;   // Time each node finished syncing
+uint64_t *received_us;              // First time each node saw each mined block
+uint64_t *mined_us;                 // Time each block was mined
+int *mined_by;                      // Node that mined each block
+int orphans;                        // Blocks dropped because their parent was unknown
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+
+// Uniform random number in [0, 1)
+double random_unit()
+{
+    return rand() / ((double) RAND_MAX + 1);
+}
+
+// Whether event a happens before event b
+int event_before(sim_event_t *a, sim_event_t *b)
+{
+    return a->time_us < b->time_us || (a->time_us == b->time_us && a->order < b->order);
+}
+
+// Add an event to the queue
+void queue_push(sim_event_t *event)
+{
+    if (queue_length == queue_capacity)
+    {
+        queue_capacity = queue_capacity ? queue_capacity * 2 : 1024;
+        queue = realloc(queue, sizeof(sim_event_t *) * queue_capacity);
+        if (!queue)
+        {
+            printf("Error allocating memory for event queue\n");
+            exit(1);
+        }
+    }
+    event->order = queue_order++;
+
+    // Sift up
+    int i = queue_length++;
+    while (i > 0 && event_before(event, queue[(i - 1) / 2]))
+    {
+        queue[i] = queue[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    queue[i] = event;
+}
+
+// Remove and return the earliest event, NULL if the queue is empty
+sim_event_t *queue_pop()
+{
+    if (queue_length == 0)
+    {
+        return NULL;
+    }
+    sim_event_t *first = queue[0];
+    sim_event_t *last = queue[--queue_length];
+
+    // Sift down
+    int i = 0;
+    while (2 * i + 1 < queue_length)
+    {
+        int child = 2 * i + 1;
+        if (child + 1 < queue_length && event_before(queue[child + 1], queue[child]))
+        {
+            child++;
+        }
+        if (!event_before(queue[child], last))
+        {
+            break;
+        }
+        queue[i] = queue[child];
+        i = child;
+    }
+    queue[i] = last;
+
+    return first;
+}
+
+// Create an event
+sim_event_t *new_event(sim_event_type_t type, uint64_t time_us, int node)
+{
+    sim_event_t *event = calloc(1, sizeof(sim_event_t));
+    if (!event)
+    {
+        printf("Error allocating memory for event\n");
+        exit(1);
+    }
+    event->type = type;
+    event->time_us = time_us;
+    event->node = node;
+    return event;
+}
+
+// Connect two nodes both ways with a latency around the configured mean
+void connect_nodes(int a, int b)
+{
+    if (a == b || links[a][b].up)
+    {
+        return;
+    }
+    double latency_ms = config.latency_ms + config.jitter_ms * (2 * random_unit() - 1);
+    uint64_t latency_us = latency_ms > 0 ? (uint64_t) (latency_ms * 1000) : 0;
+    links[a][b].up = links[b][a].up = 1;
+    links[a][b].latency_us = links[b][a].latency_us = latency_us;
+}
+
+// Number of neighbours of a node
+int degree(int node)
+{
+    int count = 0;
+    for (int i = 0; i < config.nodes; i++)
+    {
+        count += links[node][i].up;
+    }
+    return count;
+}
+
+// Build the links of the configured topology
+void build_topology()
+{
+    int n = config.nodes;
+
+    if (strcmp(config.topology, "mesh") == 0)
+    {
+        for (int a = 0; a < n; a++)
+        {
+            for (int b = a + 1; b < n; b++)
+            {
+                connect_nodes(a, b);
+            }
+        }
+    }
+    else if (strcmp(config.topology, "ring") == 0 || strcmp(config.topology, "line") == 0)
+    {
+        for (int a = 0; a + 1 < n; a++)
+        {
+            connect_nodes(a, a + 1);
+        }
+        if (strcmp(config.topology, "ring") == 0)
+        {
+            connect_nodes(n - 1, 0);
+        }
+    }
+    else if (strcmp(config.topology, "star") == 0)
+    {
+        for (int a = 1; a < n; a++)
+        {
+            connect_nodes(0, a);
+        }
+    }
+    else if (strncmp(config.topology, "random:", 7) == 0)
+    {
+        // A ring keeps the network connected, random links bring every
+        // node up to the requested degree
+        int target = atoi(config.topology + 7);
+        for (int a = 0; a < n; a++)
+        {
+            connect_nodes(a, (a + 1) % n);
+        }
+        for (int a = 0; a < n; a++)
+        {
+            int attempts = 0;
+            while (degree(a) < target && degree(a) < n - 1 && attempts++ < 100 * n)
+            {
+                connect_nodes(a, rand() % n);
+            }
+        }
+    }
+    else
+    {
+        printf("Unknown topology %s\n", config.topology);
+        exit(1);
+    }
+}
+
+// Queue a block for delivery over the link from one node to another. The
+// link sends one message at a time, so messages wait for the ones ahead.
+void send_block(int from, int to, char *message, size_t length)
+{
+    sim_link_t *link = &links[from][to];
+    uint64_t transmit_us = (uint64_t) (length * 1e6 / config.bandwidth);
+    uint64_t start_us = link->busy_until_us > now_us ? link->busy_until_us : now_us;
+    link->busy_until_us = start_us + transmit_us;
+
+    sim_message_t *message_copy = malloc(sizeof(sim_message_t));
+    char *data = malloc(length);
+    if (!message_copy || !data)
+    {
+        printf("Error allocating memory for message\n");
+        exit(1);
+    }
+    memcpy(data, message, length);
+    message_copy->data = data;
+    message_copy->length = length;
+    message_copy->arrival_us = link->busy_until_us + link->latency_us;
+    message_copy->next = NULL;
+
+    // An idle link gets a delivery event for its first message
+    if (link->tail)
+    {
+        link->tail->next = message_copy;
+    }
+    else
+    {
+        link->head = message_copy;
+        sim_event_t *event = new_event(SIM_DELIVER, message_copy->arrival_us, to);
+        event->from = from;
+        queue_push(event);
+    }
+    link->tail = message_copy;
+
+    bytes_sent += length;
+}
+
+// Send a block to every neighbour of a node but one (-1 for none)
+void relay_block(int node, int except, block_t *block)
+{
+    size_t length = SIM_MESSAGE_HEADER + block_serialized_size(block);
+    char *message = malloc(length);
+    if (!message)
+    {
+        printf("Error allocating memory for message\n");
+        exit(1);
+    }
+    uint32_t type = htonl(1);
+    uint32_t block_length = htonl(length - SIM_MESSAGE_HEADER);
+    memcpy(message, &type, 4);
+    memcpy(message + 4, &block_length, 4);
+    block_serialize(block, message + SIM_MESSAGE_HEADER);
+
+    for (int i = 0; i < config.nodes; i++)
+    {
+        if (links[node][i].up && i != except)
+        {
+            send_block(node, i, message, length);
+        }
+    }
+    free(message);
+}
+
+// Mined block id of a block, -1 for blocks of the sync phase
+int block_id(block_t *block)
+{
+    int id;
+    if (sscanf(block->data, "mined %d", &id) == 1)
+    {
+        return id;
+    }
+    return -1;
+}
+
+// Compare two times for qsort
+int compare_times(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Value at percentile p of a sorted array, in milliseconds
+double percentile_ms(uint64_t *sorted, int count, int p)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+    return sorted[(long) p * (count - 1) / 100] / 1000.0;
+}
+
+// Read command line options
+void parse_arguments(int argc, char *argv[])
+{
+    int option;
+    while ((option = getopt(argc, argv, "n:t:l:j:b:s:m:i:r:h")) != -1)
+    {
+        switch (option)
+        {
+        case 'n': config.nodes = atoi(optarg); break;
+        case 't': snprintf(config.topology, sizeof(config.topology), "%s", optarg); break;
+        case 'l': config.latency_ms = atof(optarg); break;
+        case 'j': config.jitter_ms = atof(optarg); break;
+        case 'b': config.bandwidth = atof(optarg); break;
+        case 's': config.sync_blocks = atoi(optarg); break;
+        case 'm': config.mined_blocks = atoi(optarg); break;
+        case 'i': config.interval_ms = atof(optarg); break;
+        case 'r': config.seed = (unsigned int) atoi(optarg); break;
+        default:
+            printf("Usage: %s [-n nodes] [-t mesh|ring|line|star|random:<degree>] [-l latency_ms]\n"
+                   "          [-j jitter_ms] [-b bytes_per_second] [-s sync_blocks] [-m mined_blocks]\n"
+                   "          [-i interval_ms] [-r seed]\n", argv[0]);
+            exit(option == 'h' ? 0 : 1);
+        }
+    }
+
+    if (config.nodes < 2 || config.nodes > SIM_MAX_NODES)
+    {
+        printf("Number of nodes must be between 2 and %d\n", SIM_MAX_NODES);
+        exit(1);
+    }
+    if (config.bandwidth <= 0 || config.interval_ms <= 0 || config.sync_blocks < 0 || config.mined_blocks < 0)
+    {
+        printf("Invalid simulation parameters\n");
+        exit(1);
+    }
+}
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+
+// Deliver the first message of a link and relay its block if the node did
+// not know it
+void handle_deliver(sim_event_t *event)
+{
+    sim_link_t *link = &links[event->from][event->node];
+    sim_message_t *message = link->head;
+    link->head = message->next;
+    if (link->head)
+    {
+        sim_event_t *next = new_event(SIM_DELIVER, link->head->arrival_us, event->node);
+        next->from = event->from;
+        queue_push(next);
+    }
+    else
+    {
+        link->tail = NULL;
+    }
+
+    // Floods deliver most blocks several times, skip known ones cheaply
+    char *hash = message->data + SIM_MESSAGE_HEADER + 4 + BLOCK_HASH_LENGTH;
+    if (block_tree_find(nodes[event->node]->tree, hash))
+    {
+        free(message->data);
+        free(message);
+        return;
+    }
+
+    size_t consumed;
+    block_t *block = block_deserialize(message->data + SIM_MESSAGE_HEADER, message->length - SIM_MESSAGE_HEADER, &consumed);
+    free(message->data);
+    free(message);
+    if (block == NULL)
+    {
+        printf("Simulated message is truncated\n");
+        exit(1);
+    }
+
+    uint64_t seq;
+    int status = receive_block(nodes[event->node], block, &seq);
+    if (status != BLOCK_ACCEPTED && status != BLOCK_SIDE)
+    {
+        orphans += status == BLOCK_ORPHAN;
+        free(block->previous_hash);
+        free(block->hash);
+        free(block->data);
+        free(block);
+        return;
+    }
+
+    int id = block_id(block);
+    if (id >= 0)
+    {
+        received_us[(long) id * config.nodes + event->node] = now_us;
+    }
+    else if (nodes[event->node]->length == config.sync_blocks + 1)
+    {
+        node_height_reached_us[event->node] = now_us;
+    }
+    relay_block(event->node, event->from, block);
+}
+
+// Mine a block at a node, relay it and schedule the next one
+void handle_mine(sim_event_t *event, int id)
+{
+    char *data = malloc(sizeof(char) * SIM_DATA_SIZE);
+    if (!data)
+    {
+        printf("Error allocating memory for block data\n");
+        exit(1);
+    }
+    // Pad to a realistic payload size
+    snprintf(data, SIM_DATA_SIZE, "mined %d by node %d %0*d", id, event->node, SIM_DATA_SIZE / 2, 0);
+
+    block_t *block = add_block(nodes[event->node], data);
+    mined_us[id] = now_us;
+    mined_by[id] = event->node;
+    received_us[(long) id * config.nodes + event->node] = now_us;
+    relay_block(event->node, -1, block);
+}
+
+// Process events until the queue is empty, mining blocks along the way
+void run_events(int mine)
+{
+    int next_id = 0;
+    if (mine && config.mined_blocks > 0)
+    {
+        queue_push(new_event(SIM_MINE, now_us, rand() % config.nodes));
+    }
+
+    sim_event_t *event;
+    while ((event = queue_pop()) != NULL)
+    {
+        now_us = event->time_us;
+        if (event->type == SIM_DELIVER)
+        {
+            handle_deliver(event);
+        }
+        else
+        {
+            handle_mine(event, next_id++);
+            if (next_id < config.mined_blocks)
+            {
+                // Exponential gaps, like proof of work arrivals
+                uint64_t gap_us = (uint64_t) (-log(1 - random_unit()) * config.interval_ms * 1000);
+                queue_push(new_event(SIM_MINE, now_us + gap_us, rand() % config.nodes));
+            }
+        }
+        free(event);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    parse_arguments(argc, argv);
+    srand(config.seed);
+
+    int n = config.nodes;
+    int m = config.mined_blocks;
+    node_height_reached_us = calloc(n, sizeof(uint64_t));
+    received_us = malloc(sizeof(uint64_t) * (m ? m : 1) * n);
+    mined_us = malloc(sizeof(uint64_t) * (m ? m : 1));
+    mined_by = malloc(sizeof(int) * (m ? m : 1));
+    if (!node_height_reached_us || !received_us || !mined_us || !mined_by)
+    {
+        printf("Error allocating memory for simulation\n");
+        exit(1);
+    }
+    for (long i = 0; i < (long) m * n; i++)
+    {
+        received_us[i] = UINT64_MAX;
+    }
+
+    // Nodes share the genesis block, node 0 starts ahead by sync_blocks
+    for (int i = 0; i < n; i++)
+    {
+        nodes[i] = create_blockchain();
+    }
+    for (int i = 0; i < config.sync_blocks; i++)
+    {
+        char *data = malloc(sizeof(char) * SIM_DATA_SIZE);
+        snprintf(data, SIM_DATA_SIZE, "sync %d %0*d", i, SIM_DATA_SIZE / 2, 0);
+        add_block(nodes[0], data);
+    }
+    build_topology();
+
+    printf("Simulating %d nodes (%s, %.1f ms latency, %.1f ms jitter, %.0f B/s)\n",
+           n, config.topology, config.latency_ms, config.jitter_ms, config.bandwidth);
+
+    // Sync phase: node 0 offers its chain to its neighbours, who relay it
+    uint64_t sync_start_us = now_us;
+    bytes_sent = 0;
+    for (int height = 1; height <= config.sync_blocks; height++)
+    {
+        relay_block(0, -1, nodes[0]->chain[height]);
+    }
+    run_events(0);
+    uint64_t sync_us = 0;
+    for (int i = 1; i < n && config.sync_blocks > 0; i++)
+    {
+        if (nodes[i]->length < config.sync_blocks + 1)
+        {
+            printf("Node %d did not sync\n", i);
+            exit(1);
+        }
+        if (node_height_reached_us[i] - sync_start_us > sync_us)
+        {
+            sync_us = node_height_reached_us[i] - sync_start_us;
+        }
+    }
+    uint64_t sync_bytes = bytes_sent;
+    printf("Sync: %d blocks to %d nodes in %.1f ms, %.0f bytes per block\n",
+           config.sync_blocks, n - 1, sync_us / 1000.0,
+           config.sync_blocks ? (double) sync_bytes / config.sync_blocks : 0);
+
+    // Propagation phase: random nodes mine and flood blocks
+    bytes_sent = 0;
+    run_events(1);
+
+    // Delay from mining to reception, per node and until every node has it
+    uint64_t *delays = malloc(sizeof(uint64_t) * ((long) m * n + 1));
+    uint64_t *full = malloc(sizeof(uint64_t) * (m + 1));
+    if (!delays || !full)
+    {
+        printf("Error allocating memory for results\n");
+        exit(1);
+    }
+    int delay_count = 0;
+    int full_count = 0;
+    for (int id = 0; id < m; id++)
+    {
+        uint64_t slowest = 0;
+        int reached = 0;
+        for (int i = 0; i < n; i++)
+        {
+            uint64_t at = received_us[(long) id * n + i];
+            if (at == UINT64_MAX || i == mined_by[id])
+            {
+                continue;
+            }
+            delays[delay_count++] = at - mined_us[id];
+            slowest = at - mined_us[id] > slowest ? at - mined_us[id] : slowest;
+            reached++;
+        }
+        if (reached == n - 1)
+        {
+            full[full_count++] = slowest;
+        }
+    }
+    qsort(delays, delay_count, sizeof(uint64_t), compare_times);
+    qsort(full, full_count, sizeof(uint64_t), compare_times);
+
+    // Nodes that ended on the same tip as node 0
+    int agreeing = 0;
+    for (int i = 0; i < n; i++)
+    {
+        block_t *tip = nodes[i]->chain[nodes[i]->length - 1];
+        block_t *reference = nodes[0]->chain[nodes[0]->length - 1];
+        agreeing += memcmp(tip->hash, reference->hash, BLOCK_HASH_LENGTH) == 0;
+    }
+
+    printf("Propagation of %d blocks (mean interval %.0f ms):\n", m, config.interval_ms);
+    printf("  node delay     p50 %.1f ms  p90 %.1f ms  p99 %.1f ms  max %.1f ms\n",
+           percentile_ms(delays, delay_count, 50), percentile_ms(delays, delay_count, 90),
+           percentile_ms(delays, delay_count, 99), percentile_ms(delays, delay_count, 100));
+    printf("  all nodes      p50 %.1f ms  p90 %.1f ms  p99 %.1f ms  max %.1f ms\n",
+           percentile_ms(full, full_count, 50), percentile_ms(full, full_count, 90),
+           percentile_ms(full, full_count, 99), percentile_ms(full, full_count, 100));
+    printf("  bytes per block %.0f (%.1f per node)\n",
+           m ? (double) bytes_sent / m : 0, m ? (double) bytes_sent / m / n : 0);
+    printf("  %d/%d nodes on the tip of node 0 at height %d, %d orphans dropped\n",
+           agreeing, n, nodes[0]->length - 1, orphans);
+
+    return 0;
+}
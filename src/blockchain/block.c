@@ -13,11 +13,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <openssl/sha.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <openssl/evp.h>
 #include "block.h"
+#include "../tracing/trace.h"
 
 #define SHA256_DIGEST_LENGTH 32
 
+// Digest context of the calling thread, reused for every hash it computes
+static __thread EVP_MD_CTX *hash_ctx = NULL;
+
 /***********************/
 /*  UTILITY FUNCTIONS  */
 /***********************/
@@ -42,14 +48,75 @@ char *get_ascii_hash(char *hash)
     return hash_string;
 }
 
+// Write data as the body of a JSON string (quotes, backslashes and control
+// characters escaped) to buffer if not NULL, return the bytes needed
+static size_t json_escape(const char *data, char *buffer)
+{
+    size_t length = 0;
+    for (const unsigned char *c = (const unsigned char *) data; *c; c++)
+    {
+        char escape = 0;
+        switch (*c)
+        {
+        case '"': escape = '"'; break;
+        case '\\': escape = '\\'; break;
+        case '\n': escape = 'n'; break;
+        case '\r': escape = 'r'; break;
+        case '\t': escape = 't'; break;
+        }
+        if (escape)
+        {
+            if (buffer)
+            {
+                buffer[length] = '\\';
+                buffer[length + 1] = escape;
+            }
+            length += 2;
+        }
+        else if (*c < 0x20)
+        {
+            if (buffer)
+            {
+                sprintf(buffer + length, "\\u%04x", *c);
+            }
+            length += 6;
+        }
+        else
+        {
+            if (buffer)
+            {
+                buffer[length] = *c;
+            }
+            length++;
+        }
+    }
+    return length;
+}
+
 // Convert block to string representation for printing
 char *block_to_json(block_t *block)
 {
-    // Allocate memory for string
+    // Hashes are raw bytes, print them as hex (genesis has no previous hash)
+    char *previous_hash = block->previous_hash ? get_ascii_hash(block->previous_hash) : NULL;
+    char *hash = block->hash ? get_ascii_hash(block->hash) : NULL;
+
+    // Allocate memory for string, sized for the escaped data
+    size_t data_length = json_escape(block->data, NULL);
     char *json;
-    json = (char *) malloc(sizeof(char) * 1000);
+    json = (char *) malloc(sizeof(char) * (200 + 2 * SHA256_DIGEST_LENGTH * 2 + data_length));
+    if (!json)
+    {
+        printf("Error allocating memory for json\n");
+        exit(1);
+    }
     // Create json string
-    sprintf(json, "{\"timestamp\":%d,\"previous_hash\":\"%s\",\"hash\":\"%s\",\"data\":\"%s\"}", block->timestamp, block->previous_hash, block->hash, block->data);
+    int length = sprintf(json, "{\"timestamp\":%d,\"previous_hash\":\"%s\",\"hash\":\"%s\",\"data\":\"", block->timestamp, previous_hash ? previous_hash : "", hash ? hash : "");
+    json_escape(block->data, json + length);
+    strcpy(json + length + data_length, "\"}");
+
+    free(previous_hash);
+    free(hash);
+
     // Return json string
     return json;
 }
@@ -57,11 +124,7 @@ char *block_to_json(block_t *block)
 // Function to get hash of block
 char *get_hash(block_t *block)
 {
-    struct block_header {
-        int timestamp;
-        char *previous_hash;
-        char *data;
-    };
+    TRACE_SCOPE("hash");
 
     // Allocate memory for hash
     char *hash = malloc(sizeof(char) * SHA256_DIGEST_LENGTH);
@@ -71,27 +134,115 @@ char *get_hash(block_t *block)
         exit(1);
     }
 
-    struct block_header *header = malloc(sizeof(struct block_header));
-    if (!header)
+    // Calculate hash with SHA256 over the block contents, so that the same
+    // block hashes the same after being reloaded from disk
+    if (hash_ctx == NULL && (hash_ctx = EVP_MD_CTX_new()) == NULL)
     {
-        printf("Error allocating memory for header\n");
+        printf("Error allocating memory for hash\n");
         exit(1);
     }
-
-    header->timestamp = block->timestamp;
-    header->previous_hash = block->previous_hash;
-    header->data = block->data;
-
-    // Calculate hash with SHA256
-    SHA256_CTX ctx;
-    SHA256_Init(&ctx);
-    SHA256_Update(&ctx, header, sizeof(struct block_header));
-    SHA256_Final((unsigned char *) hash, &ctx);
+    EVP_DigestInit_ex(hash_ctx, EVP_sha256(), NULL);
+    EVP_DigestUpdate(hash_ctx, &block->timestamp, sizeof(block->timestamp));
+    if (block->previous_hash)
+    {
+        EVP_DigestUpdate(hash_ctx, block->previous_hash, SHA256_DIGEST_LENGTH);
+    }
+    EVP_DigestUpdate(hash_ctx, block->data, strlen(block->data));
+    EVP_DigestFinal_ex(hash_ctx, (unsigned char *) hash, NULL);
 
     // Return hash
     return hash;
 }
 
+// Size of the binary encoding of a block
+size_t block_serialized_size(block_t *block)
+{
+    return BLOCK_HEADER_SIZE + strlen(block->data);
+}
+
+// Write the binary encoding of a block to buffer, return the bytes written.
+// Layout (network byte order): timestamp, previous hash, hash, data length, data.
+// The genesis block has no previous hash and is encoded with zeros.
+size_t block_serialize(block_t *block, char *buffer)
+{
+    uint32_t timestamp = htonl((uint32_t) block->timestamp);
+    uint32_t data_length = strlen(block->data);
+    uint32_t data_length_n = htonl(data_length);
+
+    memcpy(buffer, &timestamp, 4);
+    if (block->previous_hash)
+    {
+        memcpy(buffer + 4, block->previous_hash, SHA256_DIGEST_LENGTH);
+    }
+    else
+    {
+        memset(buffer + 4, 0, SHA256_DIGEST_LENGTH);
+    }
+    if (block->hash)
+    {
+        memcpy(buffer + 36, block->hash, SHA256_DIGEST_LENGTH);
+    }
+    else
+    {
+        memset(buffer + 36, 0, SHA256_DIGEST_LENGTH);
+    }
+    memcpy(buffer + 68, &data_length_n, 4);
+    memcpy(buffer + BLOCK_HEADER_SIZE, block->data, data_length);
+
+    return BLOCK_HEADER_SIZE + data_length;
+}
+
+// Read a block from its binary encoding, NULL if the buffer is truncated.
+// The number of bytes used is stored in consumed.
+block_t *block_deserialize(char *buffer, size_t length, size_t *consumed)
+{
+    if (length < BLOCK_HEADER_SIZE)
+    {
+        return NULL;
+    }
+
+    uint32_t timestamp, data_length;
+    memcpy(&timestamp, buffer, 4);
+    memcpy(&data_length, buffer + 68, 4);
+    data_length = ntohl(data_length);
+    if (length - BLOCK_HEADER_SIZE < data_length)
+    {
+        return NULL;
+    }
+
+    // Allocate memory for block
+    block_t *block = malloc(sizeof(block_t));
+    char *previous_hash = malloc(sizeof(char) * SHA256_DIGEST_LENGTH);
+    char *hash = malloc(sizeof(char) * SHA256_DIGEST_LENGTH);
+    char *data = malloc(sizeof(char) * (data_length + 1));
+    if (!block || !previous_hash || !hash || !data)
+    {
+        printf("Error allocating memory for block\n");
+        exit(1);
+    }
+
+    memcpy(previous_hash, buffer + 4, SHA256_DIGEST_LENGTH);
+    memcpy(hash, buffer + 36, SHA256_DIGEST_LENGTH);
+    memcpy(data, buffer + BLOCK_HEADER_SIZE, data_length);
+    data[data_length] = '\0';
+
+    block->timestamp = (int) ntohl(timestamp);
+    block->hash = hash;
+    block->data = data;
+
+    // An all-zero previous hash marks the genesis block
+    static const char zero_hash[SHA256_DIGEST_LENGTH];
+    if (memcmp(previous_hash, zero_hash, SHA256_DIGEST_LENGTH) == 0)
+    {
+        free(previous_hash);
+        previous_hash = NULL;
+    }
+    block->previous_hash = previous_hash;
+
+    *consumed = BLOCK_HEADER_SIZE + data_length;
+    return block;
+}
+
 /***********************/
 /*    CORE FUNCTIONS   */
 /***********************/
@@ -113,17 +264,19 @@ block_t *get_genesis_block()
     // Set block previous hash
     block->previous_hash = NULL;
 
-    // Set block hash
-    block->hash = NULL;
-
     // Set block data
     block->data = "Genesis block";
 
+    // Set block hash
+    block->hash = get_hash(block);
+
     // Return block
     return block;
 }
 
 block_t *mine_block(block_t *last_block, char *data) {
+    TRACE_SCOPE("mine");
+
     // Allocate memory for block
     block_t *block = malloc(sizeof(block_t));
     if (!block)
@@ -138,12 +291,12 @@ block_t *mine_block(block_t *last_block, char *data) {
     // Set block previous hash
     block->previous_hash = last_block->hash;
 
-    // Set block hash
-    block->hash = 0;
-
     // Set block data
     block->data = data;
 
+    // Set block hash
+    block->hash = get_hash(block);
+
     // Return block
     return block;
 }
\ No newline at end of file
@@ -7,6 +7,14 @@
  * 
  * */
 
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include <stddef.h>
+
+#define BLOCK_HASH_LENGTH 32                            // Length of a raw SHA256 hash
+#define BLOCK_HEADER_SIZE (4 + 2 * BLOCK_HASH_LENGTH + 4)  // Binary encoding without data
+
 /***********************/
 /*   DATA STRUCTURES   */
 /***********************/
@@ -24,9 +32,14 @@ typedef struct block_t {
 char *get_ascii_hash(char *hash);       // Prints hash as a string of ascii characters
 char *block_to_json(block_t *block);    // Convert block to string representation for printing
 char *get_hash(block_t *block);         // Get hash of block
+size_t block_serialized_size(block_t *block);                           // Size of binary encoding
+size_t block_serialize(block_t *block, char *buffer);                   // Write binary encoding
+block_t *block_deserialize(char *buffer, size_t length, size_t *consumed); // Read binary encoding
 
 /***********************/
 /*    CORE FUNCTIONS   */
 /***********************/
 block_t *get_genesis_block();                           // Get genesis block
-block_t *mine_block(block_t *last_block, char *data);    // Mine block
\ No newline at end of file
+block_t *mine_block(block_t *last_block, char *data);    // Mine block
+
+#endif
@@ -0,0 +1,276 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the implementation of the block tree.
+ *
+ * Skip ancestors follow the same height pattern as Bitcoin's CBlockIndex:
+ * each node skips back to a height with fewer trailing ones, so walking back
+ * any distance needs a logarithmic number of jumps.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block_tree.h"
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+
+// Clear the lowest set bit
+static int invert_lowest_one(int n)
+{
+    return n & (n - 1);
+}
+
+// Height the skip pointer of a node at height points to
+static int skip_height(int height)
+{
+    if (height < 2)
+    {
+        return 0;
+    }
+    // Odd heights jump a little less far than even ones so that walks from
+    // neighbouring heights do not keep landing on the same nodes
+    return (height & 1) ? invert_lowest_one(invert_lowest_one(height - 1)) + 1 : invert_lowest_one(height);
+}
+
+// Slot of the node table where a hash lives or would be inserted
+static int node_slot(block_tree_t *tree, char *hash)
+{
+    uint64_t key;
+    memcpy(&key, hash, sizeof(key));
+    int mask = tree->capacity - 1;
+    int slot = (int) (key & mask);
+
+    // Linear probing until the hash or an empty slot is found, comparing
+    // keys in the table before touching the nodes
+    while (tree->nodes[slot].node &&
+           (tree->nodes[slot].key != key || memcmp(tree->nodes[slot].node->block->hash, hash, BLOCK_HASH_LENGTH) != 0))
+    {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Double the node table
+static void nodes_grow(block_tree_t *tree)
+{
+    tree_slot_t *old = tree->nodes;
+    int old_capacity = tree->capacity;
+
+    tree->capacity *= 2;
+    tree->nodes = (tree_slot_t *) calloc(tree->capacity, sizeof(tree_slot_t));
+    if (!tree->nodes)
+    {
+        printf("Error allocating memory for block tree\n");
+        exit(1);
+    }
+    for (int i = 0; i < old_capacity; i++)
+    {
+        if (old[i].node)
+        {
+            tree->nodes[node_slot(tree, old[i].node->block->hash)] = old[i];
+        }
+    }
+    free(old);
+}
+
+// Tips with height and work as JSON, marking the active one
+char *block_tree_tips_to_json(block_tree_t *tree, tree_node_t *active)
+{
+    char *json = malloc(sizeof(char) * (64 + 160 * tree->tips_count));
+    if (!json)
+    {
+        printf("Error allocating memory for tips\n");
+        exit(1);
+    }
+
+    int length = sprintf(json, "[");
+    for (int i = 0; i < tree->tips_count; i++)
+    {
+        tree_node_t *tip = tree->tips[i];
+        char *hash = get_ascii_hash(tip->block->hash);
+        int fork = block_tree_common_ancestor(tip, active)->height;
+        length += sprintf(json + length, "%s{\"hash\":\"%s\",\"height\":%d,\"work\":%llu,\"fork_height\":%d,\"active\":%s}",
+                          i ? "," : "", hash, tip->height, (unsigned long long) tip->work, fork,
+                          tip == active ? "true" : "false");
+        free(hash);
+    }
+    sprintf(json + length, "]");
+
+    return json;
+}
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+
+// Create a tree holding the blocks of a linear chain starting at genesis
+block_tree_t *block_tree_create(block_t **chain, int length)
+{
+    block_tree_t *tree = (block_tree_t *) calloc(1, sizeof(block_tree_t));
+    if (!tree)
+    {
+        printf("Error allocating memory for block tree\n");
+        exit(1);
+    }
+
+    tree->capacity = BLOCK_TREE_CAPACITY;
+    tree->nodes = (tree_slot_t *) calloc(tree->capacity, sizeof(tree_slot_t));
+    if (!tree->nodes)
+    {
+        printf("Error allocating memory for block tree\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < length; i++)
+    {
+        if (block_tree_insert(tree, chain[i]) == NULL)
+        {
+            printf("Block %d does not extend the chain\n", i);
+            exit(1);
+        }
+    }
+
+    return tree;
+}
+
+// Node of the block with the given hash, NULL if it is not in the tree
+tree_node_t *block_tree_find(block_tree_t *tree, char *hash)
+{
+    return tree->nodes[node_slot(tree, hash)].node;
+}
+
+// Add a block whose parent is in the tree (or the genesis block of an empty
+// tree). Return its node, the existing node if the block is already known,
+// or NULL if the parent is unknown.
+tree_node_t *block_tree_insert(block_tree_t *tree, block_t *block)
+{
+    int slot = node_slot(tree, block->hash);
+    if (tree->nodes[slot].node)
+    {
+        return tree->nodes[slot].node;
+    }
+
+    tree_node_t *parent = NULL;
+    if (block->previous_hash)
+    {
+        parent = block_tree_find(tree, block->previous_hash);
+        if (parent == NULL)
+        {
+            return NULL;
+        }
+    }
+    else if (tree->count > 0)
+    {
+        return NULL;
+    }
+
+    // Grow at half load
+    if ((tree->count + 1) * 2 > tree->capacity)
+    {
+        nodes_grow(tree);
+        slot = node_slot(tree, block->hash);
+    }
+
+    tree_node_t *node = (tree_node_t *) malloc(sizeof(tree_node_t));
+    if (!node)
+    {
+        printf("Error allocating memory for tree node\n");
+        exit(1);
+    }
+    node->block = block;
+    node->parent = parent;
+    node->height = parent ? parent->height + 1 : 0;
+    node->work = (parent ? parent->work : 0) + BLOCK_TREE_BLOCK_WORK;
+    node->skip = parent ? block_tree_ancestor(parent, skip_height(node->height)) : NULL;
+    memcpy(&tree->nodes[slot].key, block->hash, sizeof(uint64_t));
+    tree->nodes[slot].node = node;
+    tree->count++;
+
+    // The new node replaces its parent as a tip, or starts a new branch
+    int i = 0;
+    while (i < tree->tips_count && tree->tips[i] != parent)
+    {
+        i++;
+    }
+    if (i == tree->tips_count)
+    {
+        if (tree->tips_count == tree->tips_capacity)
+        {
+            tree->tips_capacity = tree->tips_capacity ? tree->tips_capacity * 2 : 4;
+            tree->tips = realloc(tree->tips, sizeof(tree_node_t *) * tree->tips_capacity);
+            if (!tree->tips)
+            {
+                printf("Error allocating memory for tips\n");
+                exit(1);
+            }
+        }
+        tree->tips_count++;
+    }
+    tree->tips[i] = node;
+
+    return node;
+}
+
+// Ancestor of node at height (node itself if height is its own), taking skip
+// pointers whenever they do not overshoot
+tree_node_t *block_tree_ancestor(tree_node_t *node, int height)
+{
+    if (height > node->height || height < 0)
+    {
+        return NULL;
+    }
+
+    tree_node_t *walk = node;
+    while (walk->height > height)
+    {
+        int skip = skip_height(walk->height);
+        int skip_previous = skip_height(walk->height - 1);
+        // Take the skip unless the parent's skip lands closer to height
+        if (walk->skip && (skip == height || (skip > height && !(skip_previous < skip - 2 && skip_previous >= height))))
+        {
+            walk = walk->skip;
+        }
+        else
+        {
+            walk = walk->parent;
+        }
+    }
+    return walk;
+}
+
+// Last node shared by the branches ending at a and b
+tree_node_t *block_tree_common_ancestor(tree_node_t *a, tree_node_t *b)
+{
+    // Bring both to the same height
+    if (a->height > b->height)
+    {
+        a = block_tree_ancestor(a, b->height);
+    }
+    else if (b->height > a->height)
+    {
+        b = block_tree_ancestor(b, a->height);
+    }
+
+    // Nodes at the same height have skips at the same height, so jump
+    // together while the skips still differ
+    while (a != b)
+    {
+        if (a->skip && a->skip != b->skip)
+        {
+            a = a->skip;
+            b = b->skip;
+        }
+        else
+        {
+            a = a->parent;
+            b = b->parent;
+        }
+    }
+    return a;
+}
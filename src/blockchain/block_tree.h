@@ -0,0 +1,67 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the definition of the block tree.
+ *
+ * The tree keeps every known block, including side branches, with the
+ * cumulative work of the branch ending at it. Every node also points to a
+ * skip ancestor chosen so that any ancestor, and the common ancestor of two
+ * nodes, is found in O(log n) steps.
+ *
+ * Blocks carry no difficulty yet, so each one counts BLOCK_TREE_BLOCK_WORK
+ * and the heaviest tip is the longest one (ties keep the first seen).
+ *
+ * */
+
+#ifndef BLOCK_TREE_H
+#define BLOCK_TREE_H
+
+#include <stdint.h>
+#include "block.h"
+
+#define BLOCK_TREE_CAPACITY 1024        // Initial slots of the node table (power of two)
+#define BLOCK_TREE_BLOCK_WORK 1         // Work contributed by one block
+
+/***********************/
+/*   DATA STRUCTURES   */
+/***********************/
+
+typedef struct tree_node_t {
+    block_t *block;                 // Block of this node
+    struct tree_node_t *parent;     // Node of the previous block, NULL for genesis
+    struct tree_node_t *skip;       // Ancestor used to jump back quickly
+    int height;                     // Height of the block
+    uint64_t work;                  // Cumulative work from genesis
+} tree_node_t;
+
+typedef struct tree_slot_t {
+    uint64_t key;                   // First bytes of the block hash, checked before the node
+    tree_node_t *node;              // Node in this slot, NULL if empty
+} tree_slot_t;
+
+typedef struct block_tree_t {
+    tree_slot_t *nodes;             // Node table by block hash, open addressing
+    int capacity;                   // Slots in nodes (power of two)
+    int count;                      // Nodes in the tree
+    tree_node_t **tips;             // Nodes without children
+    int tips_count;                 // Tips used
+    int tips_capacity;              // Tips allocated
+} block_tree_t;
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+char *block_tree_tips_to_json(block_tree_t *tree, tree_node_t *active);        // Tips with height and work as JSON
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+block_tree_t *block_tree_create(block_t **chain, int length);                  // Tree holding a linear chain
+tree_node_t *block_tree_find(block_tree_t *tree, char *hash);                  // Node of a block hash, NULL if unknown
+tree_node_t *block_tree_insert(block_tree_t *tree, block_t *block);            // Add a block whose parent is known, NULL otherwise
+tree_node_t *block_tree_ancestor(tree_node_t *node, int height);               // Ancestor of node at height
+tree_node_t *block_tree_common_ancestor(tree_node_t *a, tree_node_t *b);       // Last node shared by two branches
+
+#endif
@@ -11,39 +11,385 @@
 
 #include "blockchain.h"
 #include "utils.h"
+#include "block_tree.h"
+#include "../networking/response_cache.h"
+#include "../networking/subscriptions.h"
+#include "../pool/thread_pool.h"
+#include "../search/search_index.h"
+#include "../storage/payload_cache.h"
+#include "../storage/wal.h"
+#include "../tracing/trace.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <arpa/inet.h>
 
 /***********************/
 /*  UTILITY FUNCTIONS  */
 /***********************/
 
+typedef struct render_t {
+    blockchain_t *blockchain;       // Chain being rendered
+    int first;                      // Height of the first block
+    char **json;                    // Json of each block
+} render_t;
+
+typedef struct encode_t {
+    blockchain_t *blockchain;       // Chain being encoded
+    int first;                      // Height of the first block
+    char *buffer;                   // Response being written
+    size_t *offsets;                // Offset of each block in buffer
+} encode_t;
+
+typedef struct verify_t {
+    block_t **blocks;               // Blocks to hash
+    int *statuses;                  // BLOCK_INVALID where the hash does not match
+} verify_t;
+
 // Blockchain to json
 char *blockchain_to_json(blockchain_t *blockchain) {
+    return blockchain_range_to_json(blockchain, 0, -1, NULL);
+}
+
+// ETag of the chain, the tip height and hash (the lock must be held)
+static void etag_locked(blockchain_t *blockchain, char *etag) {
+    char *hash = get_ascii_hash(blockchain->chain[blockchain->length - 1]->hash);
+    sprintf(etag, "\"%d-%s\"", blockchain->length - 1, hash);
+    free(hash);
+}
+
+// Render blocks from..to-1 of a range as json, with their data paged in if
+// pruned (runs on the thread pool under the caller's read lock)
+static void render_blocks(int from, int to, void *arg) {
+    render_t *render = (render_t *) arg;
+    for (int i = from; i < to; i++) {
+        block_t block = *render->blockchain->chain[render->first + i];
+        block.data = get_block_data(render->blockchain, render->first + i);
+        render->json[i] = block_to_json(&block);
+        free(block.data);
+    }
+}
+
+// Blocks from height from to height to (-1 for the tip) as json. If etag is
+// not NULL it receives the ETag of the chain the blocks were read from.
+char *blockchain_range_to_json(blockchain_t *blockchain, int from, int to, char *etag) {
+    TRACE_SCOPE("serialize");
+
+    pthread_rwlock_rdlock(&blockchain->lock);
+    if (to < 0 || to >= blockchain->length) {
+        to = blockchain->length - 1;
+    }
+    if (from < 0) {
+        from = 0;
+    }
+    if (etag) {
+        etag_locked(blockchain, etag);
+    }
+
+    // Render the blocks on the thread pool
+    int count = to >= from ? to - from + 1 : 0;
+    char **blocks_json = (char **) malloc(sizeof(char *) * (count > 0 ? count : 1));
+    if (!blocks_json) {
+        printf("Error allocating memory for json\n");
+        exit(1);
+    }
+    render_t render = {blockchain, from, blocks_json};
+    pool_parallel_for(0, count, BLOCKCHAIN_RENDER_GRAIN, render_blocks, &render);
+
     // Allocate memory for string to allocate all the blocks
-    char *json;
-    json = (char *) malloc(sizeof(char) * 1000 * blockchain->length);
+    size_t total = 3;
+    for (int i = 0; i < count; i++) {
+        total += strlen(blocks_json[i]) + 1;
+    }
+    char *json = (char *) malloc(sizeof(char) * total);
+    if (!json) {
+        printf("Error allocating memory for json\n");
+        exit(1);
+    }
+    size_t length = 0;
 
-    strcat(json, "[");
-    // Iterate over the blocks
-    for (int i = 0; i < blockchain->length; i++) {
-        // Add the block to the string
-        strcat(json, block_to_json(blockchain->chain[i]));
+    json[length++] = '[';
+    // Join the blocks
+    for (int i = 0; i < count; i++) {
+        size_t block_length = strlen(blocks_json[i]);
+        memcpy(json + length, blocks_json[i], block_length);
+        length += block_length;
+        free(blocks_json[i]);
         // Add a comma if it is not the last block
-        if (i != blockchain->length - 1) {
-            strcat(json, ",");
+        if (i != count - 1) {
+            json[length++] = ',';
         }
     }
+    free(blocks_json);
     // Close the json string
-    strcat(json, "]");
-
-    // Add terminator to the string
-    // strcat(json, "\0");
+    json[length++] = ']';
+    json[length] = '\0';
+    pthread_rwlock_unlock(&blockchain->lock);
 
     return json;
 }
 
+// Write the binary encoding of blocks from..to-1 of a range at their offsets,
+// with their data paged in if pruned (runs on the thread pool under the
+// caller's read lock)
+static void encode_blocks(int from, int to, void *arg) {
+    encode_t *encode = (encode_t *) arg;
+    for (int i = from; i < to; i++) {
+        block_t block = *encode->blockchain->chain[encode->first + i];
+        block.data = get_block_data(encode->blockchain, encode->first + i);
+        block_serialize(&block, encode->buffer + encode->offsets[i]);
+        free(block.data);
+    }
+}
+
+// Blocks from height from to height to (-1 for the tip) in binary: first
+// height (4) | block count (4), in network byte order, then every block in
+// the encoding of block_serialize (raw hashes, length-prefixed data). The
+// size is stored in length; etag works as in blockchain_range_to_json.
+char *blockchain_range_to_binary(blockchain_t *blockchain, int from, int to, char *etag, size_t *length) {
+    TRACE_SCOPE("serialize");
+
+    pthread_rwlock_rdlock(&blockchain->lock);
+    if (to < 0 || to >= blockchain->length) {
+        to = blockchain->length - 1;
+    }
+    if (from < 0) {
+        from = 0;
+    }
+    if (etag) {
+        etag_locked(blockchain, etag);
+    }
+
+    // Lay out the blocks from their data lengths, without paging data in
+    int count = to >= from ? to - from + 1 : 0;
+    size_t *offsets = (size_t *) malloc(sizeof(size_t) * (count + 1));
+    if (!offsets) {
+        printf("Error allocating memory for blocks\n");
+        exit(1);
+    }
+    offsets[0] = BLOCKCHAIN_BINARY_HEADER_SIZE;
+    for (int i = 0; i < count; i++) {
+        block_t *block = blockchain->chain[from + i];
+        size_t data_length = block->data ? strlen(block->data) : payload_cache_length(blockchain->payloads, from + i);
+        offsets[i + 1] = offsets[i] + BLOCK_HEADER_SIZE + data_length;
+    }
+
+    char *buffer = (char *) malloc(offsets[count]);
+    if (!buffer) {
+        printf("Error allocating memory for blocks\n");
+        exit(1);
+    }
+    uint32_t first_n = htonl((uint32_t) from);
+    uint32_t count_n = htonl((uint32_t) count);
+    memcpy(buffer, &first_n, 4);
+    memcpy(buffer + 4, &count_n, 4);
+
+    // Encode the blocks on the thread pool
+    encode_t encode = {blockchain, from, buffer, offsets};
+    pool_parallel_for(0, count, BLOCKCHAIN_RENDER_GRAIN, encode_blocks, &encode);
+    pthread_rwlock_unlock(&blockchain->lock);
+
+    *length = offsets[count];
+    free(offsets);
+
+    return buffer;
+}
+
+// Slot of the hash index where a hash lives or would be inserted
+static int index_slot(blockchain_t *blockchain, char *hash) {
+    uint64_t key;
+    memcpy(&key, hash, sizeof(key));
+    int mask = blockchain->index_capacity - 1;
+    int slot = (int) (key & mask);
+
+    // Linear probing until the hash or an empty slot is found
+    while (blockchain->index[slot] != 0) {
+        block_t *block = blockchain->chain[blockchain->index[slot] - 1];
+        if (memcmp(block->hash, hash, BLOCK_HASH_LENGTH) == 0) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Rebuild the hash index with the given capacity
+static void index_rebuild(blockchain_t *blockchain, int capacity) {
+    while (capacity < (blockchain->length + 1) * 2) {
+        capacity *= 2;
+    }
+
+    free(blockchain->index);
+    blockchain->index = (int *) calloc(capacity, sizeof(int));
+    if (!blockchain->index) {
+        printf("Error allocating memory for hash index\n");
+        exit(1);
+    }
+    blockchain->index_capacity = capacity;
+
+    for (int i = 0; i < blockchain->length; i++) {
+        blockchain->index[index_slot(blockchain, blockchain->chain[i]->hash)] = i + 1;
+    }
+}
+
+// Rebuild the hash index of a chain restored from elsewhere (e.g. a snapshot)
+void blockchain_rebuild_index(blockchain_t *blockchain) {
+    index_rebuild(blockchain, BLOCKCHAIN_INDEX_CAPACITY);
+}
+
+// Add the block at height to the hash index, growing it at half load
+static void index_insert(blockchain_t *blockchain, int height) {
+    if ((height + 1) * 2 > blockchain->index_capacity) {
+        index_rebuild(blockchain, blockchain->index_capacity * 2);
+        return;
+    }
+    blockchain->index[index_slot(blockchain, blockchain->chain[height]->hash)] = height + 1;
+}
+
+// Remove the block at height from the hash index, shifting back the entries
+// that probed past its slot so that lookups still find them
+static void index_remove(blockchain_t *blockchain, int height) {
+    int mask = blockchain->index_capacity - 1;
+    int slot = index_slot(blockchain, blockchain->chain[height]->hash);
+    blockchain->index[slot] = 0;
+
+    int next = (slot + 1) & mask;
+    while (blockchain->index[next] != 0) {
+        uint64_t key;
+        memcpy(&key, blockchain->chain[blockchain->index[next] - 1]->hash, sizeof(key));
+        int home = (int) (key & mask);
+        // Move the entry into the hole unless its home lies in (slot, next]
+        int reachable = slot <= next ? (home > slot && home <= next) : (home > slot || home <= next);
+        if (!reachable) {
+            blockchain->index[slot] = blockchain->index[next];
+            blockchain->index[next] = 0;
+            slot = next;
+        }
+        next = (next + 1) & mask;
+    }
+}
+
+// Height of the block with the given hash, -1 if it is not in the chain
+int blockchain_find(blockchain_t *blockchain, char *hash) {
+    pthread_rwlock_rdlock(&blockchain->lock);
+    int height = blockchain->index[index_slot(blockchain, hash)] - 1;
+    pthread_rwlock_unlock(&blockchain->lock);
+
+    return height;
+}
+
+// Copy of the data of the block at height, paged in from the payload file
+// if it was pruned. The chain lock must be held; the caller frees the copy.
+char *get_block_data(blockchain_t *blockchain, int height) {
+    block_t *block = blockchain->chain[height];
+    if (block->data) {
+        return strdup(block->data);
+    }
+    return payload_cache_get(blockchain->payloads, height);
+}
+
+// Number of leading blocks of the active chain that are durable, the lock
+// must be held. Streams stop there so they never announce a block that a
+// crash could still take back.
+int blockchain_durable_length(blockchain_t *blockchain) {
+    if (blockchain->wal == NULL) {
+        return blockchain->length;
+    }
+    return wal_durable_length(blockchain->wal, blockchain->length);
+}
+
+// Append a block to the chain, the write lock must be held
+static void append_block_locked(blockchain_t *blockchain, block_t *block) {
+    blockchain->chain = (block_t **) realloc(blockchain->chain, sizeof(block_t *) * (blockchain->length + 1));
+    blockchain->chain[blockchain->length] = block;
+    blockchain->length++;
+
+    index_insert(blockchain, blockchain->length - 1);
+    if (blockchain->search) {
+        search_index_add(blockchain->search, blockchain->length - 1, block->data);
+    }
+    block_tree_insert(blockchain->tree, block);
+    if (blockchain->responses) {
+        char etag[BLOCKCHAIN_ETAG_SIZE];
+        etag_locked(blockchain, etag);
+        response_cache_update(blockchain->responses, etag);
+    }
+}
+
+// Append a block to the chain and log it, the write lock must be held.
+// Return its WAL sequence number (0 if not logged).
+static uint64_t extend_locked(blockchain_t *blockchain, block_t *block) {
+    uint64_t seq = 0;
+
+    append_block_locked(blockchain, block);
+    // Logged under the write lock so records are in height order
+    if (blockchain->wal) {
+        seq = wal_append(blockchain->wal, block, blockchain->length - 1, 0);
+    }
+    // In pruning mode only the header stays in memory
+    if (blockchain->payloads) {
+        payload_cache_put(blockchain->payloads, blockchain->length - 1, block->data, block->hash);
+        block->data = NULL;
+    }
+    return seq;
+}
+
+// Make the branch ending at tip the active chain, the write lock must be held.
+// Only the blocks past the fork point are unwound and appended, so a reorg
+// costs as much as its depth. Return the WAL sequence number of the last block.
+static uint64_t switch_tip_locked(blockchain_t *blockchain, tree_node_t *tip) {
+    TRACE_SCOPE("reorg");
+
+    tree_node_t *active = block_tree_find(blockchain->tree, blockchain->chain[blockchain->length - 1]->hash);
+    tree_node_t *fork = block_tree_common_ancestor(active, tip);
+
+    // Unwind the active blocks past the fork, they stay in the tree as a
+    // side branch (with their payloads back in memory)
+    for (int height = blockchain->length - 1; height > fork->height; height--) {
+        block_t *block = blockchain->chain[height];
+        if (!block->data) {
+            block->data = payload_cache_get(blockchain->payloads, height);
+        }
+        index_remove(blockchain, height);
+        blockchain->length--;
+    }
+    if (blockchain->search) {
+        search_index_truncate(blockchain->search, blockchain->length);
+    }
+
+    // Append the new branch from the fork on
+    int depth = tip->height - fork->height;
+    block_t **branch = (block_t **) malloc(sizeof(block_t *) * depth);
+    if (!branch) {
+        printf("Error allocating memory for reorg\n");
+        exit(1);
+    }
+    tree_node_t *node = tip;
+    for (int i = depth - 1; i >= 0; i--) {
+        branch[i] = node->block;
+        node = node->parent;
+    }
+    uint64_t seq = 0;
+    for (int i = 0; i < depth; i++) {
+        seq = extend_locked(blockchain, branch[i]);
+    }
+    free(branch);
+
+    if (active->height > fork->height) {
+        printf("Switched to tip at height %d (fork at %d, %d blocks unwound)\n", tip->height, fork->height, active->height - fork->height);
+    }
+    return seq;
+}
+
+// Free a block that was not added to the chain
+static void free_block(block_t *block) {
+    free(block->previous_hash);
+    free(block->hash);
+    free(block->data);
+    free(block);
+}
+
 blockchain_t *create_blockchain() {
     blockchain_t *blockchain = (blockchain_t *) malloc(sizeof(blockchain_t));
     blockchain->chain = (block_t **) malloc(sizeof(block_t *));
@@ -51,40 +397,271 @@ blockchain_t *create_blockchain() {
 
     blockchain->length = 1;
 
+    blockchain->index = NULL;
+    index_rebuild(blockchain, BLOCKCHAIN_INDEX_CAPACITY);
+    pthread_rwlock_init(&blockchain->lock, NULL);
+    blockchain->wal = NULL;
+    blockchain->payloads = NULL;
+    blockchain->search = NULL;
+    blockchain->subscriptions = NULL;
+    blockchain->responses = NULL;
+    blockchain->tree = block_tree_create(blockchain->chain, blockchain->length);
+
     return blockchain;
 }
 
 block_t *add_block(blockchain_t *blockchain, char *data) {
-    block_t *new_block = mine_block((blockchain->chain[blockchain->length - 1]), data);
-    blockchain->chain = (block_t **) realloc(blockchain->chain, sizeof(block_t *) * (blockchain->length + 1));
-    blockchain->chain[blockchain->length] = new_block;
-    blockchain->length++;
+    uint64_t seq;
+    int height;
+    block_t *new_block = add_block_no_wait(blockchain, data, &seq, &height);
+    wait_block_durable(blockchain, seq);
 
     return new_block;
 }
 
+// Add block and log it without waiting for the log to reach the disk, so
+// that blocks added back to back share one sync (see wait_block_durable).
+// The height is taken under the write lock: a reorg may move the block off
+// the active chain before the caller looks it up.
+block_t *add_block_no_wait(blockchain_t *blockchain, char *data, uint64_t *seq, int *height) {
+    TRACE_SCOPE("append");
+
+    *seq = 0;
+
+    // Mine without holding the lock so readers are never blocked by mining,
+    // then retry if another block was appended in the meantime
+    while (1) {
+        pthread_rwlock_rdlock(&blockchain->lock);
+        block_t *last_block = blockchain->chain[blockchain->length - 1];
+        pthread_rwlock_unlock(&blockchain->lock);
+
+        block_t *new_block = mine_block(last_block, data);
+
+        pthread_rwlock_wrlock(&blockchain->lock);
+        if (blockchain->chain[blockchain->length - 1] == last_block) {
+            *seq = extend_locked(blockchain, new_block);
+            *height = blockchain->length - 1;
+            pthread_rwlock_unlock(&blockchain->lock);
+            return new_block;
+        }
+        pthread_rwlock_unlock(&blockchain->lock);
+
+        free(new_block->hash);
+        free(new_block);
+    }
+}
+
+// Wait until every block logged up to seq is durable, then wake the
+// subscribers so that streams only announce committed blocks
+void wait_block_durable(blockchain_t *blockchain, uint64_t seq) {
+    if (blockchain->wal && seq > 0) {
+        wal_wait(blockchain->wal, seq);
+    }
+    if (blockchain->subscriptions) {
+        subscriptions_publish(blockchain->subscriptions);
+    }
+}
+
+// Append a block that is already mined (e.g. loaded from disk)
+void append_block(blockchain_t *blockchain, block_t *block) {
+    pthread_rwlock_wrlock(&blockchain->lock);
+    append_block_locked(blockchain, block);
+    pthread_rwlock_unlock(&blockchain->lock);
+}
+
+// Check the hashes of blocks from..to-1 against their contents, skipping
+// those already marked (runs on the thread pool)
+static void verify_blocks(int from, int to, void *arg) {
+    verify_t *verify = (verify_t *) arg;
+    for (int i = from; i < to; i++) {
+        if (verify->statuses[i] != BLOCK_ACCEPTED) {
+            continue;
+        }
+        char *hash = get_hash(verify->blocks[i]);
+        if (memcmp(verify->blocks[i]->hash, hash, BLOCK_HASH_LENGTH) != 0) {
+            verify->statuses[i] = BLOCK_INVALID;
+        }
+        free(hash);
+    }
+}
+
+// Add a block received from anywhere in the tree (e.g. a peer or the log).
+// The active chain switches to the block's branch if it has more work.
+// Takes ownership of the block unless it is known, orphan or invalid.
+int receive_block(blockchain_t *blockchain, block_t *block, uint64_t *seq) {
+    int status;
+    receive_blocks(blockchain, &block, 1, &status, seq);
+    return status;
+}
+
+// Add a batch of blocks in order, as if each went through receive_block.
+// Their hashes are checked in parallel before taking the write lock. Set
+// the status of each block and the WAL sequence number of the last logged.
+void receive_blocks(blockchain_t *blockchain, block_t **blocks, int count, int *statuses, uint64_t *seq) {
+    *seq = 0;
+
+    // Known blocks (e.g. replayed after a snapshot) are not hashed again
+    pthread_rwlock_rdlock(&blockchain->lock);
+    for (int i = 0; i < count; i++) {
+        statuses[i] = block_tree_find(blockchain->tree, blocks[i]->hash) ? BLOCK_KNOWN : BLOCK_ACCEPTED;
+    }
+    pthread_rwlock_unlock(&blockchain->lock);
+
+    // Check the hashes against the contents before taking the write lock
+    verify_t verify = {blocks, statuses};
+    pool_parallel_for(0, count, BLOCKCHAIN_VERIFY_GRAIN, verify_blocks, &verify);
+
+    pthread_rwlock_wrlock(&blockchain->lock);
+    for (int i = 0; i < count; i++) {
+        if (statuses[i] != BLOCK_ACCEPTED) {
+            continue;
+        }
+        if (block_tree_find(blockchain->tree, blocks[i]->hash)) {
+            statuses[i] = BLOCK_KNOWN;
+            continue;
+        }
+        tree_node_t *node = block_tree_insert(blockchain->tree, blocks[i]);
+        if (node == NULL) {
+            statuses[i] = BLOCK_ORPHAN;
+            continue;
+        }
+
+        statuses[i] = BLOCK_SIDE;
+        uint64_t block_seq = 0;
+        tree_node_t *active = block_tree_find(blockchain->tree, blockchain->chain[blockchain->length - 1]->hash);
+        if (node->work > active->work) {
+            block_seq = switch_tip_locked(blockchain, node);
+            statuses[i] = BLOCK_ACCEPTED;
+        } else if (blockchain->wal) {
+            // Side blocks are logged too, so a restart rebuilds the same tree
+            block_seq = wal_append(blockchain->wal, blocks[i], node->height, 1);
+        }
+        if (block_seq > *seq) {
+            *seq = block_seq;
+        }
+    }
+    pthread_rwlock_unlock(&blockchain->lock);
+}
+
+// Competing tips with their height, work and fork point as JSON
+char *blockchain_tips_to_json(blockchain_t *blockchain) {
+    pthread_rwlock_rdlock(&blockchain->lock);
+    tree_node_t *active = block_tree_find(blockchain->tree, blockchain->chain[blockchain->length - 1]->hash);
+    char *json = block_tree_tips_to_json(blockchain->tree, active);
+    pthread_rwlock_unlock(&blockchain->lock);
+
+    return json;
+}
+
+// Switch to pruning mode: move the payloads of all blocks but genesis to the
+// payload cache and keep only headers in memory from now on
+void enable_pruning(blockchain_t *blockchain, struct payload_cache_t *payloads) {
+    pthread_rwlock_wrlock(&blockchain->lock);
+    for (int i = 1; i < blockchain->length; i++) {
+        block_t *block = blockchain->chain[i];
+        if (block->data) {
+            payload_cache_put(payloads, i, block->data, block->hash);
+            block->data = NULL;
+        }
+    }
+    blockchain->payloads = payloads;
+    pthread_rwlock_unlock(&blockchain->lock);
+}
+
+// Build the search index over the blocks already in the chain and keep it
+// up to date as blocks are added
+void enable_search(blockchain_t *blockchain, struct search_index_t *search) {
+    pthread_rwlock_wrlock(&blockchain->lock);
+    for (int i = 0; i < blockchain->length; i++) {
+        char *data = get_block_data(blockchain, i);
+        search_index_add(search, i, data);
+        free(data);
+    }
+    blockchain->search = search;
+    pthread_rwlock_unlock(&blockchain->lock);
+}
+
+void enable_response_cache(blockchain_t *blockchain, struct response_cache_t *responses) {
+    char etag[BLOCKCHAIN_ETAG_SIZE];
+    pthread_rwlock_wrlock(&blockchain->lock);
+    etag_locked(blockchain, etag);
+    response_cache_update(responses, etag);
+    blockchain->responses = responses;
+    pthread_rwlock_unlock(&blockchain->lock);
+}
+
 bool is_chain_valid(block_t **chain, int length) {
-    if(chain[0] != get_genesis_block()) { // Genesis block must be the first block
-        return FALSE;
+    return is_chain_valid_from(chain, length, 0);
+}
+
+// Validate only the blocks from the given height on, trusting the ones before
+// (e.g. restored from a verified snapshot)
+bool is_chain_valid_from(block_t **chain, int length, int from) {
+    TRACE_SCOPE("validate");
+
+    if(from == 0) { // Genesis block must be the first block
+        block_t *genesis = get_genesis_block();
+        int same = memcmp(chain[0]->hash, genesis->hash, BLOCK_HASH_LENGTH) == 0;
+        free(genesis->hash);
+        free(genesis);
+        if(!same) {
+            return FALSE;
+        }
+        from = 1;
     }
 
-    for(int i = 1; i < length; i++) {
+    // Check the links first, they are cheap
+    for(int i = from; i < length; i++) {
         block_t *block = chain[i];
         block_t *last_block = chain[i-1];
 
         // Check if the block previous hash is the hash of the previous block
-        if(strcmp(block->previous_hash, get_hash(last_block)) != 0) {
+        if(!block->previous_hash || memcmp(block->previous_hash, last_block->hash, BLOCK_HASH_LENGTH) != 0) {
             return FALSE;
         }
     }
 
-    return TRUE;
+    // Check if the block hashes match their contents, on the thread pool
+    if(length <= from) {
+        return TRUE;
+    }
+    int *statuses = (int *) calloc(length - from, sizeof(int));
+    if(!statuses) {
+        printf("Error allocating memory for validation\n");
+        exit(1);
+    }
+    verify_t verify = {chain + from, statuses};
+    pool_parallel_for(0, length - from, BLOCKCHAIN_VERIFY_GRAIN, verify_blocks, &verify);
+    bool valid = TRUE;
+    for(int i = 0; i < length - from; i++) {
+        if(statuses[i] != BLOCK_ACCEPTED) {
+            valid = FALSE;
+            break;
+        }
+    }
+    free(statuses);
+
+    return valid;
 }
 
+// Adopt another copy of the chain (e.g. from a peer). Its blocks go through
+// the tree, so known blocks are skipped and only a heavier branch replaces
+// the diverging part of the active chain.
 void replace_chain(block_t **new_chain, int new_length, blockchain_t *blockchain) {
-    if(new_length > blockchain->length && is_chain_valid(new_chain, new_length)) {
-        free(blockchain->chain);
-        blockchain->chain = new_chain;
-        blockchain->length = new_length;
+    int *statuses = (int *) malloc(sizeof(int) * (new_length > 0 ? new_length : 1));
+    if (!statuses) {
+        printf("Error allocating memory for chain\n");
+        exit(1);
+    }
+    uint64_t last_seq;
+    receive_blocks(blockchain, new_chain, new_length, statuses, &last_seq);
+    for (int i = 0; i < new_length; i++) {
+        if (statuses[i] != BLOCK_ACCEPTED && statuses[i] != BLOCK_SIDE) {
+            free_block(new_chain[i]);
+        }
     }
-}
\ No newline at end of file
+    free(statuses);
+    free(new_chain);
+
+    wait_block_durable(blockchain, last_seq);
+}
@@ -1,17 +1,72 @@
+#ifndef BLOCKCHAIN_H
+#define BLOCKCHAIN_H
+
+#include <stdint.h>
+#include <pthread.h>
 #include "block.h"
+#include "utils.h"
+
+struct wal_t;
+struct payload_cache_t;
+struct search_index_t;
+struct block_tree_t;
+struct subscriptions_t;
+struct response_cache_t;
+
+#define BLOCKCHAIN_INDEX_CAPACITY 1024   // Initial slots of the hash index
+#define BLOCKCHAIN_ETAG_SIZE 80          // Quoted "height-tiphash" ETag
+#define BLOCKCHAIN_VERIFY_GRAIN 64       // Blocks hashed per thread pool task
+#define BLOCKCHAIN_RENDER_GRAIN 256      // Blocks rendered per thread pool task
+#define BLOCKCHAIN_BINARY_HEADER_SIZE 8  // First height and block count before binary blocks
+
+// Outcomes of receive_block
+#define BLOCK_ACCEPTED 0    // Block is now on the active chain (extended or switched to)
+#define BLOCK_SIDE 1        // Block is kept on a side branch
+#define BLOCK_KNOWN 2       // Block is already in the tree
+#define BLOCK_ORPHAN 3      // Parent of the block is unknown
+#define BLOCK_INVALID 4     // Hash does not match the block contents
 
 typedef struct blockchain_t {
     block_t **chain;            // List of blocks
     int length;                 // Length of chain
+    int *index;                 // Hash index, open addressing table of height + 1 (0 is empty)
+    int index_capacity;         // Number of slots in hash index (power of two)
+    pthread_rwlock_t lock;      // Guards chain, length and index
+    struct wal_t *wal;          // Write-ahead log of added blocks, NULL if not persisted
+    struct payload_cache_t *payloads; // Payload cache in pruning mode, NULL keeps payloads in memory
+    struct search_index_t *search; // Payload search index, NULL if disabled
+    struct block_tree_t *tree;  // Every known block, chain is its heaviest branch
+    struct subscriptions_t *subscriptions; // Block streams woken on commit, NULL if none
+    struct response_cache_t *responses; // Cached response bodies, told about every new tip
 } blockchain_t;
 
 /***********************/
 /*  UTILITY FUNCTIONS  */
 /***********************/
 char *blockchain_to_json(blockchain_t *blockchain_t);
+char *blockchain_range_to_json(blockchain_t *blockchain, int from, int to, char *etag); // Heights from..to (-1 for tip), with the chain ETag
+char *blockchain_range_to_binary(blockchain_t *blockchain, int from, int to, char *etag, size_t *length); // Same in the binary block encoding
+int blockchain_find(blockchain_t *blockchain, char *hash);     // Height of block with hash, -1 if missing
+char *get_block_data(blockchain_t *blockchain, int height);    // Copy of block data, paged in if pruned (lock held)
+int blockchain_durable_length(blockchain_t *blockchain);       // Leading blocks of the chain on disk (lock held)
+void blockchain_rebuild_index(blockchain_t *blockchain);       // Rebuild the hash index from the chain (e.g. after a snapshot)
+char *blockchain_tips_to_json(blockchain_t *blockchain);       // Competing tips with their work
 
 /***********************/
 /*    CORE FUNCTIONS   */
 /***********************/
 blockchain_t *create_blockchain();                          // Create new blockchain
-block_t *add_block(blockchain_t *blockchain, char *data);   // Add block to blockchain
+block_t *add_block(blockchain_t *blockchain, char *data);   // Add block to blockchain, wait until durable
+block_t *add_block_no_wait(blockchain_t *blockchain, char *data, uint64_t *seq, int *height); // Add block, return its WAL sequence number and height
+void wait_block_durable(blockchain_t *blockchain, uint64_t seq);                // Wait for blocks added without waiting, then announce them
+void append_block(blockchain_t *blockchain, block_t *block); // Append an already mined block
+int receive_block(blockchain_t *blockchain, block_t *block, uint64_t *seq); // Add a block from anywhere in the tree, reorg if heavier
+void receive_blocks(blockchain_t *blockchain, block_t **blocks, int count, int *statuses, uint64_t *seq); // Same for a batch, hashed in parallel
+bool is_chain_valid(block_t **chain, int length);           // Validate whole chain
+bool is_chain_valid_from(block_t **chain, int length, int from); // Validate blocks from height on
+void enable_pruning(blockchain_t *blockchain, struct payload_cache_t *payloads); // Keep only headers in memory
+void enable_search(blockchain_t *blockchain, struct search_index_t *search);      // Index payloads of all blocks from now on
+void enable_response_cache(blockchain_t *blockchain, struct response_cache_t *responses); // Tell the cache about every new tip
+void replace_chain(block_t **new_chain, int new_length, blockchain_t *blockchain);
+
+#endif
@@ -1,4 +1,9 @@
+#ifndef UTILS_H
+#define UTILS_H
+
 #define TRUE 0
 #define FALSE 1
 
-typedef int bool;
\ No newline at end of file
+typedef int bool;
+
+#endif
@@ -6,6 +6,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -19,12 +21,25 @@
 #include <pthread.h>
 
 #include "blockchain/blockchain.h"
+#include "mining/scheduler.h"
+#include "pool/thread_pool.h"
+#include "networking/http_api.h"
+#include "networking/response_cache.h"
+#include "networking/server.h"
+#include "networking/subscriptions.h"
+#include "search/search_index.h"
+#include "storage/payload_cache.h"
+#include "storage/snapshot.h"
+#include "storage/wal.h"
+#include "tracing/trace.h"
 
 #define MAX_PEERS 2
 
 void api_server_init(int api_port);
 void api_server_run();
-void api_server_handle_request(int client_sockfd);
+void api_server_handle_request(int client_sockfd, char *request, int n);
+int api_server_send(int client_sockfd, char *buffer, int length);
+void url_decode(char *string);
 
 // Global API socket descriptor
 int api_server_sockfd;
@@ -38,16 +53,69 @@ blockchain_t *blockchain;
 // Main function
 int main(int argc, char *argv[])
 {
-    // Blockchain initialization
-    blockchain = create_blockchain();
-    // Add 100 blocks to the blockchain
-    for (int i = 0; i < 3; i++)
+    // Shared thread pool for hashing, validation and rendering, one worker
+    // per core unless POOL_THREADS=<n> is given
+    char *pool_threads = getenv("POOL_THREADS");
+    thread_pool_init(pool_threads ? atoi(pool_threads) : 0);
+
+    // PAYLOAD_CACHE=<bytes> keeps only block headers in memory and pages
+    // payloads in through an LRU cache of that size. Pruning starts before
+    // the snapshot and the WAL are loaded so payloads go straight to disk;
+    // the payload file is kept across runs and only missing payloads are written.
+    payload_cache_t *payloads = NULL;
+    char *payload_cache_bytes = getenv("PAYLOAD_CACHE");
+    if (payload_cache_bytes && atol(payload_cache_bytes) > 0)
     {
-        char *data = malloc(sizeof(char) * 1024);
-        sprintf(data, "Data %d", i);
-        add_block(blockchain, data);
+        payloads = payload_cache_open(PAYLOAD_PATH, atol(payload_cache_bytes));
     }
 
+    // Open the block log. WAL_SYNC selects durability: "always" (default),
+    // "interval:<ms>" or "off".
+    int wal_interval_ms;
+    wal_sync_policy_t wal_policy = wal_parse_policy(getenv("WAL_SYNC"), &wal_interval_ms);
+    wal_t *wal = wal_open(WAL_PATH, wal_policy, wal_interval_ms);
+
+    // Blockchain initialization from the latest snapshot, trusted up to its
+    // height. TRUSTED_CHECKPOINT ("<height> <block hash>") overrides the
+    // compiled-in checkpoint the snapshot must agree with.
+    char *trusted_checkpoint = getenv("TRUSTED_CHECKPOINT");
+    blockchain = snapshot_load(SNAPSHOT_PATH, payloads, trusted_checkpoint ? trusted_checkpoint : SNAPSHOT_TRUSTED_CHECKPOINT, wal);
+    if (blockchain == NULL)
+    {
+        blockchain = create_blockchain();
+        if (payloads)
+        {
+            enable_pruning(blockchain, payloads);
+        }
+    }
+
+    // Replay blocks logged after the snapshot, then log every new block
+    wal_replay(wal, blockchain);
+    blockchain->wal = wal;
+
+    if (blockchain->length == 1)
+    {
+        // Add 100 blocks to the blockchain
+        for (int i = 0; i < 3; i++)
+        {
+            char *data = malloc(sizeof(char) * 1024);
+            sprintf(data, "Data %d", i);
+            add_block(blockchain, data);
+        }
+    }
+
+    // Index block payloads for GET /search
+    enable_search(blockchain, search_index_create());
+
+    // Serve GET /blocks from bodies cached per tip, with tip-hash ETags
+    enable_response_cache(blockchain, response_cache_create());
+
+    // Push committed blocks to GET /blocks/subscribe streams
+    blockchain->subscriptions = subscriptions_create();
+
+    // Start miner threads
+    scheduler_init(blockchain);
+
     // Check arguments count
     if (argc != 3)
     {
@@ -64,6 +132,11 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    // A client leaving mid-response must not stop the node. Sends use
+    // MSG_NOSIGNAL, but raw WAL ranges go out with sendfile, which has no
+    // such flag
+    signal(SIGPIPE, SIG_IGN);
+
     // Initialize servers
     servers_init(api_port, p2p_port);
 
@@ -122,7 +195,7 @@ void servers_init(int api_port, int p2p_port)
 void api_server_run()
 {
     // Listen for connections
-    if (listen(api_server_sockfd, 5) < 0)
+    if (listen(api_server_sockfd, SOMAXCONN) < 0)
     {
         printf("Error listening\n");
         exit(1);
@@ -130,106 +203,261 @@ void api_server_run()
 
     printf("API server listening\n");
 
-    // Accept connections and spawn child processes
-    while (1)
+    // Accept connections and receive requests through the I/O backend,
+    // which hands every request to api_server_handle_request on a worker
+    server_run(api_server_sockfd, api_server_handle_request);
+}
+
+// Handle a request received by the I/O backend (NUL terminated)
+void api_server_handle_request(int client_sockfd, char *request, int n)
+{
+    // Get method and resource requested (path)
+    char method[16] = "";
+    char path[1024] = "";
     {
-        // Accept connection
-        struct sockaddr_in client_addr;
-        socklen_t client_addr_len = sizeof(client_addr);
-        int client_sockfd = accept(api_server_sockfd, (struct sockaddr *)&client_addr, &client_addr_len);
-        if (client_sockfd < 0)
+        TRACE_SCOPE("parse");
+        sscanf(request, "%15s %1023s", method, path);
+    }
+
+    // Handle GET request
+    if (strcmp(method, "GET") == 0)
+    {
+        if (strncmp(path, "/blocks", 7) == 0 && (path[7] == '\0' || path[7] == '?'))
         {
-            printf("Error accepting connection\n");
-            exit(1);
+            printf("Client requested block list\n");
+
+            // JSON (or, with Accept: application/octet-stream, binary)
+            // representation, each format and encoding with its own ETag
+            int format = http_accept_format(request);
+            int encoding = http_accept_encoding(request);
+
+            // Unchanged since the client's copy, answered from the ETag alone
+            char etag[BLOCKCHAIN_ETAG_SIZE];
+            char representation_etag[HTTP_ETAG_SIZE];
+            char response[1024];
+            response_cache_etag(blockchain->responses, etag);
+            http_representation_etag(etag, format, encoding, representation_etag);
+            if (http_etag_matches(request, representation_etag))
+            {
+                sprintf(response, "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nVary: Accept, Accept-Encoding\r\n\r\n", representation_etag);
+                api_server_send(client_sockfd, response, strlen(response));
+            }
+            else
+            {
+                // Get height range (/blocks?from=a&to=b, inclusive, whole chain by default)
+                int from = 0;
+                int to = -1;
+                char *param = strstr(path, "from=");
+                if (param)
+                {
+                    from = atoi(param + 5);
+                }
+                param = strstr(path, "to=");
+                if (param)
+                {
+                    to = atoi(param + 3);
+                }
+
+                // Blocks serialized and compressed once per tip, format and
+                // encoding, shared with every request for them
+                response_body_t *body = response_cache_get(blockchain->responses, blockchain, from, to, format, encoding, etag);
+                http_representation_etag(etag, format, encoding, representation_etag);
+
+                // Send 200 OK response with the blocks
+                int header_length = sprintf(response, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\nETag: %s\r\nVary: Accept, Accept-Encoding\r\n",
+                                            http_format_type(format), body->length, representation_etag);
+                if (http_encoding_name(encoding))
+                {
+                    header_length += sprintf(response + header_length, "Content-Encoding: %s\r\n", http_encoding_name(encoding));
+                }
+                sprintf(response + header_length, "\r\n");
+                if (api_server_send(client_sockfd, response, strlen(response)) == 0)
+                {
+                    api_server_send(client_sockfd, body->data, body->length);
+                }
+                response_body_release(body);
+            }
+
+            printf("GET /blocks response sent\n");
         }
+        else if (strcmp(path, "/trace") == 0)
+        {
+            printf("Client requested trace dump\n");
 
-        printf("Connection from %s\n", inet_ntoa(client_addr.sin_addr));
+            // Send 200 OK response with Chrome trace_event JSON
+            char response[1024];
+            sprintf(response, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n\r\n");
+            api_server_send(client_sockfd, response, strlen(response));
 
-        // Create thread for handling request
-        pthread_t thread;
+            char *json = trace_to_json();
+            api_server_send(client_sockfd, json, strlen(json));
+            free(json);
 
-        if (pthread_create(&thread, NULL, (void *)api_server_handle_request, (void *)client_sockfd) < 0)
+            printf("GET /trace response sent\n");
+        }
+        else if (strcmp(path, "/stats/cache") == 0)
         {
-            printf("Error creating thread\n");
-            exit(1);
+            // Payload cache hit and miss stats
+            char response[1024];
+            sprintf(response, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n\r\n");
+            api_server_send(client_sockfd, response, strlen(response));
+
+            char *json = payload_cache_stats_to_json(blockchain->payloads);
+            api_server_send(client_sockfd, json, strlen(json));
+            free(json);
+
+            printf("GET /stats/cache response sent\n");
         }
+        else if (strcmp(path, "/stats/pool") == 0)
+        {
+            // Thread pool workers and task stats
+            char response[1024];
+            sprintf(response, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n\r\n");
+            api_server_send(client_sockfd, response, strlen(response));
 
-        // Wait for thread to finish
-        pthread_join(thread, NULL);
+            char *json = thread_pool_stats_to_json();
+            api_server_send(client_sockfd, json, strlen(json));
+            free(json);
 
-        // Close socket
-        close(client_sockfd);
-    }
-}
+            printf("GET /stats/pool response sent\n");
+        }
+        else if (strncmp(path, "/blocks/subscribe", 17) == 0 && (path[17] == '\0' || path[17] == '?'))
+        {
+            // Server-Sent Events (or WebSocket) stream of committed blocks,
+            // served on this thread until the client leaves
+            subscriptions_serve(blockchain->subscriptions, blockchain, client_sockfd, path, request);
 
-void api_server_handle_request(int client_sockfd)
-{
-    // Receive request
-    char request[1024];
-    int n = read(client_sockfd, request, 1024);
+            printf("GET /blocks/subscribe stream closed\n");
+        }
+        else if (strncmp(path, "/blocks/raw", 11) == 0 && (path[11] == '\0' || path[11] == '?'))
+        {
+            // Get height range (/blocks/raw?from=a&to=b, inclusive). The
+            // genesis block is not logged, so ranges start at height 1.
+            pthread_rwlock_rdlock(&blockchain->lock);
+            int from = 1;
+            int to = blockchain->length - 1;
+            pthread_rwlock_unlock(&blockchain->lock);
+            char *param = strstr(path, "from=");
+            if (param)
+            {
+                from = atoi(param + 5);
+            }
+            param = strstr(path, "to=");
+            if (param)
+            {
+                to = atoi(param + 3);
+            }
 
-    // Check for error
-    if (n < 0)
-    {
-        printf("Error reading from socket\n");
-        exit(1);
-    }
+            // Send WAL records straight from the page cache, exactly the
+            // bytes the length was taken from
+            wal_range_t range;
+            char response[1024];
+            if (blockchain->wal && wal_range_open(blockchain->wal, from, to, &range) == 0)
+            {
+                sprintf(response, "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %llu\r\n\r\n", (unsigned long long) range.length);
+                if (api_server_send(client_sockfd, response, strlen(response)) != 0 ||
+                    wal_range_send(blockchain->wal, &range, client_sockfd) != 0)
+                {
+                    printf("Error sending blocks %d-%d\n", from, to);
+                }
+                wal_range_close(&range);
+            }
+            else
+            {
+                sprintf(response, "HTTP/1.1 416 Range Not Satisfiable\r\n\r\n");
+                api_server_send(client_sockfd, response, strlen(response));
+            }
 
-    // Handle GET request
-    if (strncmp(request, "GET", 3) == 0)
-    {
-        // Get resource requested (path)
-        char path[1024];
-        sscanf(request, "GET %s", path);
+            printf("GET /blocks/raw response sent\n");
+        }
+        else if (strcmp(path, "/tips") == 0)
+        {
+            // Competing tips of the block tree
+            char response[1024];
+            sprintf(response, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n\r\n");
+            api_server_send(client_sockfd, response, strlen(response));
+
+            char *json = blockchain_tips_to_json(blockchain);
+            api_server_send(client_sockfd, json, strlen(json));
+            free(json);
 
-        if (strncmp(path, "/blocks\0", 8) == 0)
+            printf("GET /tips response sent\n");
+        }
+        else if (strncmp(path, "/search?", 8) == 0)
         {
-            printf("Client requested block list\n");
+            // Tokens (/search?q=...) or a whole payload (/search?exact=...)
+            char *query = NULL;
+            bool exact = FALSE;
+            if (strncmp(path + 8, "q=", 2) == 0)
+            {
+                query = path + 10;
+            }
+            else if (strncmp(path + 8, "exact=", 6) == 0)
+            {
+                query = path + 14;
+                exact = TRUE;
+            }
 
-            // Send 200 OK response with JSON
             char response[1024];
-            sprintf(response, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n\r\n");
-            n = write(client_sockfd, response, strlen(response));
-            if (n < 0)
+            if (query)
+            {
+                url_decode(query);
+                sprintf(response, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n\r\n");
+                api_server_send(client_sockfd, response, strlen(response));
+
+                char *json = search_to_json(blockchain->search, blockchain, query, exact);
+                api_server_send(client_sockfd, json, strlen(json));
+                free(json);
+            }
+            else
             {
-                printf("Error writing to socket\n");
-                exit(1);
+                sprintf(response, "HTTP/1.1 400 Bad Request\r\n\r\n");
+                api_server_send(client_sockfd, response, strlen(response));
             }
 
-            // JSON representation of blockchain
-            char *json = blockchain_to_json(blockchain);
-            n = write(client_sockfd, json, strlen(json));
-            if (n < 0)
+            printf("GET /search response sent\n");
+        }
+        else if (strncmp(path, "/jobs/", 6) == 0)
+        {
+            // Get job id and optional long-poll timeout (/jobs/{id}?wait=ms)
+            int id = atoi(path + 6);
+            int wait_ms = 0;
+            char *wait = strstr(path, "wait=");
+            if (wait)
             {
-                printf("Error writing to socket\n");
-                exit(1);
+                wait_ms = atoi(wait + 5);
             }
-            free(json);
 
-            printf("GET /blocks response sent\n");
+            char *json = scheduler_job_to_json(id, wait_ms);
+            char response[1024];
+            if (json)
+            {
+                sprintf(response, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n\r\n");
+                api_server_send(client_sockfd, response, strlen(response));
+                api_server_send(client_sockfd, json, strlen(json));
+                free(json);
+            }
+            else
+            {
+                sprintf(response, "HTTP/1.1 404 Not Found\r\n\r\n");
+                api_server_send(client_sockfd, response, strlen(response));
+            }
+
+            printf("GET /jobs/%d response sent\n", id);
         }
         else
         {
             // Send 404 response
             char response[1024];
             sprintf(response, "HTTP/1.1 404 Not Found\r\n\r\n");
-            n = write(client_sockfd, response, strlen(response));
-            if (n < 0)
-            {
-                printf("Error writing to socket\n");
-                exit(1);
-            }
+            api_server_send(client_sockfd, response, strlen(response));
 
             printf("404 Not Found response sent\n");
         }
     }
     // Handle POST request
-    else if (strncmp(request, "POST", 4) == 0)
+    else if (strcmp(method, "POST") == 0)
     {
-        // Get resource requested (path)
-        char path[1024];
-        sscanf(request, "POST %s", path);
-
         // TODO - Filter out malicious requests
 
         if (strncmp(path, "/mine\0", 5) == 0)
@@ -239,45 +467,184 @@ void api_server_handle_request(int client_sockfd)
             // Get data from request body
             char *data;
             data = (char *)malloc(sizeof(char) * 1024);
-            // Read request line by line until /r/n/r/n is found
-            for (int i = 0; i < 1024; i++)
+            data[0] = '\0';
+            // Read request line by line until /r/n/r/n is found, within
+            // the n bytes received; the body is the rest of them
+            for (int i = 0; i + 3 < n; i++)
             {
                 if (request[i] == '\r' && request[i + 1] == '\n' && request[i + 2] == '\r' && request[i + 3] == '\n')
                 {
-                    strncpy(data, &request[i + 4], 1024);
+                    int length = n - (i + 4) < 1023 ? n - (i + 4) : 1023;
+                    memcpy(data, &request[i + 4], length);
+                    data[length] = '\0';
                     break;
                 }
             }
     
-            // Add block to blockchain
-            add_block(blockchain, data);
+            // Get optional job priority (/mine?priority=n)
+            int priority = 0;
+            char *priority_param = strstr(path, "priority=");
+            if (priority_param)
+            {
+                priority = atoi(priority_param + 9);
+            }
+
+            // Enqueue mining job, the block is mined in the background
+            int id = scheduler_submit(data, priority);
 
-            // Send 200 OK response with JSON
             char response[1024];
-            sprintf(response, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n\r\n");
-            n = write(client_sockfd, response, strlen(response));
-            if (n < 0)
+            if (id < 0)
+            {
+                free(data);
+                sprintf(response, "HTTP/1.1 503 Service Unavailable\r\n\r\n");
+                api_server_send(client_sockfd, response, strlen(response));
+            }
+            else
             {
-                printf("Error writing to socket\n");
-                exit(1);
+                // Send 202 Accepted response with the job id
+                sprintf(response, "HTTP/1.1 202 Accepted\r\nContent-Type: application/json\r\nLocation: /jobs/%d\r\n\r\n{\"job_id\":%d}", id, id);
+                api_server_send(client_sockfd, response, strlen(response));
             }
 
             printf("POST /mine response sent\n");
         }
+        else if (strcmp(path, "/blocks") == 0)
+        {
+            // Block from another node in binary encoding, possibly on a
+            // competing branch
+            char *body = strstr(request, "\r\n\r\n");
+            size_t consumed;
+            block_t *block = body ? block_deserialize(body + 4, n - (body + 4 - request), &consumed) : NULL;
+
+            char response[1024];
+            if (block)
+            {
+                static const char *statuses[] = {"accepted", "side", "known", "orphan", "invalid"};
+                uint64_t seq;
+                int status = receive_block(blockchain, block, &seq);
+                wait_block_durable(blockchain, seq);
+                if (status != BLOCK_ACCEPTED && status != BLOCK_SIDE)
+                {
+                    free(block->previous_hash);
+                    free(block->hash);
+                    free(block->data);
+                    free(block);
+                }
+                sprintf(response, "HTTP/1.1 %s\r\nContent-Type: application/json\r\n\r\n{\"status\":\"%s\"}",
+                        status == BLOCK_INVALID ? "422 Unprocessable Entity" : "200 OK", statuses[status]);
+            }
+            else
+            {
+                sprintf(response, "HTTP/1.1 400 Bad Request\r\n\r\n");
+            }
+            api_server_send(client_sockfd, response, strlen(response));
+
+            printf("POST /blocks response sent\n");
+        }
+        else if (strcmp(path, "/trace/start") == 0 || strcmp(path, "/trace/stop") == 0)
+        {
+            // Enable or disable recording of trace scopes
+            trace_set_enabled(strcmp(path, "/trace/start") == 0);
+
+            char response[1024];
+            sprintf(response, "HTTP/1.1 200 OK\r\n\r\n");
+            api_server_send(client_sockfd, response, strlen(response));
+
+            printf("POST %s response sent\n", path);
+        }
         else
         {
             printf("POST request to unrecognized path\n");
             // Send 404 response
             char response[1024];
             sprintf(response, "HTTP/1.1 404 Not Found\r\n\r\n");
-            n = write(client_sockfd, response, strlen(response));
-            if (n < 0)
+            api_server_send(client_sockfd, response, strlen(response));
+
+            printf("404 Not Found response sent\n");
+        }
+    }
+    // Handle DELETE request
+    else if (strcmp(method, "DELETE") == 0)
+    {
+        char response[1024];
+        if (strncmp(path, "/jobs/", 6) == 0)
+        {
+            // Cancel a queued mining job
+            int result = scheduler_cancel(atoi(path + 6));
+            if (result == 0)
+            {
+                sprintf(response, "HTTP/1.1 200 OK\r\n\r\n");
+            }
+            else if (result == -2)
+            {
+                sprintf(response, "HTTP/1.1 409 Conflict\r\n\r\n");
+            }
+            else
             {
-                printf("Error writing to socket\n");
-                exit(1);
+                sprintf(response, "HTTP/1.1 404 Not Found\r\n\r\n");
             }
+        }
+        else
+        {
+            sprintf(response, "HTTP/1.1 404 Not Found\r\n\r\n");
+        }
+        api_server_send(client_sockfd, response, strlen(response));
 
-            printf("404 Not Found response sent\n");
+        printf("DELETE %s response sent\n", path);
+    }
+
+    // Close socket
+    close(client_sockfd);
+}
+
+// Write a whole buffer to the client socket, 0 on success. A client that
+// left only fails its own request (-1): the handler closes the socket.
+int api_server_send(int client_sockfd, char *buffer, int length)
+{
+    TRACE_SCOPE("socket_write");
+
+    while (length > 0)
+    {
+        // Short writes continue where they stopped, MSG_NOSIGNAL turns a
+        // closed connection into EPIPE instead of SIGPIPE
+        ssize_t n = send(client_sockfd, buffer, length, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
         }
+        if (n <= 0)
+        {
+            printf("Error writing to socket\n");
+            return -1;
+        }
+        buffer += n;
+        length -= n;
     }
-}
\ No newline at end of file
+    return 0;
+}
+
+// Decode a query string value in place ('+' and %XX escapes)
+void url_decode(char *string)
+{
+    char *out = string;
+    for (char *in = string; *in; in++)
+    {
+        unsigned int byte;
+        if (*in == '+')
+        {
+            *out++ = ' ';
+        }
+        else if (*in == '%' && isxdigit((unsigned char) in[1]) && isxdigit((unsigned char) in[2]))
+        {
+            // Only a full %XX escape is decoded, a stray '%' is kept as is
+            sscanf(in + 1, "%2x", &byte);
+            *out++ = (char) byte;
+            in += 2;
+        }
+        else
+        {
+            *out++ = *in;
+        }
+    }
+    *out = '\0';
+}
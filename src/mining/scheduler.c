@@ -0,0 +1,279 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the implementation of the mining scheduler.
+ *
+ * Jobs live in a fixed table indexed by id, so a job can be looked up long
+ * after it was mined without the table ever growing. Queued jobs are kept in
+ * a list sorted by priority (FIFO among equal priorities).
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include "scheduler.h"
+#include "../storage/snapshot.h"
+
+static blockchain_t *scheduler_blockchain;
+static mining_job_t jobs[SCHEDULER_MAX_JOBS];
+static mining_job_t *queue = NULL;
+static int queued = 0;
+static int next_id = 1;
+
+static pthread_mutex_t scheduler_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_available = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_changed = PTHREAD_COND_INITIALIZER;
+
+static const char *job_state_names[] = {"queued", "mining", "done", "cancelled", "reorged"};
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+
+// Job with the given id, NULL if unknown or already forgotten
+static mining_job_t *find_job(int id)
+{
+    if (id <= 0)
+    {
+        return NULL;
+    }
+    mining_job_t *job = &jobs[id % SCHEDULER_MAX_JOBS];
+    return job->id == id ? job : NULL;
+}
+
+// Job as JSON, waiting up to wait_ms for it to be mined or cancelled
+char *scheduler_job_to_json(int id, int wait_ms)
+{
+    if (wait_ms > SCHEDULER_MAX_WAIT_MS)
+    {
+        wait_ms = SCHEDULER_MAX_WAIT_MS;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += wait_ms / 1000;
+    deadline.tv_nsec += (long) (wait_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&scheduler_lock);
+    mining_job_t *job = find_job(id);
+    while (job && wait_ms > 0 && (job->state == JOB_QUEUED || job->state == JOB_MINING))
+    {
+        if (pthread_cond_timedwait(&job_changed, &scheduler_lock, &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+        // The slot may have been reused while waiting
+        job = find_job(id);
+    }
+    if (!job)
+    {
+        pthread_mutex_unlock(&scheduler_lock);
+        return NULL;
+    }
+
+    char *json = malloc(sizeof(char) * 256);
+    if (!json)
+    {
+        printf("Error allocating memory for job\n");
+        exit(1);
+    }
+    if (job->state == JOB_DONE || job->state == JOB_REORGED)
+    {
+        char *hash = get_ascii_hash(job->hash);
+        sprintf(json, "{\"id\":%d,\"state\":\"%s\",\"priority\":%d,\"height\":%d,\"hash\":\"%s\"}",
+                job->id, job_state_names[job->state], job->priority, job->height, hash);
+        free(hash);
+    }
+    else
+    {
+        sprintf(json, "{\"id\":%d,\"state\":\"%s\",\"priority\":%d}",
+                job->id, job_state_names[job->state], job->priority);
+    }
+    pthread_mutex_unlock(&scheduler_lock);
+
+    return json;
+}
+
+// Miner thread: take the highest priority jobs and mine them. Jobs queued
+// together are mined back to back and made durable with a single WAL sync.
+static void *scheduler_worker(void *arg)
+{
+    (void) arg;
+
+    int ids[SCHEDULER_BATCH];
+    char *data[SCHEDULER_BATCH];
+    block_t *blocks[SCHEDULER_BATCH];
+    int heights[SCHEDULER_BATCH];
+
+    while (1)
+    {
+        // Wait for jobs
+        pthread_mutex_lock(&scheduler_lock);
+        while (queue == NULL)
+        {
+            pthread_cond_wait(&job_available, &scheduler_lock);
+        }
+        int count = 0;
+        while (queue != NULL && count < SCHEDULER_BATCH)
+        {
+            mining_job_t *job = queue;
+            queue = job->next;
+            queued--;
+            job->state = JOB_MINING;
+            ids[count] = job->id;
+            data[count] = job->data;
+            count++;
+        }
+        pthread_mutex_unlock(&scheduler_lock);
+
+        // Mine the blocks outside of the scheduler lock
+        uint64_t seq = 0;
+        for (int i = 0; i < count; i++)
+        {
+            blocks[i] = add_block_no_wait(scheduler_blockchain, data[i], &seq, &heights[i]);
+        }
+        wait_block_durable(scheduler_blockchain, seq);
+
+        // Publish the results and wake up long-polling clients. A block
+        // that a reorg moved off the active chain meanwhile is reported as
+        // reorged, with the height it was mined at.
+        int active[SCHEDULER_BATCH];
+        for (int i = 0; i < count; i++)
+        {
+            active[i] = blockchain_find(scheduler_blockchain, blocks[i]->hash) == heights[i];
+        }
+        pthread_mutex_lock(&scheduler_lock);
+        for (int i = 0; i < count; i++)
+        {
+            mining_job_t *job = find_job(ids[i]);
+            if (job)
+            {
+                job->state = active[i] ? JOB_DONE : JOB_REORGED;
+                job->height = heights[i];
+                job->hash = blocks[i]->hash;
+            }
+        }
+        pthread_cond_broadcast(&job_changed);
+        pthread_mutex_unlock(&scheduler_lock);
+
+        // Take a snapshot every SNAPSHOT_INTERVAL blocks, counting with the
+        // heights the blocks were mined at. It is written in the background,
+        // after the results are out; if the previous one is still running
+        // the next interval takes it.
+        int first_height = heights[0];
+        int last_height = heights[count - 1];
+        if ((last_height + 1) / SNAPSHOT_INTERVAL != first_height / SNAPSHOT_INTERVAL)
+        {
+            snapshot_save_async(scheduler_blockchain, SNAPSHOT_PATH);
+        }
+
+        printf("Mined %d jobs up to height %d\n", count, last_height);
+    }
+
+    return NULL;
+}
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+
+// Start miner threads
+void scheduler_init(blockchain_t *blockchain)
+{
+    scheduler_blockchain = blockchain;
+
+    for (int i = 0; i < SCHEDULER_WORKERS; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, scheduler_worker, NULL) != 0)
+        {
+            printf("Error creating miner thread\n");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+}
+
+// Enqueue a job, return its id or -1 if the queue is full
+int scheduler_submit(char *data, int priority)
+{
+    pthread_mutex_lock(&scheduler_lock);
+
+    // Refuse the job if the queue is full or its slot still holds a live job
+    mining_job_t *job = &jobs[next_id % SCHEDULER_MAX_JOBS];
+    if (queued >= SCHEDULER_MAX_QUEUED || (job->id != 0 && (job->state == JOB_QUEUED || job->state == JOB_MINING)))
+    {
+        pthread_mutex_unlock(&scheduler_lock);
+        return -1;
+    }
+
+    job->id = next_id++;
+    job->priority = priority;
+    job->data = data;
+    job->state = JOB_QUEUED;
+    job->height = -1;
+    job->hash = NULL;
+
+    // Insert after every job with the same or a higher priority
+    mining_job_t **position = &queue;
+    while (*position && (*position)->priority >= priority)
+    {
+        position = &(*position)->next;
+    }
+    job->next = *position;
+    *position = job;
+    queued++;
+
+    int id = job->id;
+    pthread_cond_signal(&job_available);
+    pthread_mutex_unlock(&scheduler_lock);
+
+    return id;
+}
+
+// Cancel a queued job: 0 on success, -1 if unknown, -2 if already started
+int scheduler_cancel(int id)
+{
+    pthread_mutex_lock(&scheduler_lock);
+
+    mining_job_t *job = find_job(id);
+    if (!job)
+    {
+        pthread_mutex_unlock(&scheduler_lock);
+        return -1;
+    }
+    if (job->state != JOB_QUEUED)
+    {
+        pthread_mutex_unlock(&scheduler_lock);
+        return -2;
+    }
+
+    // Remove job from the queue
+    mining_job_t **position = &queue;
+    while (*position != job)
+    {
+        position = &(*position)->next;
+    }
+    *position = job->next;
+    queued--;
+
+    job->state = JOB_CANCELLED;
+    free(job->data);
+    job->data = NULL;
+
+    pthread_cond_broadcast(&job_changed);
+    pthread_mutex_unlock(&scheduler_lock);
+
+    return 0;
+}
@@ -0,0 +1,58 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the definition of the mining scheduler.
+ *
+ * POST /mine enqueues a job and returns right away; a bounded pool of miner
+ * threads takes jobs by priority and appends the mined blocks to the chain.
+ *
+ * */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "../blockchain/blockchain.h"
+
+#define SCHEDULER_WORKERS 1             // Miner threads
+#define SCHEDULER_MAX_QUEUED 256        // Jobs waiting to be mined
+#define SCHEDULER_BATCH 64              // Jobs mined before one durability wait
+#define SCHEDULER_MAX_JOBS 1024         // Jobs remembered for GET /jobs/{id}
+#define SCHEDULER_MAX_WAIT_MS 30000     // Longest long-poll on a job
+
+/***********************/
+/*   DATA STRUCTURES   */
+/***********************/
+
+typedef enum job_state_t {
+    JOB_QUEUED,
+    JOB_MINING,
+    JOB_DONE,
+    JOB_CANCELLED,
+    JOB_REORGED                     // Mined, then dropped from the active chain by a reorg
+} job_state_t;
+
+typedef struct mining_job_t {
+    int id;                         // Job identifier, 0 for a free slot
+    int priority;                   // Higher priority jobs are mined first
+    char *data;                     // Data of the block to mine
+    job_state_t state;              // Current state
+    int height;                     // Height the block was mined at
+    char *hash;                     // Hash of the mined block
+    struct mining_job_t *next;      // Next job in the queue
+} mining_job_t;
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+char *scheduler_job_to_json(int id, int wait_ms);   // Job as JSON, waits until mined; NULL if unknown
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+void scheduler_init(blockchain_t *blockchain);      // Start miner threads
+int scheduler_submit(char *data, int priority);     // Enqueue a job, return its id or -1 if the queue is full
+int scheduler_cancel(int id);                       // Cancel a queued job: 0 on success, -1 if unknown, -2 if already started
+
+#endif
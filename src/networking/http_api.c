@@ -0,0 +1,206 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the implementation of the HTTP request helpers shared
+ * by the API handlers.
+ *
+ * */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include "http_api.h"
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+
+// Copy the value of a request header (case insensitive name) into value.
+// Return 1 if the header is present, 0 otherwise.
+int http_header_value(char *request, const char *name, char *value, size_t size)
+{
+    size_t name_length = strlen(name);
+    char *line = strstr(request, "\r\n");
+    while (line && line[2] != '\r' && line[2] != '\0')
+    {
+        line += 2;
+        if (strncasecmp(line, name, name_length) == 0 && line[name_length] == ':')
+        {
+            char *start = line + name_length + 1;
+            while (*start == ' ')
+            {
+                start++;
+            }
+            size_t length = strcspn(start, "\r\n");
+            if (length >= size)
+            {
+                length = size - 1;
+            }
+            memcpy(value, start, length);
+            value[length] = '\0';
+            return 1;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return 0;
+}
+
+// Pick the encoding of the response from Accept-Encoding. gzip is preferred
+// over deflate, codings with q=0 are skipped and anything else is identity.
+int http_accept_encoding(char *request)
+{
+    char value[256];
+    if (!http_header_value(request, "Accept-Encoding", value, sizeof(value)))
+    {
+        return HTTP_ENCODING_IDENTITY;
+    }
+
+    int encoding = HTTP_ENCODING_IDENTITY;
+    char *save;
+    for (char *coding = strtok_r(value, ",", &save); coding; coding = strtok_r(NULL, ",", &save))
+    {
+        // Split "name;q=value"
+        while (*coding == ' ')
+        {
+            coding++;
+        }
+        char *params = strchr(coding, ';');
+        if (params)
+        {
+            *params++ = '\0';
+            char *q = strstr(params, "q=");
+            if (q && atof(q + 2) <= 0)
+            {
+                continue;
+            }
+        }
+        coding[strcspn(coding, " ")] = '\0';
+
+        if (strcasecmp(coding, "gzip") == 0 || strcasecmp(coding, "x-gzip") == 0 || strcmp(coding, "*") == 0)
+        {
+            return HTTP_ENCODING_GZIP;
+        }
+        if (strcasecmp(coding, "deflate") == 0)
+        {
+            encoding = HTTP_ENCODING_DEFLATE;
+        }
+    }
+    return encoding;
+}
+
+// Content-Encoding token of an encoding, NULL for identity
+const char *http_encoding_name(int encoding)
+{
+    switch (encoding)
+    {
+    case HTTP_ENCODING_GZIP:
+        return "gzip";
+    case HTTP_ENCODING_DEFLATE:
+        return "deflate";
+    default:
+        return NULL;
+    }
+}
+
+// Quality the client gives a media type in Accept, 0 if not listed.
+// Wildcards do not count, they only mean any format is fine.
+static double accept_quality(char *accept, const char *type)
+{
+    char value[512];
+    strncpy(value, accept, sizeof(value) - 1);
+    value[sizeof(value) - 1] = '\0';
+
+    char *save;
+    for (char *range = strtok_r(value, ",", &save); range; range = strtok_r(NULL, ",", &save))
+    {
+        while (*range == ' ')
+        {
+            range++;
+        }
+        double quality = 1;
+        char *params = strchr(range, ';');
+        if (params)
+        {
+            *params++ = '\0';
+            char *q = strstr(params, "q=");
+            if (q)
+            {
+                quality = atof(q + 2);
+            }
+        }
+        range[strcspn(range, " ")] = '\0';
+        if (strcasecmp(range, type) == 0)
+        {
+            return quality;
+        }
+    }
+    return 0;
+}
+
+// Pick the response format from Accept. Binary only when the client lists
+// application/octet-stream above application/json, JSON otherwise.
+int http_accept_format(char *request)
+{
+    char value[512];
+    if (!http_header_value(request, "Accept", value, sizeof(value)))
+    {
+        return HTTP_FORMAT_JSON;
+    }
+
+    double binary = accept_quality(value, "application/octet-stream");
+    double json = accept_quality(value, "application/json");
+    return binary > json ? HTTP_FORMAT_BINARY : HTTP_FORMAT_JSON;
+}
+
+// Content-Type of a format
+const char *http_format_type(int format)
+{
+    return format == HTTP_FORMAT_BINARY ? "application/octet-stream" : "application/json";
+}
+
+// ETag of one representation of a resource: the quoted chain ETag with a
+// suffix per format and encoding, so that a cache holding the gzip or binary
+// body never revalidates it against another representation
+void http_representation_etag(const char *etag, int format, int encoding, char *out)
+{
+    size_t length = strlen(etag);
+    if (length < 2 || etag[length - 1] != '"')
+    {
+        strcpy(out, etag);
+        return;
+    }
+    sprintf(out, "%.*s%s%s%s\"", (int) (length - 1), etag, format == HTTP_FORMAT_BINARY ? "-bin" : "",
+            http_encoding_name(encoding) ? "-" : "", http_encoding_name(encoding) ? http_encoding_name(encoding) : "");
+}
+
+// Return 1 if If-None-Match lists the (quoted) etag, weak or not, or is *
+int http_etag_matches(char *request, const char *etag)
+{
+    char value[1024];
+    if (!http_header_value(request, "If-None-Match", value, sizeof(value)))
+    {
+        return 0;
+    }
+
+    char *save;
+    for (char *tag = strtok_r(value, ",", &save); tag; tag = strtok_r(NULL, ",", &save))
+    {
+        while (*tag == ' ')
+        {
+            tag++;
+        }
+        if (strncmp(tag, "W/", 2) == 0)
+        {
+            tag += 2;
+        }
+        tag[strcspn(tag, " ")] = '\0';
+        if (strcmp(tag, "*") == 0 || strcmp(tag, etag) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,38 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the definition of the HTTP request helpers shared by
+ * the API handlers.
+ *
+ * */
+
+#ifndef HTTP_API_H
+#define HTTP_API_H
+
+#include <stddef.h>
+
+#define HTTP_ENCODING_IDENTITY 0            // Body sent as is
+#define HTTP_ENCODING_GZIP 1                // Content-Encoding: gzip
+#define HTTP_ENCODING_DEFLATE 2             // Content-Encoding: deflate (zlib stream)
+#define HTTP_ENCODINGS 3                    // Number of encodings above
+
+#define HTTP_FORMAT_JSON 0                  // application/json (default)
+#define HTTP_FORMAT_BINARY 1                // application/octet-stream, binary block encoding
+#define HTTP_FORMATS 2                      // Number of formats above
+
+#define HTTP_ETAG_SIZE 112                  // Quoted chain ETag plus representation suffixes
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+int http_header_value(char *request, const char *name, char *value, size_t size); // Copy a header value, 0 if absent
+int http_accept_encoding(char *request);                            // Best encoding the client accepts
+const char *http_encoding_name(int encoding);                       // Content-Encoding token, NULL for identity
+int http_etag_matches(char *request, const char *etag);             // If-None-Match lists etag (or *)
+void http_representation_etag(const char *etag, int format, int encoding, char *out); // ETag of one format and encoding of a body
+int http_accept_format(char *request);                              // Response format asked for by Accept
+const char *http_format_type(int format);                           // Content-Type of a format
+
+#endif
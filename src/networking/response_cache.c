@@ -0,0 +1,257 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the implementation of the response cache of
+ * GET /blocks.
+ *
+ * Bodies are built and compressed outside the cache lock and only stored if
+ * the tip did not move meanwhile, so a slow serialization never holds up
+ * other readers and a stale body is never cached under the new ETag. Under
+ * the lock a request only takes a reference, it never copies a body.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "response_cache.h"
+#include "../tracing/trace.h"
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+
+// Body owning data, with one reference for the caller
+static response_body_t *body_create(char *data, size_t length)
+{
+    response_body_t *body = (response_body_t *) malloc(sizeof(response_body_t));
+    if (!body)
+    {
+        printf("Error allocating memory for response\n");
+        exit(1);
+    }
+    body->data = data;
+    body->length = length;
+    body->references = 1;
+    return body;
+}
+
+// Take one more reference to a body
+static response_body_t *body_retain(response_body_t *body)
+{
+    __atomic_fetch_add(&body->references, 1, __ATOMIC_RELAXED);
+    return body;
+}
+
+// Compress a body as gzip or deflate (zlib) stream
+static response_body_t *encode(response_body_t *plain, int encoding)
+{
+    TRACE_SCOPE("compress");
+
+    // 15 window bits give a zlib stream, +16 a gzip one
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    int window_bits = encoding == HTTP_ENCODING_GZIP ? 15 + 16 : 15;
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        printf("Error initializing compression\n");
+        exit(1);
+    }
+
+    // deflateBound covers the zlib wrapper only, leave room for gzip's
+    size_t bound = deflateBound(&stream, plain->length) + 32;
+    char *encoded = malloc(bound);
+    if (!encoded)
+    {
+        printf("Error allocating memory for response\n");
+        exit(1);
+    }
+    stream.next_in = (Bytef *) plain->data;
+    stream.avail_in = plain->length;
+    stream.next_out = (Bytef *) encoded;
+    stream.avail_out = bound;
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END)
+    {
+        printf("Error compressing response\n");
+        exit(1);
+    }
+    size_t length = stream.total_out;
+    deflateEnd(&stream);
+
+    return body_create(encoded, length);
+}
+
+// Free the bodies of an entry and mark it unused
+static void clear_entry(response_entry_t *entry)
+{
+    for (int i = 0; i < HTTP_ENCODINGS; i++)
+    {
+        response_body_release(entry->bodies[i]);
+        entry->bodies[i] = NULL;
+    }
+    entry->etag[0] = '\0';
+}
+
+// Entry of a range built at the current tip, NULL if none (lock held)
+static response_entry_t *lookup(response_cache_t *cache, int from, int to, int format)
+{
+    for (int i = 0; i < RESPONSE_CACHE_ENTRIES; i++)
+    {
+        response_entry_t *entry = &cache->entries[i];
+        if (entry->etag[0] && entry->from == from && entry->to == to && entry->format == format && strcmp(entry->etag, cache->etag) == 0)
+        {
+            entry->used = ++cache->clock;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Entry for a new range, an unused one or the least recently used (lock held)
+static response_entry_t *claim(response_cache_t *cache, int from, int to, int format)
+{
+    response_entry_t *victim = &cache->entries[0];
+    for (int i = 0; i < RESPONSE_CACHE_ENTRIES; i++)
+    {
+        response_entry_t *entry = &cache->entries[i];
+        if (!entry->etag[0])
+        {
+            victim = entry;
+            break;
+        }
+        if (entry->used < victim->used)
+        {
+            victim = entry;
+        }
+    }
+    clear_entry(victim);
+    victim->from = from;
+    victim->to = to;
+    victim->format = format;
+    strcpy(victim->etag, cache->etag);
+    victim->used = ++cache->clock;
+    return victim;
+}
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+
+response_cache_t *response_cache_create()
+{
+    response_cache_t *cache = (response_cache_t *) calloc(1, sizeof(response_cache_t));
+    if (!cache)
+    {
+        printf("Error allocating memory for response cache\n");
+        exit(1);
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+
+    return cache;
+}
+
+// Called by the chain whenever its tip changes. Bodies built at older tips
+// are freed right away, they can never be served again.
+void response_cache_update(response_cache_t *cache, const char *etag)
+{
+    pthread_mutex_lock(&cache->lock);
+    strcpy(cache->etag, etag);
+    for (int i = 0; i < RESPONSE_CACHE_ENTRIES; i++)
+    {
+        if (cache->entries[i].etag[0])
+        {
+            clear_entry(&cache->entries[i]);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Copy the current ETag (BLOCKCHAIN_ETAG_SIZE bytes), without touching the chain
+void response_cache_etag(response_cache_t *cache, char *etag)
+{
+    pthread_mutex_lock(&cache->lock);
+    strcpy(etag, cache->etag);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Return a reference to the blocks at heights from..to (-1 for tip) as JSON
+// or binary in the given encoding, with the ETag of the tip it was built at.
+// Only the first request per format after a tip change serializes, only the
+// first request per encoding compresses; every other request shares the
+// cached body. Release the body with response_body_release once sent.
+response_body_t *response_cache_get(response_cache_t *cache, blockchain_t *blockchain, int from, int to,
+                                    int format, int encoding, char *etag)
+{
+    // Cached in this encoding
+    pthread_mutex_lock(&cache->lock);
+    response_entry_t *entry = lookup(cache, from, to, format);
+    if (entry && entry->bodies[encoding])
+    {
+        response_body_t *body = body_retain(entry->bodies[encoding]);
+        strcpy(etag, entry->etag);
+        pthread_mutex_unlock(&cache->lock);
+        return body;
+    }
+
+    // Cached uncompressed only, or not at all
+    response_body_t *plain;
+    if (entry && entry->bodies[HTTP_ENCODING_IDENTITY])
+    {
+        plain = body_retain(entry->bodies[HTTP_ENCODING_IDENTITY]);
+        strcpy(etag, entry->etag);
+        pthread_mutex_unlock(&cache->lock);
+    }
+    else
+    {
+        pthread_mutex_unlock(&cache->lock);
+        size_t length;
+        char *data;
+        if (format == HTTP_FORMAT_BINARY)
+        {
+            data = blockchain_range_to_binary(blockchain, from, to, etag, &length);
+        }
+        else
+        {
+            data = blockchain_range_to_json(blockchain, from, to, etag);
+            length = strlen(data);
+        }
+        plain = body_create(data, length);
+    }
+    response_body_t *body = encoding == HTTP_ENCODING_IDENTITY ? body_retain(plain) : encode(plain, encoding);
+
+    // Keep both bodies, unless the tip moved while they were built
+    pthread_mutex_lock(&cache->lock);
+    if (strcmp(etag, cache->etag) == 0)
+    {
+        entry = lookup(cache, from, to, format);
+        if (!entry)
+        {
+            entry = claim(cache, from, to, format);
+        }
+        if (!entry->bodies[HTTP_ENCODING_IDENTITY])
+        {
+            entry->bodies[HTTP_ENCODING_IDENTITY] = body_retain(plain);
+        }
+        if (!entry->bodies[encoding])
+        {
+            entry->bodies[encoding] = body_retain(body);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    response_body_release(plain);
+
+    return body;
+}
+
+// Drop a reference to a body, freeing it with the last one (NULL is ignored)
+void response_body_release(response_body_t *body)
+{
+    if (body && __atomic_sub_fetch(&body->references, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(body->data);
+        free(body);
+    }
+}
@@ -0,0 +1,67 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the definition of the response cache of GET /blocks.
+ *
+ * Every response carries an ETag made of the tip height and hash, which the
+ * chain pushes here whenever its tip changes, plus a suffix per format and
+ * encoding (see http_representation_etag). Clients that send it back in
+ * If-None-Match get a 304 without the chain being locked or serialized.
+ * Bodies are cached per height range, format and encoding, so a range is
+ * serialized and compressed once per tip no matter how many clients poll it.
+ * Cached bodies are reference counted and handed out as they are: a request
+ * sends the cached bytes and releases its reference when done, and a body
+ * dropped by a tip change lives on until its last request releases it.
+ *
+ * */
+
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "http_api.h"
+#include "../blockchain/blockchain.h"
+
+#define RESPONSE_CACHE_ENTRIES 16           // Height ranges cached at once
+
+/***********************/
+/*   DATA STRUCTURES   */
+/***********************/
+
+typedef struct response_body_t {
+    char *data;                         // Encoded body
+    size_t length;                      // Bytes of data
+    int references;                     // Cache entry and requests holding it
+} response_body_t;
+
+typedef struct response_entry_t {
+    int from;                           // First height requested
+    int to;                             // Last height requested (-1 for tip)
+    int format;                         // JSON or binary blocks
+    char etag[BLOCKCHAIN_ETAG_SIZE];    // Tip the bodies were built at, empty if unused
+    response_body_t *bodies[HTTP_ENCODINGS]; // Body in each encoding, NULL until requested
+    uint64_t used;                      // Clock of the last lookup
+} response_entry_t;
+
+typedef struct response_cache_t {
+    char etag[BLOCKCHAIN_ETAG_SIZE];    // ETag of the current tip
+    response_entry_t entries[RESPONSE_CACHE_ENTRIES];
+    uint64_t clock;                     // Bumped on every lookup
+    pthread_mutex_t lock;               // Guards everything above
+} response_cache_t;
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+response_cache_t *response_cache_create();                          // Empty cache, no tip yet
+void response_cache_update(response_cache_t *cache, const char *etag); // Tip changed, drops stale bodies
+void response_cache_etag(response_cache_t *cache, char *etag);     // Copy of the current ETag
+response_body_t *response_cache_get(response_cache_t *cache, blockchain_t *blockchain, int from, int to,
+                                    int format, int encoding, char *etag); // Reference to the encoded body, and its ETag
+void response_body_release(response_body_t *body);                 // Drop a reference taken by response_cache_get
+
+#endif
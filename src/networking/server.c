@@ -0,0 +1,476 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the implementation of the server I/O backend.
+ *
+ * The io_uring backend talks to the kernel through the raw system calls, so
+ * it needs no extra library. One io_uring_enter submits every queued
+ * operation and reaps every completion, however many connections are busy.
+ *
+ * */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "server.h"
+#include "../tracing/trace.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+typedef struct server_request_t {
+    server_handler_t handler;       // Request handler
+    int client_sockfd;              // Connection
+    int length;                     // Bytes received
+    char request[SERVER_REQUEST_SIZE + 1]; // Request bytes, NUL terminated
+} server_request_t;
+
+// Requests waiting for a worker, in arrival order
+static server_request_t *pending[SERVER_MAX_QUEUED];
+static int pending_head = 0;
+static int pending_count = 0;
+static int workers = 0;
+static int idle_workers = 0;
+
+static pthread_mutex_t dispatch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t request_available = PTHREAD_COND_INITIALIZER;
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+
+// Worker thread: handle queued requests one after the other
+static void *server_worker(void *arg)
+{
+    (void) arg;
+
+    while (1)
+    {
+        // Wait for a request
+        pthread_mutex_lock(&dispatch_lock);
+        idle_workers++;
+        while (pending_count == 0)
+        {
+            pthread_cond_wait(&request_available, &dispatch_lock);
+        }
+        idle_workers--;
+        server_request_t *request = pending[pending_head];
+        pending_head = (pending_head + 1) % SERVER_MAX_QUEUED;
+        pending_count--;
+        pthread_mutex_unlock(&dispatch_lock);
+
+        request->handler(request->client_sockfd, request->request, request->length);
+        free(request);
+    }
+
+    return NULL;
+}
+
+// Queue a received request for the workers, starting one more if every
+// worker is busy and the limit allows it. With the queue full the
+// connection is closed, so the I/O loop never waits on the handlers.
+static void server_dispatch(server_handler_t handler, int client_sockfd, char *buffer, int length)
+{
+    TRACE_SCOPE("dispatch");
+
+    server_request_t *request = malloc(sizeof(server_request_t));
+    if (!request)
+    {
+        printf("Error allocating memory for request\n");
+        exit(1);
+    }
+    if (length > SERVER_REQUEST_SIZE)
+    {
+        length = SERVER_REQUEST_SIZE;
+    }
+    request->handler = handler;
+    request->client_sockfd = client_sockfd;
+    request->length = length;
+    memcpy(request->request, buffer, length);
+    request->request[length] = '\0';
+
+    pthread_mutex_lock(&dispatch_lock);
+    if (pending_count == SERVER_MAX_QUEUED)
+    {
+        pthread_mutex_unlock(&dispatch_lock);
+        close(client_sockfd);
+        free(request);
+        return;
+    }
+    pending[(pending_head + pending_count) % SERVER_MAX_QUEUED] = request;
+    pending_count++;
+    if (idle_workers < pending_count && workers < SERVER_MAX_WORKERS)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, server_worker, NULL) != 0)
+        {
+            printf("Error creating thread\n");
+            exit(1);
+        }
+        pthread_detach(thread);
+        workers++;
+    }
+    pthread_cond_signal(&request_available);
+    pthread_mutex_unlock(&dispatch_lock);
+}
+
+// Blocking backend: one accept and one read per connection
+static void server_run_blocking(int listen_sockfd, server_handler_t handler)
+{
+    while (1)
+    {
+        int client_sockfd = accept(listen_sockfd, NULL, NULL);
+        if (client_sockfd < 0)
+        {
+            printf("Error accepting connection\n");
+            exit(1);
+        }
+
+        char buffer[SERVER_REQUEST_SIZE];
+        int n = read(client_sockfd, buffer, SERVER_REQUEST_SIZE);
+        if (n <= 0)
+        {
+            close(client_sockfd);
+            continue;
+        }
+        server_dispatch(handler, client_sockfd, buffer, n);
+    }
+}
+
+#ifdef __linux__
+
+// Epoll backend: accept and receive whatever is ready on every wakeup
+static void server_run_epoll(int listen_sockfd, server_handler_t handler)
+{
+    int epfd = epoll_create1(0);
+    if (epfd < 0)
+    {
+        server_run_blocking(listen_sockfd, handler);
+        return;
+    }
+
+    // Accept until the backlog is drained without blocking the loop
+    fcntl(listen_sockfd, F_SETFL, fcntl(listen_sockfd, F_GETFL) | O_NONBLOCK);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = listen_sockfd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listen_sockfd, &event);
+
+    printf("Server I/O backend: epoll\n");
+
+    struct epoll_event events[SERVER_RING_ENTRIES];
+    while (1)
+    {
+        int ready = epoll_wait(epfd, events, SERVER_RING_ENTRIES, -1);
+        if (ready < 0 && errno != EINTR)
+        {
+            printf("Error waiting for events\n");
+            exit(1);
+        }
+
+        for (int i = 0; i < ready; i++)
+        {
+            int fd = events[i].data.fd;
+            if (fd == listen_sockfd)
+            {
+                // Accept every pending connection
+                int client_sockfd;
+                while ((client_sockfd = accept4(listen_sockfd, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+                {
+                    event.events = EPOLLIN | EPOLLONESHOT;
+                    event.data.fd = client_sockfd;
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, client_sockfd, &event);
+                }
+                continue;
+            }
+
+            // Receive request, then give the socket back to blocking mode
+            // for the handler thread
+            char buffer[SERVER_REQUEST_SIZE];
+            int n = recv(fd, buffer, SERVER_REQUEST_SIZE, 0);
+            if (n < 0 && errno == EAGAIN)
+            {
+                event.events = EPOLLIN | EPOLLONESHOT;
+                event.data.fd = fd;
+                epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &event);
+                continue;
+            }
+            epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+            if (n <= 0)
+            {
+                close(fd);
+                continue;
+            }
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+            server_dispatch(handler, fd, buffer, n);
+        }
+    }
+}
+
+// Operation tags kept in the top byte of io_uring user data
+#define TAG_ACCEPT 1ULL
+#define TAG_RECV 2ULL
+#define USER_DATA(tag, fd) (((tag) << 56) | ((uint64_t) (fd) << 32))
+
+typedef struct server_ring_t {
+    int fd;                             // io_uring descriptor
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;          // Submission queue entries
+    unsigned sq_entries;                // Size of the submission queue
+    unsigned sq_local_tail;             // Tail including entries not yet published
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;          // Completion queue entries
+    struct io_uring_buf_ring *buffer_ring; // Registered receive buffers
+    char *buffers;                      // Memory of the receive buffers
+    unsigned short buffer_tail;         // Tail of the buffer ring
+} server_ring_t;
+
+// Publish queued entries and wait for at least wait completions
+static int ring_enter(server_ring_t *ring, unsigned wait)
+{
+    unsigned submit = ring->sq_local_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    int result = syscall(__NR_io_uring_enter, ring->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (result < 0 && errno != EINTR && errno != EBUSY)
+    {
+        printf("Error entering io_uring\n");
+        exit(1);
+    }
+    return result;
+}
+
+// Next free submission entry, flushing the queue if it is full
+static struct io_uring_sqe *ring_get_sqe(server_ring_t *ring)
+{
+    if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    {
+        ring_enter(ring, 0);
+    }
+    unsigned index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+// Give a receive buffer back to the kernel
+static void ring_recycle_buffer(server_ring_t *ring, unsigned short id)
+{
+    struct io_uring_buf *buffer = &ring->buffer_ring->bufs[ring->buffer_tail & (SERVER_RING_BUFFERS - 1)];
+    buffer->addr = (uint64_t) (uintptr_t) (ring->buffers + (size_t) id * SERVER_REQUEST_SIZE);
+    buffer->len = SERVER_REQUEST_SIZE;
+    buffer->bid = id;
+    ring->buffer_tail++;
+    __atomic_store_n(&ring->buffer_ring->tail, ring->buffer_tail, __ATOMIC_RELEASE);
+}
+
+// Set up the ring and register its receive buffers, -1 if unsupported
+static int ring_init(server_ring_t *ring)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, SERVER_RING_ENTRIES, &params);
+    if (ring->fd < 0)
+    {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        close(ring->fd);
+        return -1;
+    }
+
+    // Map submission and completion rings (one mapping) and the entries
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t size = sq_size > cq_size ? sq_size : cq_size;
+    char *rings = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (rings == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        close(ring->fd);
+        return -1;
+    }
+    ring->sq_head = (unsigned *) (rings + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (rings + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (rings + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (rings + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *) (rings + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (rings + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (rings + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (rings + params.cq_off.cqes);
+
+    // Register a ring of receive buffers for recv
+    ring->buffer_ring = mmap(NULL, SERVER_RING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->buffers = malloc((size_t) SERVER_RING_BUFFERS * SERVER_REQUEST_SIZE);
+    if (ring->buffer_ring == MAP_FAILED || !ring->buffers)
+    {
+        close(ring->fd);
+        return -1;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) ring->buffer_ring;
+    reg.ring_entries = SERVER_RING_BUFFERS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        close(ring->fd);
+        return -1;
+    }
+    ring->buffer_tail = 0;
+    for (int i = 0; i < SERVER_RING_BUFFERS; i++)
+    {
+        ring_recycle_buffer(ring, i);
+    }
+
+    return 0;
+}
+
+// Arm multishot accept on the listening socket
+static void ring_accept(server_ring_t *ring, int listen_sockfd)
+{
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_sockfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = USER_DATA(TAG_ACCEPT, 0);
+}
+
+// Arm a single recv into the registered buffers. Nothing stays armed once
+// it completes, so the handler owns the connection from then on.
+static void ring_recv(server_ring_t *ring, int fd)
+{
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = USER_DATA(TAG_RECV, fd);
+}
+
+// io_uring backend, returns if io_uring is not available
+static void server_run_io_uring(int listen_sockfd, server_handler_t handler)
+{
+    server_ring_t ring;
+    if (ring_init(&ring) != 0)
+    {
+        return;
+    }
+
+    printf("Server I/O backend: io_uring\n");
+
+    ring_accept(&ring, listen_sockfd);
+    while (1)
+    {
+        ring_enter(&ring, 1);
+
+        // Reap every completion
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            uint64_t tag = cqe->user_data >> 56;
+            int fd = (int) ((cqe->user_data >> 32) & 0xffffff);
+
+            if (tag == TAG_ACCEPT)
+            {
+                if (cqe->res >= 0)
+                {
+                    if (cqe->res >= SERVER_MAX_FDS)
+                    {
+                        close(cqe->res);
+                    }
+                    else
+                    {
+                        ring_recv(&ring, cqe->res);
+                    }
+                }
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                {
+                    if (cqe->res == -EINVAL)
+                    {
+                        // Multishot accept not supported by this kernel
+                        printf("io_uring multishot accept unsupported\n");
+                        close(ring.fd);
+                        server_run_epoll(listen_sockfd, handler);
+                        return;
+                    }
+                    ring_accept(&ring, listen_sockfd);
+                }
+            }
+            else if (tag == TAG_RECV)
+            {
+                if (cqe->flags & IORING_CQE_F_BUFFER)
+                {
+                    // The first chunk is the request, as with read()
+                    unsigned short buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                    if (cqe->res > 0)
+                    {
+                        server_dispatch(handler, fd, ring.buffers + (size_t) buffer_id * SERVER_REQUEST_SIZE, cqe->res);
+                    }
+                    else
+                    {
+                        close(fd);
+                    }
+                    ring_recycle_buffer(&ring, buffer_id);
+                }
+                else if (cqe->res == -ENOBUFS)
+                {
+                    // Out of buffers for a moment: they are recycled as
+                    // completions are reaped, so just rearm
+                    ring_recv(&ring, fd);
+                }
+                else
+                {
+                    // Connection closed or failed before sending a request
+                    close(fd);
+                }
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+#endif
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+
+// Serve connections forever
+void server_run(int listen_sockfd, server_handler_t handler)
+{
+#ifdef __linux__
+    char *backend = getenv("IO_BACKEND");
+    if (backend == NULL || strcmp(backend, "epoll") != 0)
+    {
+        server_run_io_uring(listen_sockfd, handler);
+        printf("io_uring unavailable, falling back to epoll\n");
+    }
+    server_run_epoll(listen_sockfd, handler);
+#else
+    server_run_blocking(listen_sockfd, handler);
+#endif
+}
@@ -0,0 +1,45 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the definition of the server I/O backend.
+ *
+ * The backend accepts connections and receives requests in batches, then
+ * queues every request for a bounded set of worker threads that run the
+ * handler. On Linux it uses io_uring (multishot accept, and one recv per
+ * connection into a registered buffer ring) and falls back to epoll when
+ * io_uring is unavailable; elsewhere it uses blocking accept and read. Only
+ * accepts and request reads go through the ring: handlers write their
+ * responses themselves, since long-polls and streams block them anyway.
+ *
+ * Streams and long-polls hold a worker for as long as they last, so there
+ * are more workers than subscribers allowed (SUBSCRIBE_MAX_SUBSCRIBERS).
+ * Workers are started as requests find every worker busy.
+ *
+ * */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#define SERVER_REQUEST_SIZE 1024        // Largest request read from a connection
+#define SERVER_RING_ENTRIES 256         // io_uring submission queue entries
+#define SERVER_RING_BUFFERS 256         // Receive buffers registered with io_uring (power of two)
+#define SERVER_MAX_FDS 65536            // Highest connection descriptor kept in io_uring user data
+#define SERVER_MAX_WORKERS 512          // Threads running the handler
+#define SERVER_MAX_QUEUED 1024          // Requests waiting for a worker, more are closed
+
+/***********************/
+/*   DATA STRUCTURES   */
+/***********************/
+
+// Called on a worker thread with the first bytes received (NUL terminated).
+// The handler owns the socket and closes it.
+typedef void (*server_handler_t)(int client_sockfd, char *request, int length);
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+void server_run(int listen_sockfd, server_handler_t handler);  // Serve forever, IO_BACKEND=epoll forces the fallback
+
+#endif
@@ -0,0 +1,556 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the implementation of the block subscription streams.
+ *
+ * Every stream runs on the thread the server gave its request to. Messages
+ * are JSON objects with a "type" of block, reorg or dropped; Server-Sent
+ * Events use the type as event name and the block height as event id, so
+ * browsers resume with Last-Event-ID on their own.
+ *
+ * */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+#include "subscriptions.h"
+#include "http_api.h"
+#include "../blockchain/block_tree.h"
+#include "../tracing/trace.h"
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+
+// Write a whole buffer without raising SIGPIPE, -1 if the client is gone or
+// did not read for SUBSCRIBE_SEND_TIMEOUT_MS
+static int send_all(int sockfd, const char *buffer, size_t length)
+{
+    TRACE_SCOPE("socket_write");
+
+    while (length > 0)
+    {
+        ssize_t n = send(sockfd, buffer, length, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        buffer += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// Bytes written to the socket that the client has not received yet
+static int socket_backlog(int sockfd)
+{
+    int queued = 0;
+#ifdef SIOCOUTQ
+    if (ioctl(sockfd, SIOCOUTQ, &queued) != 0)
+    {
+        queued = 0;
+    }
+#else
+    (void) sockfd;
+#endif
+    return queued;
+}
+
+// Send one message: an SSE event, or a WebSocket text frame.
+// Return -1 if the client is gone.
+static int send_message(int sockfd, int websocket, const char *type, int id, const char *payload)
+{
+    size_t length = strlen(payload);
+    char *frame = malloc(sizeof(char) * (length + 128));
+    if (!frame)
+    {
+        printf("Error allocating memory for stream message\n");
+        exit(1);
+    }
+
+    size_t size = 0;
+    if (websocket)
+    {
+        // Final text frame, servers do not mask
+        frame[size++] = (char) 0x81;
+        if (length < 126)
+        {
+            frame[size++] = (char) length;
+        }
+        else if (length < 65536)
+        {
+            frame[size++] = 126;
+            frame[size++] = (char) (length >> 8);
+            frame[size++] = (char) (length & 0xff);
+        }
+        else
+        {
+            frame[size++] = 127;
+            for (int i = 7; i >= 0; i--)
+            {
+                frame[size++] = (char) (((uint64_t) length >> (8 * i)) & 0xff);
+            }
+        }
+        memcpy(frame + size, payload, length);
+        size += length;
+    }
+    else
+    {
+        size = id >= 0 ? sprintf(frame, "id: %d\nevent: %s\ndata: ", id, type) : sprintf(frame, "event: %s\ndata: ", type);
+        memcpy(frame + size, payload, length);
+        size += length;
+        memcpy(frame + size, "\n\n", 2);
+        size += 2;
+    }
+
+    int result = send_all(sockfd, frame, size);
+    free(frame);
+    return result;
+}
+
+// Block message for the block at height, the chain lock must be held
+static char *block_message(blockchain_t *blockchain, int height)
+{
+    block_t block = *blockchain->chain[height];
+    block.data = get_block_data(blockchain, height);
+    char *json = block_to_json(&block);
+    free(block.data);
+
+    char *message = malloc(sizeof(char) * (strlen(json) + 64));
+    if (!message)
+    {
+        printf("Error allocating memory for stream message\n");
+        exit(1);
+    }
+    sprintf(message, "{\"type\":\"block\",\"height\":%d,\"block\":%s}", height, json);
+    free(json);
+
+    return message;
+}
+
+// Answer a WebSocket handshake, -1 if the client is gone
+static int websocket_accept(int sockfd, const char *key)
+{
+    // Accept key is base64(SHA1(key + GUID))
+    char concatenated[256];
+    snprintf(concatenated, sizeof(concatenated), "%s%s", key, WEBSOCKET_GUID);
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    SHA1((unsigned char *) concatenated, strlen(concatenated), digest);
+    unsigned char accept[64];
+    EVP_EncodeBlock(accept, digest, SHA_DIGEST_LENGTH);
+
+    char response[256];
+    sprintf(response, "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept);
+    return send_all(sockfd, response, strlen(response));
+}
+
+// Milliseconds on the monotonic clock
+static int64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Send a WebSocket control frame (at most 125 bytes of payload)
+static int send_control(int sockfd, int opcode, const unsigned char *payload, size_t length)
+{
+    char frame[2 + 125];
+    frame[0] = (char) (0x80 | opcode);
+    frame[1] = (char) length;
+    memcpy(frame + 2, payload, length);
+    return send_all(sockfd, frame, 2 + length);
+}
+
+// Handle the WebSocket frames buffered in reader: answer Close and Ping,
+// note Pong and discard data frames. Return -1 once the stream must end.
+static int handle_frames(int sockfd, websocket_reader_t *reader)
+{
+    while (1)
+    {
+        // Discard the rest of a data frame
+        if (reader->skip > 0)
+        {
+            size_t n = reader->skip < reader->length ? reader->skip : reader->length;
+            memmove(reader->buffer, reader->buffer + n, reader->length - n);
+            reader->length -= n;
+            reader->skip -= n;
+            if (reader->skip > 0)
+            {
+                return 0;
+            }
+        }
+
+        // Frame header
+        unsigned char *frame = reader->buffer;
+        if (reader->length < 2)
+        {
+            return 0;
+        }
+        int opcode = frame[0] & 0x0f;
+        int masked = frame[1] & 0x80;
+        uint64_t length = frame[1] & 0x7f;
+        size_t header = 2;
+        if (length == 126)
+        {
+            if (reader->length < 4)
+            {
+                return 0;
+            }
+            length = ((uint64_t) frame[2] << 8) | frame[3];
+            header = 4;
+        }
+        else if (length == 127)
+        {
+            if (reader->length < 10)
+            {
+                return 0;
+            }
+            length = 0;
+            for (int i = 0; i < 8; i++)
+            {
+                length = (length << 8) | frame[2 + i];
+            }
+            header = 10;
+        }
+        if (masked)
+        {
+            header += 4;
+        }
+        if (reader->length < header)
+        {
+            return 0;
+        }
+
+        // Data frames are not expected from subscribers, skip them
+        if (opcode < 0x8)
+        {
+            memmove(reader->buffer, reader->buffer + header, reader->length - header);
+            reader->length -= header;
+            reader->skip = length;
+            continue;
+        }
+
+        // Control frames carry at most 125 bytes
+        if (length > 125)
+        {
+            unsigned char status[2] = {0x03, 0xea}; // 1002, protocol error
+            send_control(sockfd, 0x8, status, 2);
+            return -1;
+        }
+        if (reader->length < header + length)
+        {
+            return 0;
+        }
+        unsigned char payload[125];
+        memcpy(payload, frame + header, length);
+        if (masked)
+        {
+            for (uint64_t i = 0; i < length; i++)
+            {
+                payload[i] ^= frame[header - 4 + (i % 4)];
+            }
+        }
+        memmove(reader->buffer, reader->buffer + header + length, reader->length - header - length);
+        reader->length -= header + length;
+
+        if (opcode == 0x8)
+        {
+            // Echo the status code back and end the stream
+            send_control(sockfd, 0x8, payload, length >= 2 ? 2 : 0);
+            printf("Subscriber closed the WebSocket\n");
+            return -1;
+        }
+        if (opcode == 0x9 && send_control(sockfd, 0xA, payload, length) != 0)
+        {
+            return -1;
+        }
+        if (opcode == 0xA)
+        {
+            reader->ping_sent_ms = 0;
+        }
+    }
+}
+
+// Read whatever the client sent without blocking. WebSocket frames are
+// handled, anything else is discarded. Return -1 if the client is gone.
+static int read_client(int sockfd, int websocket, websocket_reader_t *reader)
+{
+    while (1)
+    {
+        char discard[WEBSOCKET_READ_BUFFER];
+        char *buffer = websocket ? (char *) reader->buffer + reader->length : discard;
+        size_t room = websocket ? sizeof(reader->buffer) - reader->length : sizeof(discard);
+        ssize_t n = recv(sockfd, buffer, room, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return 0;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        if (websocket)
+        {
+            reader->length += n;
+            if (handle_frames(sockfd, reader) != 0)
+            {
+                return -1;
+            }
+        }
+    }
+}
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+
+// Create the subscription registry
+subscriptions_t *subscriptions_create()
+{
+    subscriptions_t *subscriptions = (subscriptions_t *) calloc(1, sizeof(subscriptions_t));
+    if (!subscriptions)
+    {
+        printf("Error allocating memory for subscriptions\n");
+        exit(1);
+    }
+    pthread_mutex_init(&subscriptions->lock, NULL);
+    pthread_cond_init(&subscriptions->committed, NULL);
+
+    return subscriptions;
+}
+
+// Wake every subscriber after blocks were committed
+void subscriptions_publish(subscriptions_t *subscriptions)
+{
+    pthread_mutex_lock(&subscriptions->lock);
+    subscriptions->version++;
+    pthread_cond_broadcast(&subscriptions->committed);
+    pthread_mutex_unlock(&subscriptions->lock);
+}
+
+// Stream blocks to a client until it leaves or falls too far behind.
+// Options: ?from=<height> (or a Last-Event-ID header) resumes from a height,
+// otherwise only new blocks are sent; ?slow=drop skips blocks for a slow
+// client instead of disconnecting it.
+void subscriptions_serve(subscriptions_t *subscriptions, blockchain_t *blockchain, int client_sockfd, char *path, char *request)
+{
+    // Parse options
+    int from = -1;
+    char *param = strstr(path, "from=");
+    if (param)
+    {
+        from = atoi(param + 5);
+    }
+    char value[128];
+    if (http_header_value(request, "Last-Event-ID", value, sizeof(value)))
+    {
+        from = atoi(value) + 1;
+    }
+    int drop = strstr(path, "slow=drop") != NULL;
+    char key[128];
+    int websocket = http_header_value(request, "Upgrade", value, sizeof(value)) && strcasecmp(value, "websocket") == 0 &&
+                    http_header_value(request, "Sec-WebSocket-Key", key, sizeof(key));
+
+    // Admit subscriber
+    pthread_mutex_lock(&subscriptions->lock);
+    if (subscriptions->subscribers >= SUBSCRIBE_MAX_SUBSCRIBERS)
+    {
+        pthread_mutex_unlock(&subscriptions->lock);
+        char response[] = "HTTP/1.1 503 Service Unavailable\r\n\r\n";
+        send_all(client_sockfd, response, strlen(response));
+        return;
+    }
+    subscriptions->subscribers++;
+    pthread_mutex_unlock(&subscriptions->lock);
+
+    // Handshake
+    int gone;
+    if (websocket)
+    {
+        gone = websocket_accept(client_sockfd, key);
+    }
+    else
+    {
+        char response[] = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: keep-alive\r\n\r\n";
+        gone = send_all(client_sockfd, response, strlen(response));
+    }
+
+    // Writes to a client that stopped reading fail instead of blocking forever
+    struct timeval timeout = {SUBSCRIBE_SEND_TIMEOUT_MS / 1000, (SUBSCRIBE_SEND_TIMEOUT_MS % 1000) * 1000};
+    setsockopt(client_sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // Start position, remembering the hash before it to notice reorgs
+    char last_hash[BLOCK_HASH_LENGTH];
+    pthread_rwlock_rdlock(&blockchain->lock);
+    int durable = blockchain_durable_length(blockchain);
+    if (from < 0 || from > durable)
+    {
+        from = durable;
+    }
+    int next = from;
+    if (next > 0)
+    {
+        memcpy(last_hash, blockchain->chain[next - 1]->hash, BLOCK_HASH_LENGTH);
+    }
+    pthread_rwlock_unlock(&blockchain->lock);
+
+    printf("Subscriber streaming from height %d (%s)\n", next, websocket ? "WebSocket" : "SSE");
+
+    websocket_reader_t reader;
+    memset(&reader, 0, sizeof(reader));
+    int dropped_from = -1;
+    while (!gone)
+    {
+        pthread_mutex_lock(&subscriptions->lock);
+        uint64_t seen = subscriptions->version;
+        pthread_mutex_unlock(&subscriptions->lock);
+
+        // Answer control frames and notice clients that left
+        if (read_client(client_sockfd, websocket, &reader) != 0)
+        {
+            break;
+        }
+
+        char message[128];
+        int slow = socket_backlog(client_sockfd) > SUBSCRIBE_MAX_QUEUED;
+        if (slow && !drop)
+        {
+            printf("Disconnecting slow subscriber at height %d\n", next);
+            break;
+        }
+
+        // Read a batch of durable blocks, rewinding to the fork if the
+        // chain switched branches under the stream
+        char *messages[SUBSCRIBE_BATCH];
+        int heights[SUBSCRIBE_BATCH];
+        int count = 0;
+        int fork = -1;
+        pthread_rwlock_rdlock(&blockchain->lock);
+        durable = blockchain_durable_length(blockchain);
+        if (next > 0 && (next > blockchain->length || memcmp(blockchain->chain[next - 1]->hash, last_hash, BLOCK_HASH_LENGTH) != 0))
+        {
+            tree_node_t *sent = block_tree_find(blockchain->tree, last_hash);
+            tree_node_t *tip = block_tree_find(blockchain->tree, blockchain->chain[blockchain->length - 1]->hash);
+            fork = sent ? block_tree_common_ancestor(sent, tip)->height : 0;
+            next = fork + 1;
+        }
+        if (slow)
+        {
+            // Skip what the client cannot take and tell it later
+            if (dropped_from < 0 && next < durable)
+            {
+                dropped_from = next;
+            }
+            next = next > durable ? next : durable;
+        }
+        while (next < durable && count < SUBSCRIBE_BATCH)
+        {
+            messages[count] = block_message(blockchain, next);
+            heights[count++] = next;
+            next++;
+        }
+        if (next > 0)
+        {
+            memcpy(last_hash, blockchain->chain[next - 1]->hash, BLOCK_HASH_LENGTH);
+        }
+        pthread_rwlock_unlock(&blockchain->lock);
+
+        // Send without holding the chain lock
+        if (fork >= 0 && !gone)
+        {
+            sprintf(message, "{\"type\":\"reorg\",\"fork_height\":%d}", fork);
+            gone = send_message(client_sockfd, websocket, "reorg", -1, message);
+        }
+        if (dropped_from >= 0 && !slow && !gone)
+        {
+            sprintf(message, "{\"type\":\"dropped\",\"from\":%d,\"to\":%d}", dropped_from, (count ? heights[0] : next) - 1);
+            gone = send_message(client_sockfd, websocket, "dropped", -1, message);
+            dropped_from = -1;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            if (!gone)
+            {
+                gone = send_message(client_sockfd, websocket, "block", heights[i], messages[i]);
+            }
+            free(messages[i]);
+        }
+        if (count == SUBSCRIBE_BATCH)
+        {
+            continue;
+        }
+
+        // Sleep until the next commit, reading client frames every
+        // SUBSCRIBE_POLL_MS and sending keepalives so that closed
+        // connections are noticed
+        int64_t deadline_ms = now_ms() + SUBSCRIBE_KEEPALIVE_MS;
+        int woken = 0;
+        while (!woken && !gone && now_ms() < deadline_ms)
+        {
+            struct timespec slice;
+            clock_gettime(CLOCK_REALTIME, &slice);
+            slice.tv_nsec += SUBSCRIBE_POLL_MS * 1000000L;
+            slice.tv_sec += slice.tv_nsec / 1000000000L;
+            slice.tv_nsec %= 1000000000L;
+            int expired = 0;
+            pthread_mutex_lock(&subscriptions->lock);
+            while (subscriptions->version == seen && !expired)
+            {
+                expired = pthread_cond_timedwait(&subscriptions->committed, &subscriptions->lock, &slice) == ETIMEDOUT;
+            }
+            woken = subscriptions->version != seen;
+            pthread_mutex_unlock(&subscriptions->lock);
+            gone = read_client(client_sockfd, websocket, &reader);
+        }
+        if (woken || gone)
+        {
+            continue;
+        }
+        if (websocket && reader.ping_sent_ms > 0)
+        {
+            // The last ping went unanswered for a whole keepalive period
+            printf("Disconnecting unresponsive subscriber at height %d\n", next);
+            break;
+        }
+        if (websocket)
+        {
+            reader.ping_sent_ms = now_ms();
+            gone = send_control(client_sockfd, 0x9, (const unsigned char *) "", 0);
+        }
+        else
+        {
+            gone = send_all(client_sockfd, ": keepalive\n\n", 13);
+        }
+    }
+
+    pthread_mutex_lock(&subscriptions->lock);
+    subscriptions->subscribers--;
+    pthread_mutex_unlock(&subscriptions->lock);
+
+    printf("Subscriber left at height %d\n", next);
+}
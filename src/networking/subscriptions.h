@@ -0,0 +1,65 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the definition of the block subscription streams.
+ *
+ * GET /blocks/subscribe keeps the connection open and pushes every block
+ * once, as Server-Sent Events or, when the client asks for an upgrade, as
+ * WebSocket text messages. Subscribers sleep until a block is committed and
+ * then read the new blocks straight from the chain, so nothing is queued per
+ * subscriber and a stream can resume from any height.
+ *
+ * Streams stop at the last durable block, so a crash never takes back a
+ * block that was already announced.
+ *
+ * Clients that stop reading fill their socket buffer. Past a limit they are
+ * either disconnected or, with ?slow=drop, skip ahead and are told which
+ * heights they missed. WebSocket clients are pinged while idle and dropped
+ * if they do not answer; their Close and Ping frames are answered.
+ *
+ * */
+
+#ifndef SUBSCRIPTIONS_H
+#define SUBSCRIPTIONS_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "../blockchain/blockchain.h"
+
+#define SUBSCRIBE_MAX_SUBSCRIBERS 256       // Streams served at once
+#define SUBSCRIBE_BATCH 64                  // Blocks read per chain lock
+#define SUBSCRIBE_MAX_QUEUED 262144         // Unsent bytes before a client counts as slow
+#define SUBSCRIBE_SEND_TIMEOUT_MS 5000      // Blocked write before a client is dropped
+#define SUBSCRIBE_KEEPALIVE_MS 15000        // Idle time before a keepalive is sent
+#define SUBSCRIBE_POLL_MS 200               // Period at which an idle stream reads client frames
+#define WEBSOCKET_READ_BUFFER 256           // Room for one control frame (125 byte payload at most)
+
+/***********************/
+/*   DATA STRUCTURES   */
+/***********************/
+
+typedef struct subscriptions_t {
+    uint64_t version;               // Bumped every time blocks are committed
+    int subscribers;                // Streams being served
+    pthread_mutex_t lock;           // Guards everything above
+    pthread_cond_t committed;       // Signalled when blocks are committed
+} subscriptions_t;
+
+typedef struct websocket_reader_t {
+    unsigned char buffer[WEBSOCKET_READ_BUFFER]; // Received bytes not parsed yet
+    size_t length;                  // Bytes used in buffer
+    uint64_t skip;                  // Payload bytes of a data frame still to discard
+    int64_t ping_sent_ms;           // When the unanswered ping was sent, 0 if none
+} websocket_reader_t;
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+subscriptions_t *subscriptions_create();                            // No subscribers yet
+void subscriptions_publish(subscriptions_t *subscriptions);         // Wake subscribers after a commit
+void subscriptions_serve(subscriptions_t *subscriptions, blockchain_t *blockchain,
+                         int client_sockfd, char *path, char *request); // Stream blocks until the client leaves
+
+#endif
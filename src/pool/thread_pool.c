@@ -0,0 +1,485 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the implementation of the shared work-stealing thread
+ * pool.
+ *
+ * The deques are Chase-Lev deques: the owner pushes and pops at the bottom
+ * without locking and thieves take from the top with a single compare and
+ * swap. A worker whose deque is full runs the task right away instead.
+ * Workers with nothing to run or steal sleep until a task is queued.
+ *
+ * */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include "thread_pool.h"
+
+typedef struct pool_range_t {
+    pool_range_function_t function; // Body of the loop
+    void *arg;                      // Its argument
+    int from;                       // First index of the chunk
+    int to;                         // One past the last index
+} pool_range_t;
+
+static pool_worker_t *workers = NULL;
+static int worker_count = 0;
+static __thread pool_worker_t *current_worker = NULL;
+
+static pool_task_t *shared_head = NULL;        // Tasks forked from outside the pool
+static pool_task_t *shared_tail = NULL;
+static int queued = 0;                         // Tasks waiting in deques or the shared queue
+static int sleeping = 0;                       // Workers waiting on work_available
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_available = PTHREAD_COND_INITIALIZER;
+
+static uint64_t forked = 0;                    // Tasks forked
+static uint64_t inlined = 0;                   // Tasks run by the forking worker as its deque was full
+static uint64_t helped = 0;                    // Tasks run by joining threads outside the pool
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+
+// Workers and task counters as JSON
+char *thread_pool_stats_to_json()
+{
+    size_t size = 256 + 128 * worker_count;
+    char *json = malloc(sizeof(char) * size);
+    if (!json)
+    {
+        printf("Error allocating memory for pool stats\n");
+        exit(1);
+    }
+
+    size_t length = snprintf(json, size, "{\"workers\":%d,\"forked\":%llu,\"inlined\":%llu,\"helped\":%llu,\"queued\":%d,\"per_worker\":[",
+                             worker_count,
+                             (unsigned long long) __atomic_load_n(&forked, __ATOMIC_RELAXED),
+                             (unsigned long long) __atomic_load_n(&inlined, __ATOMIC_RELAXED),
+                             (unsigned long long) __atomic_load_n(&helped, __ATOMIC_RELAXED),
+                             __atomic_load_n(&queued, __ATOMIC_RELAXED));
+    for (int i = 0; i < worker_count; i++)
+    {
+        pool_worker_t *worker = &workers[i];
+        length += snprintf(json + length, size - length, "%s{\"cpu\":%d,\"executed\":%llu,\"stolen\":%llu,\"sleeps\":%llu}",
+                           i ? "," : "", worker->cpu,
+                           (unsigned long long) __atomic_load_n(&worker->executed, __ATOMIC_RELAXED),
+                           (unsigned long long) __atomic_load_n(&worker->stolen, __ATOMIC_RELAXED),
+                           (unsigned long long) __atomic_load_n(&worker->sleeps, __ATOMIC_RELAXED));
+    }
+    snprintf(json + length, size - length, "]}");
+
+    return json;
+}
+
+int thread_pool_workers()
+{
+    return worker_count;
+}
+
+// Push a task at the bottom of the owner's deque, -1 if it is full
+static int deque_push(pool_deque_t *deque, pool_task_t *task)
+{
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    if (bottom - top >= POOL_DEQUE_SIZE)
+    {
+        return -1;
+    }
+    __atomic_store_n(&deque->tasks[bottom & (POOL_DEQUE_SIZE - 1)], task, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Pop the newest task of the owner's deque, racing thieves for the last one
+static pool_task_t *deque_pop(pool_deque_t *deque)
+{
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    if (top > bottom)
+    {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    pool_task_t *task = __atomic_load_n(&deque->tasks[bottom & (POOL_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (top == bottom)
+    {
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            task = NULL;
+        }
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+// Steal the oldest task of another worker's deque, NULL if empty or lost
+static pool_task_t *deque_steal(pool_deque_t *deque)
+{
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+    if (top >= bottom)
+    {
+        return NULL;
+    }
+    pool_task_t *task = __atomic_load_n(&deque->tasks[top & (POOL_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    {
+        return NULL;
+    }
+    return task;
+}
+
+// Find a task to run: own deque first, then the other workers' deques
+// (starting past self so thieves spread out), then the shared queue
+static pool_task_t *find_task(pool_worker_t *self)
+{
+    pool_task_t *task = NULL;
+    if (self)
+    {
+        task = deque_pop(&self->deque);
+    }
+
+    int start = self ? self->id + 1 : 0;
+    for (int i = 0; !task && i < worker_count; i++)
+    {
+        pool_worker_t *victim = &workers[(start + i) % worker_count];
+        if (victim != self)
+        {
+            task = deque_steal(&victim->deque);
+            if (task && self)
+            {
+                __atomic_add_fetch(&self->stolen, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    if (!task && __atomic_load_n(&shared_head, __ATOMIC_RELAXED))
+    {
+        pthread_mutex_lock(&pool_lock);
+        task = shared_head;
+        if (task)
+        {
+            __atomic_store_n(&shared_head, task->next, __ATOMIC_RELAXED);
+            if (!task->next)
+            {
+                shared_tail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&pool_lock);
+        if (task && self)
+        {
+            __atomic_add_fetch(&self->stolen, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (task)
+    {
+        __atomic_sub_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+    }
+    return task;
+}
+
+// Run a task and wake the joiner if it was the last of its group. Only the
+// last task touches the group lock, and the joiner returns only after taking
+// it, so the group may live on the joiner's stack.
+static void run_task(pool_task_t *task)
+{
+    pool_group_t *group = task->group;
+    task->function(task->arg);
+    free(task);
+
+    if (__atomic_sub_fetch(&group->remaining, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        pthread_mutex_lock(&group->lock);
+        group->done = 1;
+        pthread_cond_broadcast(&group->finished);
+        pthread_mutex_unlock(&group->lock);
+    }
+}
+
+// Run one chunk of a parallel loop
+static void run_range(void *arg)
+{
+    pool_range_t *range = (pool_range_t *) arg;
+    range->function(range->from, range->to, range->arg);
+}
+
+// Pin the calling thread to a core
+static void pin_to_cpu(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    {
+        printf("Error pinning pool worker to CPU %d\n", cpu);
+    }
+#else
+    (void) cpu;
+#endif
+}
+
+// Worker thread: run, steal or sleep until a task is queued
+static void *pool_worker(void *arg)
+{
+    pool_worker_t *self = (pool_worker_t *) arg;
+    current_worker = self;
+    if (self->cpu >= 0)
+    {
+        pin_to_cpu(self->cpu);
+    }
+
+    while (1)
+    {
+        pool_task_t *task = find_task(self);
+        if (task)
+        {
+            run_task(task);
+            __atomic_add_fetch(&self->executed, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // Announce the sleep before checking for work, so a fork either
+        // sees a sleeper to wake or is seen here
+        pthread_mutex_lock(&pool_lock);
+        __atomic_add_fetch(&sleeping, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&queued, __ATOMIC_SEQ_CST) <= 0)
+        {
+            pthread_cond_wait(&work_available, &pool_lock);
+        }
+        __atomic_sub_fetch(&sleeping, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pool_lock);
+        __atomic_add_fetch(&self->sleeps, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+
+// Start the workers, one per core the process may run on unless workers is
+// given. Without init every fork runs inline on the caller.
+void thread_pool_init(int workers_wanted)
+{
+    // Cores the process is allowed on (e.g. by taskset or a cgroup)
+    int cpus[POOL_MAX_WORKERS];
+    int cpu_count = 0;
+#ifdef __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE && cpu_count < POOL_MAX_WORKERS; cpu++)
+        {
+            if (CPU_ISSET(cpu, &set))
+            {
+                cpus[cpu_count++] = cpu;
+            }
+        }
+    }
+#endif
+
+    int count = workers_wanted;
+    if (count <= 0)
+    {
+        count = cpu_count > 0 ? cpu_count : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (count <= 0)
+    {
+        count = 1;
+    }
+    if (count > POOL_MAX_WORKERS)
+    {
+        count = POOL_MAX_WORKERS;
+    }
+
+    workers = (pool_worker_t *) calloc(count, sizeof(pool_worker_t));
+    if (!workers)
+    {
+        printf("Error allocating memory for pool workers\n");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++)
+    {
+        workers[i].id = i;
+        workers[i].cpu = cpu_count > 0 ? cpus[i % cpu_count] : -1;
+    }
+
+    // Publish the workers before any of them can steal from the others
+    __atomic_store_n(&worker_count, count, __ATOMIC_RELEASE);
+    for (int i = 0; i < count; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_worker, &workers[i]) != 0)
+        {
+            printf("Error creating pool worker\n");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+
+    printf("Thread pool started with %d workers\n", count);
+}
+
+void pool_group_init(pool_group_t *group)
+{
+    group->remaining = 1;
+    group->done = 0;
+    pthread_mutex_init(&group->lock, NULL);
+    pthread_cond_init(&group->finished, NULL);
+}
+
+// Queue a task in the group. Workers push on their own deque, other threads
+// on the shared queue; without workers the task runs right away.
+void pool_fork(pool_group_t *group, pool_function_t function, void *arg)
+{
+    if (worker_count == 0)
+    {
+        function(arg);
+        return;
+    }
+
+    pool_task_t *task = malloc(sizeof(pool_task_t));
+    if (!task)
+    {
+        printf("Error allocating memory for task\n");
+        exit(1);
+    }
+    task->function = function;
+    task->arg = arg;
+    task->group = group;
+    task->next = NULL;
+    __atomic_add_fetch(&group->remaining, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&forked, 1, __ATOMIC_RELAXED);
+
+    if (current_worker)
+    {
+        if (deque_push(&current_worker->deque, task) != 0)
+        {
+            __atomic_add_fetch(&inlined, 1, __ATOMIC_RELAXED);
+            run_task(task);
+            return;
+        }
+    }
+    else
+    {
+        pthread_mutex_lock(&pool_lock);
+        if (shared_tail)
+        {
+            shared_tail->next = task;
+        }
+        else
+        {
+            __atomic_store_n(&shared_head, task, __ATOMIC_RELAXED);
+        }
+        shared_tail = task;
+        pthread_mutex_unlock(&pool_lock);
+    }
+
+    // Wake a sleeping worker to take it
+    __atomic_add_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST) > 0)
+    {
+        pthread_mutex_lock(&pool_lock);
+        pthread_cond_signal(&work_available);
+        pthread_mutex_unlock(&pool_lock);
+    }
+}
+
+// Run queued tasks (this group's or any other) while the group has tasks
+// left, then sleep until the last one finishes. The group holds one extra
+// count for the joiner, so a task only finishes it once the joiner is here.
+void pool_join(pool_group_t *group)
+{
+    while (__atomic_load_n(&group->remaining, __ATOMIC_ACQUIRE) > 1)
+    {
+        pool_task_t *task = find_task(current_worker);
+        if (!task)
+        {
+            break;
+        }
+        run_task(task);
+        if (current_worker)
+        {
+            __atomic_add_fetch(&current_worker->executed, 1, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            __atomic_add_fetch(&helped, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (__atomic_sub_fetch(&group->remaining, 1, __ATOMIC_ACQ_REL) > 0)
+    {
+        pthread_mutex_lock(&group->lock);
+        while (!group->done)
+        {
+            pthread_cond_wait(&group->finished, &group->lock);
+        }
+        pthread_mutex_unlock(&group->lock);
+    }
+
+    pthread_mutex_destroy(&group->lock);
+    pthread_cond_destroy(&group->finished);
+}
+
+// Run function over from..to-1 split in chunks of at least grain indices,
+// about four per worker so stealing evens out uneven chunks. The caller runs
+// the first chunk itself; ranges under one grain never leave the caller.
+void pool_parallel_for(int from, int to, int grain, pool_range_function_t function, void *arg)
+{
+    int count = to - from;
+    if (count <= 0)
+    {
+        return;
+    }
+    if (worker_count == 0 || count <= grain)
+    {
+        function(from, to, arg);
+        return;
+    }
+
+    int chunk = (count + 4 * worker_count - 1) / (4 * worker_count);
+    if (chunk < grain)
+    {
+        chunk = grain;
+    }
+    int chunks = (count + chunk - 1) / chunk;
+    pool_range_t *ranges = (pool_range_t *) malloc(sizeof(pool_range_t) * chunks);
+    if (!ranges)
+    {
+        printf("Error allocating memory for parallel loop\n");
+        exit(1);
+    }
+
+    pool_group_t group;
+    pool_group_init(&group);
+    for (int i = 0; i < chunks; i++)
+    {
+        ranges[i].function = function;
+        ranges[i].arg = arg;
+        ranges[i].from = from + i * chunk;
+        ranges[i].to = ranges[i].from + chunk < to ? ranges[i].from + chunk : to;
+        if (i > 0)
+        {
+            pool_fork(&group, run_range, &ranges[i]);
+        }
+    }
+    run_range(&ranges[0]);
+    pool_join(&group);
+    free(ranges);
+}
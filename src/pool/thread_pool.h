@@ -0,0 +1,80 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the definition of the shared work-stealing thread pool.
+ *
+ * One worker per allowed core, each pinned to its core and owning a deque of
+ * tasks. Workers push and pop forked tasks at the bottom of their own deque
+ * and steal from the top of the others' when they run dry, so nested forks
+ * stay on the core that made them and idle cores take the biggest pieces.
+ * Threads outside the pool submit through a shared queue and help run tasks
+ * while they join, so callers never just sit on a core.
+ *
+ * Tasks must not take the chain lock: a joining thread may be holding it and
+ * run any queued task while it waits.
+ *
+ * */
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define POOL_MAX_WORKERS 64                 // Workers started at most
+#define POOL_DEQUE_SIZE 4096                // Tasks per worker deque (power of two)
+
+/***********************/
+/*   DATA STRUCTURES   */
+/***********************/
+
+typedef void (*pool_function_t)(void *arg);
+typedef void (*pool_range_function_t)(int from, int to, void *arg); // Runs heights from..to-1
+
+typedef struct pool_group_t {
+    int remaining;                  // Forked tasks not finished yet, plus one until joined
+    int done;                       // Set under lock by the last task to finish
+    pthread_mutex_t lock;           // Guards done
+    pthread_cond_t finished;        // Signalled when remaining drops to zero
+} pool_group_t;
+
+typedef struct pool_task_t {
+    pool_function_t function;       // Work to run
+    void *arg;                      // Its argument
+    pool_group_t *group;            // Group joined on
+    struct pool_task_t *next;       // Next task in the shared queue
+} pool_task_t;
+
+typedef struct pool_deque_t {
+    int64_t top;                    // Next task to steal
+    int64_t bottom;                 // Next free slot of the owner
+    pool_task_t *tasks[POOL_DEQUE_SIZE];
+} pool_deque_t;
+
+typedef struct pool_worker_t {
+    int id;                         // Index of the worker
+    int cpu;                        // Core the worker is pinned to, -1 if not pinned
+    pool_deque_t deque;             // Tasks forked by this worker
+    uint64_t executed;              // Tasks run
+    uint64_t stolen;                // Tasks taken from other workers or the shared queue
+    uint64_t sleeps;                // Times the worker found no task and slept
+} pool_worker_t;
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+char *thread_pool_stats_to_json();                                  // Workers and task counters as JSON
+int thread_pool_workers();                                          // Workers started, 0 before init
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+void thread_pool_init(int workers);                                 // Start workers, 0 for one per allowed core
+void pool_group_init(pool_group_t *group);                          // Empty group to fork into
+void pool_fork(pool_group_t *group, pool_function_t function, void *arg); // Queue a task in the group
+void pool_join(pool_group_t *group);                                // Help run tasks until the whole group is done
+void pool_parallel_for(int from, int to, int grain, pool_range_function_t function, void *arg); // Split from..to-1 in chunks of at least grain
+
+#endif
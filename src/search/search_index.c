@@ -0,0 +1,491 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the implementation of the block payload search index.
+ *
+ * Blocks are indexed in height order, so every posting list stays sorted by
+ * appending to it and a chain switch only has to drop the tail of the lists
+ * the dropped heights went into.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "search_index.h"
+#include "../tracing/trace.h"
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+
+// FNV-1a hash of length bytes
+static uint64_t hash_bytes(const char *bytes, size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char) bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Copy the next token at *cursor into token and advance past it.
+// Tokens are lowercase runs of ASCII letters and digits. Return 0 at the end.
+static int next_token(const char **cursor, char *token)
+{
+    const char *c = *cursor;
+    while (*c && !isalnum((unsigned char) *c))
+    {
+        c++;
+    }
+    if (*c == '\0')
+    {
+        *cursor = c;
+        return 0;
+    }
+
+    int length = 0;
+    while (*c && isalnum((unsigned char) *c))
+    {
+        if (length < SEARCH_TOKEN_MAX)
+        {
+            token[length++] = tolower((unsigned char) *c);
+        }
+        c++;
+    }
+    token[length] = '\0';
+    *cursor = c;
+    return 1;
+}
+
+// Slot of the token table where token lives or would be inserted
+static int table_slot(search_index_t *index, const char *token)
+{
+    int mask = index->table_capacity - 1;
+    int slot = (int) (hash_bytes(token, strlen(token)) & mask);
+
+    // Linear probing until the token or an empty slot is found
+    while (index->table[slot] && strcmp(index->table[slot]->token, token) != 0)
+    {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Double the token table
+static void table_grow(search_index_t *index)
+{
+    search_token_t **old = index->table;
+    int old_capacity = index->table_capacity;
+
+    index->table_capacity *= 2;
+    index->table = (search_token_t **) calloc(index->table_capacity, sizeof(search_token_t *));
+    if (!index->table)
+    {
+        printf("Error allocating memory for search index\n");
+        exit(1);
+    }
+    for (int i = 0; i < old_capacity; i++)
+    {
+        if (old[i])
+        {
+            index->table[table_slot(index, old[i]->token)] = old[i];
+        }
+    }
+    free(old);
+}
+
+// Posting list of token, created if missing
+static search_token_t *token_entry(search_index_t *index, const char *token)
+{
+    int slot = table_slot(index, token);
+    if (index->table[slot])
+    {
+        return index->table[slot];
+    }
+
+    // Grow at half load
+    if ((index->tokens + 1) * 2 > index->table_capacity)
+    {
+        table_grow(index);
+        slot = table_slot(index, token);
+    }
+
+    search_token_t *entry = (search_token_t *) calloc(1, sizeof(search_token_t));
+    if (!entry)
+    {
+        printf("Error allocating memory for search token\n");
+        exit(1);
+    }
+    entry->token = strdup(token);
+    index->table[slot] = entry;
+    index->tokens++;
+    return entry;
+}
+
+// Set the Bloom filter bits of a payload hash in the filter of its segment
+static void bloom_add(uint8_t *bloom, uint64_t digest)
+{
+    uint64_t step = (digest >> 32) | 1;
+    for (int i = 0; i < SEARCH_BLOOM_HASHES; i++)
+    {
+        uint64_t bit = (digest + i * step) & (SEARCH_BLOOM_BITS - 1);
+        bloom[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+// Whether a segment may contain a payload hash
+static int bloom_may_contain(uint8_t *bloom, uint64_t digest)
+{
+    uint64_t step = (digest >> 32) | 1;
+    for (int i = 0; i < SEARCH_BLOOM_HASHES; i++)
+    {
+        uint64_t bit = (digest + i * step) & (SEARCH_BLOOM_BITS - 1);
+        if (!(bloom[bit / 8] & (1 << (bit % 8))))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Whether a sorted list of heights contains height (binary search)
+static int contains_height(search_token_t *entry, int height)
+{
+    int low = 0;
+    int high = entry->count - 1;
+    while (low <= high)
+    {
+        int middle = (low + high) / 2;
+        if (entry->heights[middle] == height)
+        {
+            return 1;
+        }
+        if (entry->heights[middle] < height)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
+    return 0;
+}
+
+// Matching heights as JSON. Exact matches are checked against the block data,
+// since the Bloom filters and payload hashes only narrow down the candidates.
+char *search_to_json(search_index_t *index, blockchain_t *blockchain, const char *query, bool exact)
+{
+    TRACE_SCOPE("search");
+
+    int count;
+    int *heights;
+    if (exact == TRUE)
+    {
+        heights = search_index_exact(index, query, &count);
+
+        int matches = 0;
+        pthread_rwlock_rdlock(&blockchain->lock);
+        for (int i = 0; i < count; i++)
+        {
+            if (heights[i] >= blockchain->length)
+            {
+                continue;
+            }
+            char *data = get_block_data(blockchain, heights[i]);
+            if (strcmp(data, query) == 0)
+            {
+                heights[matches++] = heights[i];
+            }
+            free(data);
+        }
+        pthread_rwlock_unlock(&blockchain->lock);
+        count = matches;
+    }
+    else
+    {
+        heights = search_index_query(index, query, &count);
+    }
+
+    char *json = malloc(sizeof(char) * (64 + 12 * count));
+    if (!json)
+    {
+        printf("Error allocating memory for search results\n");
+        exit(1);
+    }
+    int length = sprintf(json, "{\"count\":%d,\"heights\":[", count);
+    for (int i = 0; i < count; i++)
+    {
+        length += sprintf(json + length, i ? ",%d" : "%d", heights[i]);
+    }
+    sprintf(json + length, "]}");
+    free(heights);
+
+    return json;
+}
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+
+// Create an empty index
+search_index_t *search_index_create()
+{
+    search_index_t *index = (search_index_t *) calloc(1, sizeof(search_index_t));
+    if (!index)
+    {
+        printf("Error allocating memory for search index\n");
+        exit(1);
+    }
+
+    index->table_capacity = SEARCH_TABLE_CAPACITY;
+    index->table = (search_token_t **) calloc(index->table_capacity, sizeof(search_token_t *));
+    if (!index->table)
+    {
+        printf("Error allocating memory for search index\n");
+        exit(1);
+    }
+    pthread_rwlock_init(&index->lock, NULL);
+
+    return index;
+}
+
+// Index the payload of the block at height. Blocks are added in height
+// order; adding a height already indexed replaces it and every later block.
+void search_index_add(search_index_t *index, int height, const char *data)
+{
+    TRACE_SCOPE("search_add");
+
+    if (height < index->length)
+    {
+        search_index_truncate(index, height);
+    }
+
+    pthread_rwlock_wrlock(&index->lock);
+    if (height != index->length)
+    {
+        printf("Search index expected height %d, got %d\n", index->length, height);
+        exit(1);
+    }
+
+    // Grow per-height arrays
+    if (height >= index->capacity)
+    {
+        int capacity = index->capacity ? index->capacity * 2 : SEARCH_SEGMENT_BLOCKS;
+        int segments = capacity / SEARCH_SEGMENT_BLOCKS;
+        index->digests = realloc(index->digests, sizeof(uint64_t) * capacity);
+        index->blooms = realloc(index->blooms, sizeof(uint8_t *) * segments);
+        index->posting_starts = realloc(index->posting_starts, sizeof(int) * capacity);
+        if (!index->digests || !index->blooms || !index->posting_starts)
+        {
+            printf("Error allocating memory for search index\n");
+            exit(1);
+        }
+        for (int i = index->capacity / SEARCH_SEGMENT_BLOCKS; i < segments; i++)
+        {
+            index->blooms[i] = NULL;
+        }
+        index->capacity = capacity;
+    }
+
+    // Payload hash into the Bloom filter of its segment
+    int segment = height / SEARCH_SEGMENT_BLOCKS;
+    if (!index->blooms[segment])
+    {
+        index->blooms[segment] = calloc(SEARCH_BLOOM_BITS / 8, sizeof(uint8_t));
+        if (!index->blooms[segment])
+        {
+            printf("Error allocating memory for Bloom filter\n");
+            exit(1);
+        }
+    }
+    index->digests[height] = hash_bytes(data, strlen(data));
+    bloom_add(index->blooms[segment], index->digests[height]);
+
+    // Height into the posting list of every token (once per block),
+    // remembering the lists it went into
+    index->posting_starts[height] = index->postings_count;
+    char token[SEARCH_TOKEN_MAX + 1];
+    const char *cursor = data;
+    while (next_token(&cursor, token))
+    {
+        search_token_t *entry = token_entry(index, token);
+        if (entry->count > 0 && entry->heights[entry->count - 1] == height)
+        {
+            continue;
+        }
+        if (entry->count == entry->capacity)
+        {
+            entry->capacity = entry->capacity ? entry->capacity * 2 : 4;
+            entry->heights = realloc(entry->heights, sizeof(int) * entry->capacity);
+            if (!entry->heights)
+            {
+                printf("Error allocating memory for search postings\n");
+                exit(1);
+            }
+        }
+        entry->heights[entry->count++] = height;
+        if (index->postings_count == index->postings_capacity)
+        {
+            index->postings_capacity = index->postings_capacity ? index->postings_capacity * 2 : SEARCH_SEGMENT_BLOCKS;
+            index->postings = realloc(index->postings, sizeof(search_token_t *) * index->postings_capacity);
+            if (!index->postings)
+            {
+                printf("Error allocating memory for search postings\n");
+                exit(1);
+            }
+        }
+        index->postings[index->postings_count++] = entry;
+    }
+
+    index->length = height + 1;
+    pthread_rwlock_unlock(&index->lock);
+}
+
+// Forget the blocks from height length on (e.g. when the chain is replaced)
+void search_index_truncate(search_index_t *index, int length)
+{
+    pthread_rwlock_wrlock(&index->lock);
+    if (length >= index->length)
+    {
+        pthread_rwlock_unlock(&index->lock);
+        return;
+    }
+
+    // Posting lists are sorted, so every dropped height is at the tail of
+    // the lists it went into: drop it from those lists only
+    for (int i = index->posting_starts[length]; i < index->postings_count; i++)
+    {
+        index->postings[i]->count--;
+    }
+    index->postings_count = index->posting_starts[length];
+
+    // Bloom filters cannot forget, so rebuild the segment cut in two
+    int segment = length / SEARCH_SEGMENT_BLOCKS;
+    for (int i = segment + 1; i <= (index->length - 1) / SEARCH_SEGMENT_BLOCKS; i++)
+    {
+        free(index->blooms[i]);
+        index->blooms[i] = NULL;
+    }
+    if (index->blooms[segment])
+    {
+        memset(index->blooms[segment], 0, SEARCH_BLOOM_BITS / 8);
+        for (int height = segment * SEARCH_SEGMENT_BLOCKS; height < length; height++)
+        {
+            bloom_add(index->blooms[segment], index->digests[height]);
+        }
+    }
+
+    index->length = length;
+    pthread_rwlock_unlock(&index->lock);
+}
+
+// Heights of the blocks containing every token of query, ascending.
+// The rarest token's list is walked and the others are binary searched.
+int *search_index_query(search_index_t *index, const char *query, int *count)
+{
+    pthread_rwlock_rdlock(&index->lock);
+
+    // Posting lists of the query tokens, rarest first
+    search_token_t *entries[SEARCH_TOKEN_MAX];
+    int tokens = 0;
+    int missing = 0;
+    char token[SEARCH_TOKEN_MAX + 1];
+    const char *cursor = query;
+    while (tokens < SEARCH_TOKEN_MAX && next_token(&cursor, token))
+    {
+        search_token_t *entry = index->table[table_slot(index, token)];
+        if (!entry || entry->count == 0)
+        {
+            missing = 1;
+            break;
+        }
+        entries[tokens++] = entry;
+        if (entry->count < entries[0]->count)
+        {
+            entries[tokens - 1] = entries[0];
+            entries[0] = entry;
+        }
+    }
+
+    *count = 0;
+    int *heights = malloc(sizeof(int) * (tokens && !missing ? entries[0]->count : 1));
+    if (!heights)
+    {
+        printf("Error allocating memory for search results\n");
+        exit(1);
+    }
+    if (tokens && !missing)
+    {
+        for (int i = 0; i < entries[0]->count; i++)
+        {
+            int height = entries[0]->heights[i];
+            int all = 1;
+            for (int j = 1; j < tokens && all; j++)
+            {
+                all = contains_height(entries[j], height);
+            }
+            if (all)
+            {
+                heights[(*count)++] = height;
+            }
+        }
+    }
+
+    pthread_rwlock_unlock(&index->lock);
+    return heights;
+}
+
+// Heights of the blocks whose payload hash equals the hash of data. Only
+// segments whose Bloom filter may contain the hash are scanned.
+int *search_index_exact(search_index_t *index, const char *data, int *count)
+{
+    uint64_t digest = hash_bytes(data, strlen(data));
+
+    pthread_rwlock_rdlock(&index->lock);
+
+    int capacity = 4;
+    int *heights = malloc(sizeof(int) * capacity);
+    if (!heights)
+    {
+        printf("Error allocating memory for search results\n");
+        exit(1);
+    }
+    *count = 0;
+
+    for (int segment = 0; segment * SEARCH_SEGMENT_BLOCKS < index->length; segment++)
+    {
+        if (!bloom_may_contain(index->blooms[segment], digest))
+        {
+            continue;
+        }
+        int end = (segment + 1) * SEARCH_SEGMENT_BLOCKS;
+        for (int height = segment * SEARCH_SEGMENT_BLOCKS; height < end && height < index->length; height++)
+        {
+            if (index->digests[height] != digest)
+            {
+                continue;
+            }
+            if (*count == capacity)
+            {
+                capacity *= 2;
+                heights = realloc(heights, sizeof(int) * capacity);
+                if (!heights)
+                {
+                    printf("Error allocating memory for search results\n");
+                    exit(1);
+                }
+            }
+            heights[(*count)++] = height;
+        }
+    }
+
+    pthread_rwlock_unlock(&index->lock);
+    return heights;
+}
@@ -0,0 +1,70 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the definition of the block payload search index.
+ *
+ * Token queries go through an inverted index from every token to the sorted
+ * heights of the blocks containing it, so a query costs as much as its
+ * rarest token. Exact payload queries go through one Bloom filter per
+ * segment of blocks, so only segments that may hold the payload are scanned.
+ * Every height also remembers the posting lists it was appended to, so a
+ * reorg only undoes the postings of the heights it drops.
+ *
+ * */
+
+#ifndef SEARCH_INDEX_H
+#define SEARCH_INDEX_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "../blockchain/blockchain.h"
+
+#define SEARCH_TOKEN_MAX 64                 // Longer tokens are truncated
+#define SEARCH_TABLE_CAPACITY 1024          // Initial slots of the token table (power of two)
+#define SEARCH_SEGMENT_BLOCKS 1024          // Blocks covered by one Bloom filter
+#define SEARCH_BLOOM_BITS 16384             // Bits of each Bloom filter (power of two)
+#define SEARCH_BLOOM_HASHES 4               // Bits set per payload
+
+/***********************/
+/*   DATA STRUCTURES   */
+/***********************/
+
+typedef struct search_token_t {
+    char *token;                // Lowercase alphanumeric token
+    int *heights;               // Heights of the blocks containing it, ascending
+    int count;                  // Heights used
+    int capacity;               // Heights allocated
+} search_token_t;
+
+typedef struct search_index_t {
+    search_token_t **table;     // Token table, open addressing
+    int table_capacity;         // Slots in table (power of two)
+    int tokens;                 // Distinct tokens
+    uint64_t *digests;          // Payload hash of each block by height
+    uint8_t **blooms;           // Bloom filter of payload hashes per segment
+    search_token_t **postings;  // Posting lists each height was appended to, in height order
+    int *posting_starts;        // Index in postings of the first one of each height
+    int postings_count;         // Entries used in postings
+    int postings_capacity;      // Entries allocated in postings
+    int length;                 // Blocks indexed
+    int capacity;               // Heights allocated in digests and posting_starts
+    pthread_rwlock_t lock;      // Guards everything above
+} search_index_t;
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+char *search_to_json(search_index_t *index, blockchain_t *blockchain, const char *query, bool exact); // Matching heights as JSON
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+search_index_t *search_index_create();                                      // Create empty index
+void search_index_add(search_index_t *index, int height, const char *data); // Index the next block
+void search_index_truncate(search_index_t *index, int length);              // Forget blocks from height length on
+int *search_index_query(search_index_t *index, const char *query, int *count); // Heights containing every token
+int *search_index_exact(search_index_t *index, const char *data, int *count);  // Heights whose payload may equal data
+
+#endif
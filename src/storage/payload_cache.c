@@ -0,0 +1,508 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the implementation of the block payload cache.
+ *
+ * Payload file layout (network byte order):
+ *   magic (8)
+ *   one record per payload: height (4) | length (4) | block hash (32) | data
+ *
+ * The file is kept across restarts. Opening it scans the record headers to
+ * rebuild the table of offsets and block hashes, the latest record of a
+ * height winning, and drops a torn record left by a crash. The chain then
+ * puts every payload it loads; a payload already on disk for the same block
+ * hash is not written again, which needs no read since the hash commits to
+ * the payload.
+ *
+ * Once superseded records outweigh the current ones by PAYLOAD_COMPACT_MIN,
+ * the next put rewrites the file with the current records only.
+ *
+ * */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include "payload_cache.h"
+#include "../tracing/trace.h"
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+
+// Hit, miss and size stats as JSON
+char *payload_cache_stats_to_json(payload_cache_t *cache)
+{
+    char *json = malloc(sizeof(char) * 512);
+    if (!json)
+    {
+        printf("Error allocating memory for cache stats\n");
+        exit(1);
+    }
+
+    if (cache == NULL)
+    {
+        sprintf(json, "{\"enabled\":false}");
+        return json;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    sprintf(json, "{\"enabled\":true,\"capacity\":%zu,\"used\":%zu,\"entries\":%d,\"hits\":%llu,\"misses\":%llu,\"evictions\":%llu,\"file_length\":%llu,\"live_length\":%llu,\"compactions\":%llu}",
+            cache->capacity, cache->used, cache->entries,
+            (unsigned long long) cache->hits, (unsigned long long) cache->misses,
+            (unsigned long long) cache->evictions, (unsigned long long) cache->file_length,
+            (unsigned long long) cache->live_length, (unsigned long long) cache->compactions);
+    pthread_mutex_unlock(&cache->lock);
+
+    return json;
+}
+
+// Unlink entry from the LRU list
+static void lru_remove(payload_cache_t *cache, payload_entry_t *entry)
+{
+    if (entry->prev)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        cache->head = entry->next;
+    }
+    if (entry->next)
+    {
+        entry->next->prev = entry->prev;
+    }
+    else
+    {
+        cache->tail = entry->prev;
+    }
+}
+
+// Link entry as most recently used
+static void lru_push(payload_cache_t *cache, payload_entry_t *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head)
+    {
+        cache->head->prev = entry;
+    }
+    cache->head = entry;
+    if (!cache->tail)
+    {
+        cache->tail = entry;
+    }
+}
+
+// Cached entry for height, NULL on a miss
+static payload_entry_t *lookup(payload_cache_t *cache, int height)
+{
+    payload_entry_t *entry = cache->buckets[height & (PAYLOAD_CACHE_BUCKETS - 1)];
+    while (entry && entry->height != height)
+    {
+        entry = entry->bucket_next;
+    }
+    return entry;
+}
+
+// Drop an entry from the cache
+static void remove_entry(payload_cache_t *cache, payload_entry_t *entry)
+{
+    lru_remove(cache, entry);
+
+    payload_entry_t **position = &cache->buckets[entry->height & (PAYLOAD_CACHE_BUCKETS - 1)];
+    while (*position != entry)
+    {
+        position = &(*position)->bucket_next;
+    }
+    *position = entry->bucket_next;
+
+    cache->used -= entry->size;
+    cache->entries--;
+    free(entry->data);
+    free(entry);
+}
+
+// Drop the least recently used entry
+static void evict(payload_cache_t *cache)
+{
+    remove_entry(cache, cache->tail);
+    cache->evictions++;
+}
+
+// Cache data for height (takes ownership), evicting entries to make room.
+// Payloads larger than the whole cache are not cached.
+static void insert(payload_cache_t *cache, int height, char *data, size_t length)
+{
+    size_t size = length + 1 + sizeof(payload_entry_t);
+    if (size > cache->capacity)
+    {
+        free(data);
+        return;
+    }
+    while (cache->used + size > cache->capacity)
+    {
+        evict(cache);
+    }
+
+    payload_entry_t *entry = malloc(sizeof(payload_entry_t));
+    if (!entry)
+    {
+        printf("Error allocating memory for cache entry\n");
+        exit(1);
+    }
+    entry->height = height;
+    entry->data = data;
+    entry->size = size;
+
+    int bucket = height & (PAYLOAD_CACHE_BUCKETS - 1);
+    entry->bucket_next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    lru_push(cache, entry);
+
+    cache->used += size;
+    cache->entries++;
+}
+
+// Grow the offset table to hold height, new slots marked as not on disk
+static void grow(payload_cache_t *cache, int height)
+{
+    if (height < cache->heights)
+    {
+        return;
+    }
+    int heights = cache->heights ? cache->heights : 1024;
+    while (heights <= height)
+    {
+        heights *= 2;
+    }
+    cache->offsets = realloc(cache->offsets, sizeof(uint64_t) * heights);
+    cache->lengths = realloc(cache->lengths, sizeof(uint32_t) * heights);
+    cache->hashes = realloc(cache->hashes, (size_t) PAYLOAD_HASH_SIZE * heights);
+    if (!cache->offsets || !cache->lengths || !cache->hashes)
+    {
+        printf("Error allocating memory for payload offsets\n");
+        exit(1);
+    }
+    memset(cache->offsets + cache->heights, 0, sizeof(uint64_t) * (heights - cache->heights));
+    memset(cache->lengths + cache->heights, 0, sizeof(uint32_t) * (heights - cache->heights));
+    memset(cache->hashes + (size_t) PAYLOAD_HASH_SIZE * cache->heights, 0, (size_t) PAYLOAD_HASH_SIZE * (heights - cache->heights));
+    cache->heights = heights;
+}
+
+// Point height to the record at offset, which supersedes the previous one
+static void record(payload_cache_t *cache, int height, uint64_t offset, uint32_t length, const char *hash)
+{
+    grow(cache, height);
+    if (cache->offsets[height] != 0)
+    {
+        cache->live_length -= PAYLOAD_RECORD_HEADER_SIZE + cache->lengths[height];
+    }
+    cache->offsets[height] = offset + PAYLOAD_RECORD_HEADER_SIZE;
+    cache->lengths[height] = length;
+    memcpy(cache->hashes + (size_t) PAYLOAD_HASH_SIZE * height, hash, PAYLOAD_HASH_SIZE);
+    cache->live_length += PAYLOAD_RECORD_HEADER_SIZE + length;
+}
+
+// Return 1 if the record of height on disk is the payload of the block with
+// hash. The block hash covers the payload, so nothing is read back.
+static int on_disk(payload_cache_t *cache, int height, size_t length, const char *hash)
+{
+    return height < cache->heights && cache->offsets[height] != 0 && cache->lengths[height] == length &&
+           memcmp(cache->hashes + (size_t) PAYLOAD_HASH_SIZE * height, hash, PAYLOAD_HASH_SIZE) == 0;
+}
+
+// Return 1 if superseded records outweigh the current ones enough to compact
+static int needs_compaction(payload_cache_t *cache)
+{
+    uint64_t dead = cache->file_length - PAYLOAD_MAGIC_SIZE - cache->live_length;
+    return dead > cache->live_length + PAYLOAD_COMPACT_MIN;
+}
+
+// Rebuild the offset table from the record headers, truncating a torn tail.
+// A file of another format is started over: the chain puts every payload
+// again as it loads.
+static void scan(payload_cache_t *cache)
+{
+    off_t size = lseek(cache->fd, 0, SEEK_END);
+    char magic[PAYLOAD_MAGIC_SIZE];
+    if (size < PAYLOAD_MAGIC_SIZE || pread(cache->fd, magic, PAYLOAD_MAGIC_SIZE, 0) != PAYLOAD_MAGIC_SIZE ||
+        memcmp(magic, PAYLOAD_MAGIC, PAYLOAD_MAGIC_SIZE) != 0)
+    {
+        if (size > 0)
+        {
+            printf("Payload file %s has another format, starting it over\n", cache->path);
+        }
+        if (ftruncate(cache->fd, 0) != 0 || pwrite(cache->fd, PAYLOAD_MAGIC, PAYLOAD_MAGIC_SIZE, 0) != PAYLOAD_MAGIC_SIZE)
+        {
+            printf("Error writing payload file\n");
+            exit(1);
+        }
+        cache->file_length = PAYLOAD_MAGIC_SIZE;
+        return;
+    }
+
+    uint64_t offset = PAYLOAD_MAGIC_SIZE;
+    while (offset + PAYLOAD_RECORD_HEADER_SIZE <= (uint64_t) size)
+    {
+        char header[PAYLOAD_RECORD_HEADER_SIZE];
+        if (pread(cache->fd, header, sizeof(header), offset) != (ssize_t) sizeof(header))
+        {
+            break;
+        }
+        uint32_t height, length;
+        memcpy(&height, header, 4);
+        memcpy(&length, header + 4, 4);
+        height = ntohl(height);
+        length = ntohl(length);
+        if (offset + PAYLOAD_RECORD_HEADER_SIZE + length > (uint64_t) size || height > INT32_MAX)
+        {
+            break;
+        }
+        record(cache, height, offset, length, header + 8);
+        offset += PAYLOAD_RECORD_HEADER_SIZE + length;
+    }
+
+    if (offset < (uint64_t) size)
+    {
+        printf("Truncating torn payload record at offset %llu\n", (unsigned long long) offset);
+        if (ftruncate(cache->fd, offset) != 0)
+        {
+            printf("Error truncating payload file\n");
+            exit(1);
+        }
+    }
+    cache->file_length = offset;
+}
+
+// Rewrite the payload file with only the latest record of every height. The
+// file lock is held exclusively, so no reader holds an offset into the old
+// file while it is replaced.
+static void compact(payload_cache_t *cache)
+{
+    TRACE_SCOPE("payload_compact");
+
+    pthread_rwlock_wrlock(&cache->file_lock);
+    pthread_mutex_lock(&cache->lock);
+    if (!needs_compaction(cache))
+    {
+        pthread_mutex_unlock(&cache->lock);
+        pthread_rwlock_unlock(&cache->file_lock);
+        return;
+    }
+
+    char tmp_path[1024];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache->path);
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || pwrite(fd, PAYLOAD_MAGIC, PAYLOAD_MAGIC_SIZE, 0) != PAYLOAD_MAGIC_SIZE)
+    {
+        printf("Error opening file %s\n", tmp_path);
+        exit(1);
+    }
+
+    // Copy the current records in height order, one at a time
+    char *buffer = NULL;
+    size_t capacity = 0;
+    uint64_t offset = PAYLOAD_MAGIC_SIZE;
+    for (int height = 0; height < cache->heights; height++)
+    {
+        if (cache->offsets[height] == 0)
+        {
+            continue;
+        }
+        size_t length = PAYLOAD_RECORD_HEADER_SIZE + cache->lengths[height];
+        if (length > capacity)
+        {
+            capacity = length;
+            buffer = realloc(buffer, capacity);
+            if (!buffer)
+            {
+                printf("Error allocating memory for payload\n");
+                exit(1);
+            }
+        }
+        if (pread(cache->fd, buffer, length, cache->offsets[height] - PAYLOAD_RECORD_HEADER_SIZE) != (ssize_t) length ||
+            pwrite(fd, buffer, length, offset) != (ssize_t) length)
+        {
+            printf("Error compacting payload file\n");
+            exit(1);
+        }
+        cache->offsets[height] = offset + PAYLOAD_RECORD_HEADER_SIZE;
+        offset += length;
+    }
+    free(buffer);
+
+    if (rename(tmp_path, cache->path) != 0)
+    {
+        printf("Error compacting payload file\n");
+        exit(1);
+    }
+    close(cache->fd);
+    cache->fd = fd;
+    printf("Payload file compacted from %llu to %llu bytes\n", (unsigned long long) cache->file_length, (unsigned long long) offset);
+    cache->file_length = offset;
+    cache->compactions++;
+
+    pthread_mutex_unlock(&cache->lock);
+    pthread_rwlock_unlock(&cache->file_lock);
+}
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+
+// Open the payload file, keeping the payloads of earlier runs, and create an
+// empty cache of capacity bytes
+payload_cache_t *payload_cache_open(const char *path, size_t capacity)
+{
+    payload_cache_t *cache = (payload_cache_t *) calloc(1, sizeof(payload_cache_t));
+    if (!cache || !(cache->path = strdup(path)))
+    {
+        printf("Error allocating memory for payload cache\n");
+        exit(1);
+    }
+
+    cache->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (cache->fd < 0)
+    {
+        printf("Error opening payload file %s\n", path);
+        exit(1);
+    }
+    scan(cache);
+    cache->capacity = capacity;
+    pthread_mutex_init(&cache->lock, NULL);
+
+    // Readers come and go all the time, so compaction must not wait for a
+    // moment without any
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&cache->file_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    return cache;
+}
+
+// Persist the payload of the block at height, whose hash is given, and cache
+// it (takes ownership)
+void payload_cache_put(payload_cache_t *cache, int height, char *data, const char *hash)
+{
+    size_t length = strlen(data);
+
+    pthread_mutex_lock(&cache->lock);
+
+    // Append payload to the file, unless it is already there (e.g. loaded
+    // again after a restart). A block replaced at the same height, e.g.
+    // after a reorg, just points to its new record.
+    if (!on_disk(cache, height, length, hash))
+    {
+        char header[PAYLOAD_RECORD_HEADER_SIZE];
+        uint32_t height_n = htonl((uint32_t) height);
+        uint32_t length_n = htonl((uint32_t) length);
+        memcpy(header, &height_n, 4);
+        memcpy(header + 4, &length_n, 4);
+        memcpy(header + 8, hash, PAYLOAD_HASH_SIZE);
+        if (pwrite(cache->fd, header, sizeof(header), cache->file_length) != (ssize_t) sizeof(header) ||
+            pwrite(cache->fd, data, length, cache->file_length + sizeof(header)) != (ssize_t) length)
+        {
+            printf("Error writing payload file\n");
+            exit(1);
+        }
+        record(cache, height, cache->file_length, length, hash);
+        cache->file_length += sizeof(header) + length;
+    }
+
+    // Replace a stale entry for the same height
+    payload_entry_t *entry = lookup(cache, height);
+    if (entry)
+    {
+        remove_entry(cache, entry);
+    }
+
+    // Freshly added blocks are the most likely to be read next
+    insert(cache, height, data, length);
+
+    int compacting = needs_compaction(cache);
+    pthread_mutex_unlock(&cache->lock);
+
+    if (compacting)
+    {
+        compact(cache);
+    }
+}
+
+// Copy of the payload of the block at height, paged in from disk on a miss.
+// The caller frees the returned string.
+char *payload_cache_get(payload_cache_t *cache, int height)
+{
+    TRACE_SCOPE("payload_get");
+
+    pthread_rwlock_rdlock(&cache->file_lock);
+    pthread_mutex_lock(&cache->lock);
+
+    payload_entry_t *entry = lookup(cache, height);
+    if (entry)
+    {
+        // Hit: move entry to the front
+        cache->hits++;
+        lru_remove(cache, entry);
+        lru_push(cache, entry);
+        char *data = strdup(entry->data);
+        pthread_mutex_unlock(&cache->lock);
+        pthread_rwlock_unlock(&cache->file_lock);
+        return data;
+    }
+
+    cache->misses++;
+    uint64_t offset = cache->offsets[height];
+    uint32_t length = cache->lengths[height];
+    pthread_mutex_unlock(&cache->lock);
+
+    // Miss: read payload without holding the cache lock, the file lock keeps
+    // the offset valid
+    char *data = malloc(sizeof(char) * (length + 1));
+    char *cached = malloc(sizeof(char) * (length + 1));
+    if (!data || !cached)
+    {
+        printf("Error allocating memory for payload\n");
+        exit(1);
+    }
+    if (pread(cache->fd, data, length, offset) != (ssize_t) length)
+    {
+        printf("Error reading payload file\n");
+        exit(1);
+    }
+    data[length] = '\0';
+    memcpy(cached, data, length + 1);
+
+    pthread_mutex_lock(&cache->lock);
+    if (lookup(cache, height) == NULL)
+    {
+        insert(cache, height, cached, length);
+    }
+    else
+    {
+        free(cached);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    pthread_rwlock_unlock(&cache->file_lock);
+
+    return data;
+}
+
+// Length of the payload of the block at height without paging it in
+uint32_t payload_cache_length(payload_cache_t *cache, int height)
+{
+    pthread_mutex_lock(&cache->lock);
+    uint32_t length = cache->lengths[height];
+    pthread_mutex_unlock(&cache->lock);
+
+    return length;
+}
@@ -0,0 +1,82 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the definition of the block payload cache.
+ *
+ * In pruning mode the chain keeps only block headers in memory. Payloads are
+ * written to a payload file and paged back in through a size-bounded LRU
+ * cache, so memory use stays capped while any block can still be read.
+ *
+ * Records superseded by a reorg stay in the file until it is compacted: the
+ * file never grows past twice the bytes of the current records plus
+ * PAYLOAD_COMPACT_MIN.
+ *
+ * */
+
+#ifndef PAYLOAD_CACHE_H
+#define PAYLOAD_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define PAYLOAD_PATH "payloads.dat"         // Default payload file
+#define PAYLOAD_CACHE_BUCKETS 4096          // Hash buckets of the cache (power of two)
+#define PAYLOAD_MAGIC "BCPAYLD2"            // First bytes of the payload file
+#define PAYLOAD_MAGIC_SIZE 8                // Bytes of PAYLOAD_MAGIC
+#define PAYLOAD_HASH_SIZE 32                // Block hash stored with each payload
+#define PAYLOAD_RECORD_HEADER_SIZE 40       // Height, length and block hash before each payload
+#define PAYLOAD_COMPACT_MIN (1 << 20)       // Superseded bytes tolerated before compacting
+
+/***********************/
+/*   DATA STRUCTURES   */
+/***********************/
+
+typedef struct payload_entry_t {
+    int height;                         // Height of the block
+    char *data;                         // Cached payload
+    size_t size;                        // Bytes charged to the cache
+    struct payload_entry_t *prev;       // More recently used entry
+    struct payload_entry_t *next;       // Less recently used entry
+    struct payload_entry_t *bucket_next; // Next entry in the same bucket
+} payload_entry_t;
+
+typedef struct payload_cache_t {
+    char *path;                         // Payload file
+    int fd;                             // Payload file descriptor
+    uint64_t file_length;               // Bytes written to the payload file
+    uint64_t live_length;               // Bytes of the latest record of every height
+    uint64_t *offsets;                  // Offset of each payload by height, 0 if not on disk
+    uint32_t *lengths;                  // Length of each payload by height
+    char *hashes;                       // Block hash of each payload on disk by height
+    int heights;                        // Slots allocated in offsets, lengths and hashes
+    payload_entry_t *buckets[PAYLOAD_CACHE_BUCKETS]; // Entries by height
+    payload_entry_t *head;              // Most recently used entry
+    payload_entry_t *tail;              // Least recently used entry
+    size_t capacity;                    // Maximum bytes cached
+    size_t used;                        // Bytes cached
+    int entries;                        // Entries cached
+    uint64_t hits;                      // Lookups served from memory
+    uint64_t misses;                    // Lookups read from disk
+    uint64_t evictions;                 // Entries dropped to stay under capacity
+    uint64_t compactions;               // Rewrites of the payload file
+    pthread_mutex_t lock;               // Guards everything above
+    pthread_rwlock_t file_lock;         // Held to read the file, exclusively to compact it (taken before lock)
+} payload_cache_t;
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+char *payload_cache_stats_to_json(payload_cache_t *cache);          // Hit, miss and size stats as JSON
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+payload_cache_t *payload_cache_open(const char *path, size_t capacity);  // Open payload file (kept across runs) and empty cache
+void payload_cache_put(payload_cache_t *cache, int height, char *data, const char *hash); // Persist payload of the block with hash and cache it (takes ownership)
+char *payload_cache_get(payload_cache_t *cache, int height);              // Copy of payload, paged in on a miss
+uint32_t payload_cache_length(payload_cache_t *cache, int height);        // Length of payload without paging it in
+
+#endif
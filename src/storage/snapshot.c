@@ -0,0 +1,584 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the implementation of chain snapshots.
+ *
+ * Snapshot layout (network byte order):
+ *   magic (8) | height (4) | tip hash (32) | WAL segment (4)
+ *   for every block, genesis first:
+ *     WAL segment (4) | WAL record length (4) | WAL record offset (8) | block in binary encoding
+ *
+ * The WAL segment of the header is the one started when the snapshot was
+ * taken (0 if the chain was not logged): a restart replays from there. The
+ * WAL location of every block lets the raw records of the heights in sealed
+ * segments be served without reading those segments back.
+ *
+ * The checksum file <path>.sha256 holds "<height> <sha256 of snapshot>". A
+ * snapshot that matches it was written by this node from blocks it had
+ * already validated, so its blocks are not hashed again on load; only the
+ * links between them are checked and the hash index is rebuilt.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <openssl/evp.h>
+#include "snapshot.h"
+#include "payload_cache.h"
+#include "wal.h"
+#include "../blockchain/block_tree.h"
+#include "../tracing/trace.h"
+
+/***********************/
+/*   DATA STRUCTURES   */
+/***********************/
+
+typedef struct background_snapshot_t {
+    blockchain_t *blockchain;       // Chain to snapshot
+    char path[1024];                // Snapshot file
+} background_snapshot_t;
+
+static int background_running = 0;
+static pthread_mutex_t background_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t background_done = PTHREAD_COND_INITIALIZER;
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+
+// Write a whole buffer to path through a temporary file, so that a crash
+// never leaves a half written file in place
+static int write_file_atomic(const char *path, char *buffer, size_t length)
+{
+    char tmp_path[1024];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp == NULL)
+    {
+        printf("Error opening file %s\n", tmp_path);
+        return -1;
+    }
+    if (fwrite(buffer, 1, length, fp) != length || fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+    {
+        printf("Error writing file %s\n", tmp_path);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    return rename(tmp_path, path);
+}
+
+// Read a whole file in memory, NULL if it does not exist
+static char *read_file(const char *path, size_t *length)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        return NULL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    char *buffer = malloc(size + 1);
+    if (!buffer)
+    {
+        printf("Error allocating memory for file\n");
+        exit(1);
+    }
+    if (size < 0 || fread(buffer, 1, size, fp) != (size_t) size)
+    {
+        fclose(fp);
+        free(buffer);
+        return NULL;
+    }
+    fclose(fp);
+
+    buffer[size] = '\0';
+    *length = size;
+    return buffer;
+}
+
+// Write bytes to the snapshot and add them to its digest, 0 on success
+static int write_hashed(FILE *fp, EVP_MD_CTX *ctx, const void *buffer, size_t length)
+{
+    EVP_DigestUpdate(ctx, buffer, length);
+    return fwrite(buffer, 1, length, fp) == length ? 0 : -1;
+}
+
+// Read bytes of the snapshot, 0 on success
+static int read_exact(FILE *fp, void *buffer, size_t length)
+{
+    return fread(buffer, 1, length, fp) == length ? 0 : -1;
+}
+
+// Free a chain restored from a snapshot that turned out to be unusable
+static void discard_restored(blockchain_t *blockchain, uint32_t restored, wal_location_t *locations)
+{
+    for (uint32_t i = 0; i < restored; i++)
+    {
+        free(blockchain->chain[i]->previous_hash);
+        free(blockchain->chain[i]->hash);
+        free(blockchain->chain[i]->data);
+        free(blockchain->chain[i]);
+    }
+    free(blockchain->chain);
+    pthread_rwlock_destroy(&blockchain->lock);
+    free(blockchain);
+    free(locations);
+}
+
+// Background thread: write one snapshot, then let the next one start
+static void *background_worker(void *arg)
+{
+    background_snapshot_t *snapshot = (background_snapshot_t *) arg;
+    snapshot_save(snapshot->blockchain, snapshot->path);
+    free(snapshot);
+
+    pthread_mutex_lock(&background_lock);
+    background_running = 0;
+    pthread_cond_broadcast(&background_done);
+    pthread_mutex_unlock(&background_lock);
+    return NULL;
+}
+
+// Encode the WAL location of a block
+static void location_serialize(wal_location_t *location, char *buffer)
+{
+    uint32_t segment = htonl(location->segment);
+    uint32_t length = htonl(location->length);
+    uint32_t offset_high = htonl((uint32_t) (location->offset >> 32));
+    uint32_t offset_low = htonl((uint32_t) location->offset);
+    memcpy(buffer, &segment, 4);
+    memcpy(buffer + 4, &length, 4);
+    memcpy(buffer + 8, &offset_high, 4);
+    memcpy(buffer + 12, &offset_low, 4);
+}
+
+// Decode the WAL location of a block
+static void location_deserialize(char *buffer, wal_location_t *location)
+{
+    uint32_t segment, length, offset_high, offset_low;
+    memcpy(&segment, buffer, 4);
+    memcpy(&length, buffer + 4, 4);
+    memcpy(&offset_high, buffer + 8, 4);
+    memcpy(&offset_low, buffer + 12, 4);
+    location->segment = ntohl(segment);
+    location->length = ntohl(length);
+    location->offset = ((uint64_t) ntohl(offset_high) << 32) | ntohl(offset_low);
+}
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+
+// Write a snapshot of the chain and its checkpoint. The blocks are captured
+// and the WAL is rotated under one read lock, so the segments sealed by now
+// hold exactly the blocks of the snapshot. Block headers never change, so the
+// chain is then only held again to read payloads, SNAPSHOT_CHUNK blocks at a
+// time, and the file is written and synced without holding it. A reorg that
+// replaces captured blocks meanwhile abandons the snapshot.
+int snapshot_save(blockchain_t *blockchain, const char *path)
+{
+    TRACE_SCOPE("snapshot_save");
+
+    char tmp_path[1024];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp == NULL)
+    {
+        printf("Error opening file %s\n", tmp_path);
+        return -1;
+    }
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (!ctx)
+    {
+        printf("Error allocating memory for snapshot digest\n");
+        exit(1);
+    }
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    int failed = 0;
+    int abandoned = 0;
+
+    // Capture the blocks and start a new WAL segment, replayed after this
+    // snapshot
+    pthread_rwlock_rdlock(&blockchain->lock);
+    int length = blockchain->length;
+    block_t **blocks = (block_t **) malloc(sizeof(block_t *) * length);
+    if (!blocks)
+    {
+        printf("Error allocating memory for snapshot\n");
+        exit(1);
+    }
+    memcpy(blocks, blockchain->chain, sizeof(block_t *) * length);
+    uint32_t segment = 0;
+    wal_location_t *locations = NULL;
+    if (blockchain->wal)
+    {
+        segment = wal_rotate(blockchain->wal, length, &locations);
+    }
+    pthread_rwlock_unlock(&blockchain->lock);
+
+    // Header
+    char header[SNAPSHOT_HEADER_SIZE];
+    uint32_t height = htonl(length);
+    uint32_t segment_n = htonl(segment);
+    memcpy(header, SNAPSHOT_MAGIC, 8);
+    memcpy(header + 8, &height, 4);
+    memcpy(header + 12, blocks[length - 1]->hash, BLOCK_HASH_LENGTH);
+    memcpy(header + 12 + BLOCK_HASH_LENGTH, &segment_n, 4);
+    failed |= write_hashed(fp, ctx, header, sizeof(header));
+
+    // Blocks, one chunk at a time
+    char *data[SNAPSHOT_CHUNK];
+    for (int first = 0; first < length && !failed; first += SNAPSHOT_CHUNK)
+    {
+        int count = length - first < SNAPSHOT_CHUNK ? length - first : SNAPSHOT_CHUNK;
+
+        // Pruned payloads are paged in under the lock, as long as the
+        // captured blocks are still the active ones at their heights
+        pthread_rwlock_rdlock(&blockchain->lock);
+        abandoned = blockchain->length < first + count;
+        for (int i = 0; i < count && !abandoned; i++)
+        {
+            abandoned = blockchain->chain[first + i] != blocks[first + i];
+        }
+        for (int i = 0; i < count && !abandoned; i++)
+        {
+            data[i] = get_block_data(blockchain, first + i);
+        }
+        pthread_rwlock_unlock(&blockchain->lock);
+        if (abandoned)
+        {
+            printf("Snapshot at height %d abandoned, a reorg replaced its blocks\n", length);
+            failed = 1;
+            break;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            // WAL location
+            wal_location_t none = {0, 0, 0};
+            char location[SNAPSHOT_LOCATION_SIZE];
+            location_serialize(locations ? &locations[first + i] : &none, location);
+            failed |= write_hashed(fp, ctx, location, sizeof(location));
+
+            // Block
+            block_t block = *blocks[first + i];
+            block.data = data[i];
+            char *buffer = malloc(block_serialized_size(&block));
+            if (!buffer)
+            {
+                printf("Error allocating memory for snapshot\n");
+                exit(1);
+            }
+            size_t size = block_serialize(&block, buffer);
+            failed |= write_hashed(fp, ctx, buffer, size);
+            free(buffer);
+            free(data[i]);
+        }
+    }
+    free(locations);
+    free(blocks);
+
+    // Checksum of the whole snapshot
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    EVP_DigestFinal_ex(ctx, digest, NULL);
+    EVP_MD_CTX_free(ctx);
+
+    if (failed || fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+    {
+        if (!abandoned)
+        {
+            printf("Error writing file %s\n", tmp_path);
+        }
+        fclose(fp);
+        unlink(tmp_path);
+        return -1;
+    }
+    fclose(fp);
+
+    char *digest_string = get_ascii_hash((char *) digest);
+    char checksum[128];
+    int checksum_length = sprintf(checksum, "%d %s\n", length, digest_string);
+    free(digest_string);
+
+    // The snapshot goes first: a stale checksum only rejects the new snapshot
+    char checksum_path[1024];
+    snprintf(checksum_path, sizeof(checksum_path), "%s.sha256", path);
+    int result = rename(tmp_path, path);
+    if (result == 0)
+    {
+        result = write_file_atomic(checksum_path, checksum, checksum_length);
+    }
+
+    if (result == 0)
+    {
+        printf("Snapshot saved at height %d\n", length);
+    }
+    return result;
+}
+
+// Load the snapshot at path if it matches its checksum. The node validated
+// these blocks before saving them, so they are trusted up to the snapshot
+// height: only their links are checked, and the blocks the WAL adds past it
+// are validated as they are replayed. trusted is an optional checkpoint
+// "<height> <block hash>" (NULL or empty for none) the snapshot must agree
+// with. With payloads the chain is pruned as it loads, one payload in memory
+// at a time. With wal the WAL locations of the blocks are restored, and
+// replay starts at the segment that followed the snapshot.
+blockchain_t *snapshot_load(const char *path, struct payload_cache_t *payloads, const char *trusted, struct wal_t *wal)
+{
+    TRACE_SCOPE("snapshot_load");
+
+    // Parse trusted checkpoint
+    int trusted_height = -1;
+    char trusted_hash[BLOCK_HASH_LENGTH * 2 + 1];
+    if (trusted && trusted[0] != '\0')
+    {
+        if (sscanf(trusted, "%d %64s", &trusted_height, trusted_hash) != 2 || trusted_height < 0 ||
+            strlen(trusted_hash) != BLOCK_HASH_LENGTH * 2)
+        {
+            printf("Invalid trusted checkpoint \"%s\", expected \"<height> <block hash>\"\n", trusted);
+            return NULL;
+        }
+    }
+
+    // Read checksum
+    char checksum_path[1024];
+    snprintf(checksum_path, sizeof(checksum_path), "%s.sha256", path);
+    size_t checksum_length;
+    char *checksum = read_file(checksum_path, &checksum_length);
+    if (checksum == NULL)
+    {
+        return NULL;
+    }
+    int checksum_height;
+    char checksum_digest[BLOCK_HASH_LENGTH * 2 + 1];
+    int fields = sscanf(checksum, "%d %64s", &checksum_height, checksum_digest);
+    free(checksum);
+    if (fields != 2)
+    {
+        printf("Invalid checksum %s\n", checksum_path);
+        return NULL;
+    }
+
+    // Check the snapshot against the checksum, streaming it through the
+    // digest. The same open file is parsed afterwards.
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        return NULL;
+    }
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (!ctx)
+    {
+        printf("Error allocating memory for snapshot digest\n");
+        exit(1);
+    }
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+    {
+        EVP_DigestUpdate(ctx, chunk, n);
+    }
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    EVP_DigestFinal_ex(ctx, digest, NULL);
+    EVP_MD_CTX_free(ctx);
+    char *digest_string = get_ascii_hash((char *) digest);
+    int intact = strcmp(digest_string, checksum_digest) == 0;
+    free(digest_string);
+
+    char header[SNAPSHOT_HEADER_SIZE];
+    rewind(fp);
+    if (!intact || read_exact(fp, header, sizeof(header)) != 0 || memcmp(header, SNAPSHOT_MAGIC, 8) != 0)
+    {
+        printf("Snapshot %s does not match its checksum\n", path);
+        fclose(fp);
+        return NULL;
+    }
+    uint32_t height, segment;
+    memcpy(&height, header + 8, 4);
+    memcpy(&segment, header + 12 + BLOCK_HASH_LENGTH, 4);
+    height = ntohl(height);
+    segment = ntohl(segment);
+    if (height == 0 || (int) height != checksum_height)
+    {
+        printf("Snapshot %s does not match its checksum height\n", path);
+        fclose(fp);
+        return NULL;
+    }
+
+    // Restore blocks
+    blockchain_t *blockchain = (blockchain_t *) malloc(sizeof(blockchain_t));
+    blockchain->chain = (block_t **) malloc(sizeof(block_t *) * height);
+    wal_location_t *locations = (wal_location_t *) malloc(sizeof(wal_location_t) * height);
+    if (!blockchain->chain || !locations)
+    {
+        printf("Error allocating memory for blockchain\n");
+        exit(1);
+    }
+    blockchain->length = height;
+    blockchain->index = NULL;
+    pthread_rwlock_init(&blockchain->lock, NULL);
+    blockchain->wal = NULL;
+    blockchain->payloads = payloads;
+    blockchain->search = NULL;
+    blockchain->subscriptions = NULL;
+    blockchain->responses = NULL;
+
+    // Any damage past the checksum rejects the snapshot as a whole
+    block_t *genesis = get_genesis_block();
+    const char *error = NULL;
+    uint32_t restored = 0;
+    for (uint32_t i = 0; i < height; i++)
+    {
+        // Read one block at a time, after its WAL location
+        char location[SNAPSHOT_LOCATION_SIZE];
+        char block_header[BLOCK_HEADER_SIZE];
+        uint32_t data_length;
+        char *buffer = NULL;
+        if (read_exact(fp, location, SNAPSHOT_LOCATION_SIZE) == 0 && read_exact(fp, block_header, BLOCK_HEADER_SIZE) == 0)
+        {
+            memcpy(&data_length, block_header + BLOCK_HEADER_SIZE - 4, 4);
+            data_length = ntohl(data_length);
+            buffer = malloc(BLOCK_HEADER_SIZE + (size_t) data_length);
+            if (!buffer)
+            {
+                printf("Error allocating memory for block\n");
+                exit(1);
+            }
+            memcpy(buffer, block_header, BLOCK_HEADER_SIZE);
+        }
+        if (buffer == NULL || read_exact(fp, buffer + BLOCK_HEADER_SIZE, data_length) != 0)
+        {
+            free(buffer);
+            error = "is truncated";
+            break;
+        }
+        size_t consumed;
+        block_t *block = block_deserialize(buffer, BLOCK_HEADER_SIZE + data_length, &consumed);
+        free(buffer);
+        if (block == NULL)
+        {
+            error = "holds a corrupt block";
+            break;
+        }
+        blockchain->chain[restored++] = block;
+        location_deserialize(location, &locations[i]);
+
+        // Every block links to the one before it, starting from genesis
+        int linked = i == 0 ? memcmp(block->hash, genesis->hash, BLOCK_HASH_LENGTH) == 0
+                            : block->previous_hash && memcmp(block->previous_hash, blockchain->chain[i - 1]->hash, BLOCK_HASH_LENGTH) == 0;
+        if (!linked)
+        {
+            error = "breaks the chain";
+            break;
+        }
+
+        // The checkpoint block must be in the snapshot at its height
+        if ((int) i == trusted_height)
+        {
+            char *hash = get_ascii_hash(block->hash);
+            int same = strcmp(hash, trusted_hash) == 0;
+            free(hash);
+            if (!same)
+            {
+                error = "does not contain the trusted checkpoint";
+                break;
+            }
+        }
+
+        // In pruning mode only the headers stay in memory, genesis is kept
+        if (payloads && i > 0)
+        {
+            payload_cache_put(payloads, i, block->data, block->hash);
+            block->data = NULL;
+        }
+    }
+    free(genesis->hash);
+    free(genesis);
+    fclose(fp);
+
+    // The last block is the tip the header names
+    if (!error && memcmp(blockchain->chain[height - 1]->hash, header + 12, BLOCK_HASH_LENGTH) != 0)
+    {
+        error = "does not end at its tip";
+    }
+    if (error)
+    {
+        printf("Snapshot %s %s, replaying the whole WAL\n", path, error);
+        discard_restored(blockchain, restored, locations);
+        return NULL;
+    }
+
+    // Rebuild the hash index rather than trusting one from the file
+    blockchain_rebuild_index(blockchain);
+
+    // Raw records of the snapshot heights stay in their sealed segments
+    if (wal && segment > 0)
+    {
+        wal_restore(wal, segment, locations, height);
+    }
+    free(locations);
+
+    // Side branches are not saved, the tree starts from the active chain
+    blockchain->tree = block_tree_create(blockchain->chain, blockchain->length);
+
+    printf("Snapshot loaded at height %u\n", height);
+    return blockchain;
+}
+
+// Write a snapshot on a background thread, so that the caller (the miner)
+// never waits for serialization or fsync. At most one snapshot runs at a
+// time: -1 if one is already running, 0 once the thread is started.
+int snapshot_save_async(blockchain_t *blockchain, const char *path)
+{
+    pthread_mutex_lock(&background_lock);
+    if (background_running)
+    {
+        pthread_mutex_unlock(&background_lock);
+        return -1;
+    }
+    background_running = 1;
+    pthread_mutex_unlock(&background_lock);
+
+    background_snapshot_t *snapshot = (background_snapshot_t *) malloc(sizeof(background_snapshot_t));
+    if (!snapshot)
+    {
+        printf("Error allocating memory for snapshot\n");
+        exit(1);
+    }
+    snapshot->blockchain = blockchain;
+    snprintf(snapshot->path, sizeof(snapshot->path), "%s", path);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, background_worker, snapshot) != 0)
+    {
+        printf("Error creating snapshot thread\n");
+        exit(1);
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// Wait until the background snapshot, if any, is written
+void snapshot_wait()
+{
+    pthread_mutex_lock(&background_lock);
+    while (background_running)
+    {
+        pthread_cond_wait(&background_done, &background_lock);
+    }
+    pthread_mutex_unlock(&background_lock);
+}
@@ -0,0 +1,43 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the definition of chain snapshots.
+ *
+ * A snapshot stores the blocks, the tip and where the WAL stood, so that a
+ * node can restart without rehashing the chain or replaying the blocks
+ * logged before it. Next to every snapshot a checksum file records its
+ * height and SHA256; a snapshot whose contents do not match its checksum is
+ * never loaded.
+ *
+ * The node only snapshots blocks it has validated, so a snapshot that
+ * matches its checksum is trusted up to its height and only the blocks the
+ * WAL adds after it are validated. A "<height> <block hash>" checkpoint given
+ * by the operator (TRUSTED_CHECKPOINT) or compiled in additionally pins the
+ * chain the snapshot must be on.
+ *
+ * */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "../blockchain/blockchain.h"
+
+#define SNAPSHOT_PATH "snapshot.dat"        // Default snapshot file
+#define SNAPSHOT_INTERVAL 1000              // Blocks between two snapshots
+#define SNAPSHOT_MAGIC "BCSNAP03"           // First bytes of a snapshot file
+#define SNAPSHOT_HEADER_SIZE 48             // Magic, height, tip hash and WAL segment
+#define SNAPSHOT_LOCATION_SIZE 16           // WAL location before every block
+#define SNAPSHOT_CHUNK 256                  // Blocks whose payloads are read under one chain lock
+#define SNAPSHOT_TRUSTED_CHECKPOINT ""      // Compiled-in "<height> <block hash>", empty for none
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+int snapshot_save(blockchain_t *blockchain, const char *path);  // Write snapshot and checksum, 0 on success
+int snapshot_save_async(blockchain_t *blockchain, const char *path);    // Write snapshot on a background thread, -1 if one is already running
+void snapshot_wait();                                           // Wait for the background snapshot, if any
+blockchain_t *snapshot_load(const char *path, struct payload_cache_t *payloads, const char *trusted, struct wal_t *wal); // Load snapshot trusted up to its height, NULL if missing or corrupt
+
+#endif
@@ -0,0 +1,708 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the implementation of the block write-ahead log.
+ *
+ * Record layout (network byte order):
+ *   block length (4) | height (4) | block in binary encoding
+ *
+ * Blocks kept on a side branch are logged too, with WAL_SIDE_BRANCH set in
+ * their height, so that replay rebuilds the same block tree. Only records of
+ * the active chain are indexed by height; a side block that later becomes
+ * active is logged again by the reorg.
+ *
+ * A record cut short by a crash is dropped on replay and the log truncated.
+ * The log doubles as the block segment file: the segment and offset of every
+ * height are kept in memory so ranges of records can be sent straight from
+ * the page cache with sendfile.
+ *
+ * wal_rotate seals the live file as <path>.<segment> (segments are numbered
+ * from 1 and never rewritten) and starts an empty one. A snapshot rotates
+ * the log while it holds the chain, stores the locations of its heights and
+ * the number of the new segment, and a restart from it replays from there.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include "wal.h"
+#include "../tracing/trace.h"
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+
+// Parse a durability policy: "always", "off" or "interval:<ms>"
+wal_sync_policy_t wal_parse_policy(const char *policy, int *interval_ms)
+{
+    *interval_ms = WAL_SYNC_INTERVAL_MS;
+
+    if (policy == NULL || strcmp(policy, "always") == 0)
+    {
+        return WAL_SYNC_ALWAYS;
+    }
+    if (strcmp(policy, "off") == 0)
+    {
+        return WAL_SYNC_OFF;
+    }
+    if (strncmp(policy, "interval", 8) == 0)
+    {
+        if (policy[8] == ':' && atoi(policy + 9) > 0)
+        {
+            *interval_ms = atoi(policy + 9);
+        }
+        return WAL_SYNC_INTERVAL;
+    }
+
+    printf("Unknown WAL sync policy %s, using always\n", policy);
+    return WAL_SYNC_ALWAYS;
+}
+
+// Write a whole buffer to the log
+static void write_all(int fd, char *buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = write(fd, buffer, length);
+        if (n < 0)
+        {
+            printf("Error writing to WAL\n");
+            exit(1);
+        }
+        buffer += n;
+        length -= n;
+    }
+}
+
+// Path of a sealed segment
+static void segment_path(wal_t *wal, uint32_t segment, char *path, size_t size)
+{
+    snprintf(path, size, "%s.%u", wal->path, segment);
+}
+
+// Make room for the locations of heights below heights, the lock must be held
+static void reserve_locations(wal_t *wal, int heights)
+{
+    if (heights <= wal->heights)
+    {
+        return;
+    }
+    int capacity = wal->heights ? wal->heights : 1024;
+    while (capacity < heights)
+    {
+        capacity *= 2;
+    }
+    wal->locations = realloc(wal->locations, sizeof(wal_location_t) * capacity);
+    if (!wal->locations)
+    {
+        printf("Error allocating memory for WAL locations\n");
+        exit(1);
+    }
+    memset(wal->locations + wal->heights, 0, sizeof(wal_location_t) * (capacity - wal->heights));
+    wal->heights = capacity;
+}
+
+// Remember where the record of height lives in the log, the lock must be held
+static void record_offset(wal_t *wal, int height, uint32_t segment, uint64_t offset, uint32_t length)
+{
+    reserve_locations(wal, height + 1);
+    wal->locations[height].offset = offset;
+    wal->locations[height].length = length;
+    wal->locations[height].segment = segment;
+}
+
+// Flusher thread: write buffered records and sync them in one go
+static void *wal_flusher(void *arg)
+{
+    wal_t *wal = (wal_t *) arg;
+
+    while (1)
+    {
+        if (wal->policy == WAL_SYNC_INTERVAL)
+        {
+            struct timespec period = {wal->interval_ms / 1000, (long) (wal->interval_ms % 1000) * 1000000};
+            nanosleep(&period, NULL);
+        }
+
+        // Take every record appended so far
+        pthread_mutex_lock(&wal->lock);
+        while (wal->buffer_length == 0)
+        {
+            pthread_cond_wait(&wal->pending, &wal->lock);
+        }
+        char *buffer = wal->buffer;
+        size_t length = wal->buffer_length;
+        uint64_t seq = wal->appended_seq;
+        wal->buffer = NULL;
+        wal->buffer_length = 0;
+        wal->buffer_capacity = 0;
+        pthread_mutex_unlock(&wal->lock);
+
+        // Records appended meanwhile wait for the next round
+        {
+            TRACE_SCOPE("wal_flush");
+            write_all(wal->fd, buffer, length);
+            if (wal->policy != WAL_SYNC_OFF && fdatasync(wal->fd) != 0)
+            {
+                printf("Error syncing WAL\n");
+                exit(1);
+            }
+        }
+        free(buffer);
+
+        pthread_mutex_lock(&wal->lock);
+        wal->durable_seq = seq;
+        wal->written_length += length;
+        pthread_cond_broadcast(&wal->flushed);
+        pthread_mutex_unlock(&wal->lock);
+    }
+
+    return NULL;
+}
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+
+// Open the log at path and start its flusher thread. The live file comes
+// after the sealed segments <path>.1, <path>.2, ...
+wal_t *wal_open(const char *path, wal_sync_policy_t policy, int interval_ms)
+{
+    wal_t *wal = (wal_t *) malloc(sizeof(wal_t));
+    if (!wal || !(wal->path = strdup(path)))
+    {
+        printf("Error allocating memory for WAL\n");
+        exit(1);
+    }
+
+    wal->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (wal->fd < 0)
+    {
+        printf("Error opening WAL %s\n", path);
+        exit(1);
+    }
+
+    // Number the live segment after the sealed ones
+    wal->segment = 1;
+    while (1)
+    {
+        char sealed[1024];
+        struct stat st;
+        segment_path(wal, wal->segment, sealed, sizeof(sealed));
+        if (stat(sealed, &st) != 0)
+        {
+            break;
+        }
+        wal->segment++;
+    }
+    wal->replay_segment = 1;
+
+    wal->policy = policy;
+    wal->interval_ms = interval_ms;
+    wal->buffer = NULL;
+    wal->buffer_length = 0;
+    wal->buffer_capacity = 0;
+    wal->appended_seq = 0;
+    wal->durable_seq = 0;
+    wal->appended_length = 0;
+    wal->written_length = 0;
+    wal->locations = NULL;
+    wal->heights = 0;
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->pending, NULL);
+    pthread_cond_init(&wal->flushed, NULL);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, wal_flusher, wal) != 0)
+    {
+        printf("Error creating WAL flusher thread\n");
+        exit(1);
+    }
+    pthread_detach(thread);
+
+    return wal;
+}
+
+// Buffer a record for the block at height, return its sequence number.
+// Callers append under the chain write lock, so active records come in
+// height order; side records are not indexed.
+uint64_t wal_append(wal_t *wal, block_t *block, int height, int side)
+{
+    size_t length = block_serialized_size(block);
+
+    pthread_mutex_lock(&wal->lock);
+
+    // Grow buffer
+    if (wal->buffer_length + WAL_RECORD_HEADER_SIZE + length > wal->buffer_capacity)
+    {
+        size_t capacity = wal->buffer_capacity ? wal->buffer_capacity * 2 : 4096;
+        while (capacity < wal->buffer_length + WAL_RECORD_HEADER_SIZE + length)
+        {
+            capacity *= 2;
+        }
+        wal->buffer = realloc(wal->buffer, capacity);
+        if (!wal->buffer)
+        {
+            printf("Error allocating memory for WAL buffer\n");
+            exit(1);
+        }
+        wal->buffer_capacity = capacity;
+    }
+
+    // Record header and block
+    char *record = wal->buffer + wal->buffer_length;
+    uint32_t length_n = htonl(length);
+    uint32_t height_n = htonl(side ? (uint32_t) height | WAL_SIDE_BRANCH : (uint32_t) height);
+    memcpy(record, &length_n, 4);
+    memcpy(record + 4, &height_n, 4);
+    block_serialize(block, record + WAL_RECORD_HEADER_SIZE);
+    wal->buffer_length += WAL_RECORD_HEADER_SIZE + length;
+    if (!side)
+    {
+        record_offset(wal, height, wal->segment, wal->appended_length, WAL_RECORD_HEADER_SIZE + length);
+    }
+    wal->appended_length += WAL_RECORD_HEADER_SIZE + length;
+
+    uint64_t seq = ++wal->appended_seq;
+    pthread_cond_signal(&wal->pending);
+    pthread_mutex_unlock(&wal->lock);
+
+    return seq;
+}
+
+// Wait until the record with the given sequence number is durable.
+// Only WAL_SYNC_ALWAYS waits, the other policies trade durability for latency.
+void wal_wait(wal_t *wal, uint64_t seq)
+{
+    if (wal->policy != WAL_SYNC_ALWAYS)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&wal->lock);
+    while (wal->durable_seq < seq)
+    {
+        pthread_cond_wait(&wal->flushed, &wal->lock);
+    }
+    pthread_mutex_unlock(&wal->lock);
+}
+
+// Number of leading blocks of a chain of the given length whose records are
+// durable (per policy). Records are appended in height order, so the ones
+// not durable yet are the newest heights of the live segment; heights never
+// logged (genesis) and sealed segments count as durable.
+int wal_durable_length(wal_t *wal, int length)
+{
+    pthread_mutex_lock(&wal->lock);
+    uint64_t durable = wal->policy == WAL_SYNC_ALWAYS ? wal->written_length : wal->appended_length;
+    while (length > 0 && length - 1 < wal->heights && wal->locations[length - 1].length > 0 &&
+           wal->locations[length - 1].segment == wal->segment &&
+           wal->locations[length - 1].offset + wal->locations[length - 1].length > durable)
+    {
+        length--;
+    }
+    pthread_mutex_unlock(&wal->lock);
+
+    return length;
+}
+
+// Feed a batch of logged blocks through receive_blocks, which hashes them on
+// the thread pool. Return the number of blocks replayed.
+static int replay_batch(blockchain_t *blockchain, block_t **blocks, uint32_t *heights, int count)
+{
+    int statuses[WAL_REPLAY_BATCH];
+    uint64_t seq;
+    receive_blocks(blockchain, blocks, count, statuses, &seq);
+
+    // Blocks restored from the snapshot are already known, side records
+    // rebuild the side branches and records logged by a reorg switch the
+    // chain again just as they did live
+    int replayed = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (statuses[i] == BLOCK_KNOWN)
+        {
+            free(blocks[i]->previous_hash);
+            free(blocks[i]->hash);
+            free(blocks[i]->data);
+            free(blocks[i]);
+            continue;
+        }
+        if (statuses[i] == BLOCK_ORPHAN || statuses[i] == BLOCK_INVALID)
+        {
+            printf("WAL contains an invalid block at height %u\n", heights[i]);
+            exit(1);
+        }
+        replayed++;
+    }
+    return replayed;
+}
+
+// Replay the records of one segment, reading it WAL_REPLAY_CHUNK bytes at a
+// time so the log never sits in memory as a whole. Return the length of the
+// complete records, anything after them is a torn record.
+static uint64_t replay_segment(wal_t *wal, blockchain_t *blockchain, int fd, uint32_t segment, int *replayed)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        printf("Error reading WAL\n");
+        exit(1);
+    }
+    uint64_t size = st.st_size;
+
+    size_t capacity = WAL_REPLAY_CHUNK;
+    char *buffer = malloc(capacity);
+    if (!buffer)
+    {
+        printf("Error allocating memory for WAL\n");
+        exit(1);
+    }
+
+    // buffer holds the log from offset on, up to filled bytes
+    block_t *blocks[WAL_REPLAY_BATCH];
+    uint32_t heights[WAL_REPLAY_BATCH];
+    int count = 0;
+    uint64_t offset = 0;
+    size_t start = 0;
+    size_t filled = 0;
+    while (offset < size)
+    {
+        // Bytes the next record needs, stop at a torn one
+        size_t needed = WAL_RECORD_HEADER_SIZE;
+        uint32_t length = 0, height = 0;
+        if (filled - start >= WAL_RECORD_HEADER_SIZE)
+        {
+            memcpy(&length, buffer + start, 4);
+            memcpy(&height, buffer + start + 4, 4);
+            length = ntohl(length);
+            height = ntohl(height);
+            needed += length;
+        }
+        if (offset + needed > size)
+        {
+            break;
+        }
+
+        // Read the next chunk behind what is left of the current one, with
+        // room for a record larger than a chunk
+        if (filled - start < needed)
+        {
+            memmove(buffer, buffer + start, filled - start);
+            filled -= start;
+            start = 0;
+            if (needed > capacity)
+            {
+                capacity = needed;
+                buffer = realloc(buffer, capacity);
+                if (!buffer)
+                {
+                    printf("Error allocating memory for WAL\n");
+                    exit(1);
+                }
+            }
+            ssize_t n = pread(fd, buffer + filled, capacity - filled, offset + filled);
+            if (n <= 0)
+            {
+                printf("Error reading WAL\n");
+                exit(1);
+            }
+            filled += n;
+            continue;
+        }
+
+        size_t consumed;
+        block_t *block = block_deserialize(buffer + start + WAL_RECORD_HEADER_SIZE, length, &consumed);
+        if (block == NULL || consumed != length)
+        {
+            break;
+        }
+        if (!(height & WAL_SIDE_BRANCH))
+        {
+            record_offset(wal, height, segment, offset, needed);
+        }
+        start += needed;
+        offset += needed;
+
+        blocks[count] = block;
+        heights[count] = height & ~WAL_SIDE_BRANCH;
+        count++;
+        if (count == WAL_REPLAY_BATCH)
+        {
+            *replayed += replay_batch(blockchain, blocks, heights, count);
+            count = 0;
+        }
+    }
+    *replayed += replay_batch(blockchain, blocks, heights, count);
+    free(buffer);
+
+    if (offset < size)
+    {
+        printf("Torn WAL record in segment %u at offset %llu\n", segment, (unsigned long long) offset);
+    }
+    return offset;
+}
+
+// Feed the logged blocks the chain does not know yet (e.g. those added after
+// the snapshot) through receive_blocks, which checks each of them against
+// its parent. Segments sealed before the snapshot are skipped. Return the
+// number of blocks replayed.
+int wal_replay(wal_t *wal, blockchain_t *blockchain)
+{
+    TRACE_SCOPE("wal_replay");
+
+    int replayed = 0;
+    for (uint32_t segment = wal->replay_segment; segment < wal->segment; segment++)
+    {
+        char sealed[1024];
+        segment_path(wal, segment, sealed, sizeof(sealed));
+        int fd = open(sealed, O_RDONLY);
+        if (fd < 0)
+        {
+            printf("Error opening WAL segment %s\n", sealed);
+            exit(1);
+        }
+        replay_segment(wal, blockchain, fd, segment, &replayed);
+        close(fd);
+    }
+
+    // Drop a torn record left by a crash, only the live segment can have one
+    uint64_t offset = replay_segment(wal, blockchain, wal->fd, wal->segment, &replayed);
+    struct stat st;
+    if (fstat(wal->fd, &st) == 0 && offset < (uint64_t) st.st_size && ftruncate(wal->fd, offset) != 0)
+    {
+        printf("Error truncating WAL\n");
+        exit(1);
+    }
+    wal->appended_length = offset;
+    wal->written_length = offset;
+
+    printf("Replayed %d blocks from WAL\n", replayed);
+    return replayed;
+}
+
+// Seal the live segment and start a new one. Callers hold the chain lock, so
+// no record is appended meanwhile: the sealed segments hold exactly the
+// heights below length, whose locations are copied to *locations. Return the
+// number of the new live segment.
+uint32_t wal_rotate(wal_t *wal, int length, wal_location_t **locations)
+{
+    TRACE_SCOPE("wal_rotate");
+
+    pthread_mutex_lock(&wal->lock);
+
+    // Let the flusher write what was appended, then make it durable whatever
+    // the policy: a sealed segment is never synced again
+    while (wal->written_length < wal->appended_length)
+    {
+        pthread_cond_wait(&wal->flushed, &wal->lock);
+    }
+    if (fdatasync(wal->fd) != 0)
+    {
+        printf("Error syncing WAL\n");
+        exit(1);
+    }
+
+    // An empty live segment is reused
+    if (wal->written_length > 0)
+    {
+        char sealed[1024];
+        segment_path(wal, wal->segment, sealed, sizeof(sealed));
+        if (rename(wal->path, sealed) != 0)
+        {
+            printf("Error sealing WAL segment %s\n", sealed);
+            exit(1);
+        }
+        int fd = open(wal->path, O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (fd < 0)
+        {
+            printf("Error opening WAL %s\n", wal->path);
+            exit(1);
+        }
+        close(wal->fd);
+        wal->fd = fd;
+        wal->segment++;
+        wal->appended_length = 0;
+        wal->written_length = 0;
+    }
+
+    reserve_locations(wal, length);
+    *locations = (wal_location_t *) malloc(sizeof(wal_location_t) * (length > 0 ? length : 1));
+    if (!*locations)
+    {
+        printf("Error allocating memory for WAL locations\n");
+        exit(1);
+    }
+    memcpy(*locations, wal->locations, sizeof(wal_location_t) * length);
+    uint32_t segment = wal->segment;
+
+    pthread_mutex_unlock(&wal->lock);
+
+    printf("WAL rotated, live segment %u\n", segment);
+    return segment;
+}
+
+// Take the locations of the heights below length from a snapshot, and
+// replay only from the segment that was live when it was taken
+void wal_restore(wal_t *wal, uint32_t segment, wal_location_t *locations, int length)
+{
+    pthread_mutex_lock(&wal->lock);
+    reserve_locations(wal, length);
+    memcpy(wal->locations, locations, sizeof(wal_location_t) * length);
+    wal->replay_segment = segment;
+    pthread_mutex_unlock(&wal->lock);
+}
+
+// Take the spans of the log holding the records of heights from..to, under
+// one lock hold so they describe a single state of the log even if a reorg
+// logs those heights again right after. Records are never overwritten and
+// sealed segments keep them, so the spans stay valid; contiguous records of
+// a segment are merged into one span. Wait until the spans of the live
+// segment reached the kernel. Return -1 if a record is not logged.
+int wal_range_open(wal_t *wal, int from, int to, wal_range_t *range)
+{
+    range->spans = NULL;
+    range->count = 0;
+    range->length = 0;
+    if (from < 1 || from > to)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&wal->lock);
+    if (to >= wal->heights)
+    {
+        pthread_mutex_unlock(&wal->lock);
+        return -1;
+    }
+    range->spans = (wal_span_t *) malloc(sizeof(wal_span_t) * (to - from + 1));
+    if (!range->spans)
+    {
+        printf("Error allocating memory for WAL range\n");
+        exit(1);
+    }
+    uint32_t live = wal->segment;
+    uint64_t end = 0;
+    for (int height = from; height <= to; height++)
+    {
+        wal_location_t *location = &wal->locations[height];
+        if (location->length == 0)
+        {
+            pthread_mutex_unlock(&wal->lock);
+            wal_range_close(range);
+            return -1;
+        }
+        wal_span_t *last = range->count ? &range->spans[range->count - 1] : NULL;
+        if (last && last->segment == location->segment && last->offset + last->length == location->offset)
+        {
+            last->length += location->length;
+        }
+        else
+        {
+            range->spans[range->count].offset = location->offset;
+            range->spans[range->count].length = location->length;
+            range->spans[range->count].segment = location->segment;
+            range->count++;
+        }
+        range->length += location->length;
+        if (location->segment == live && location->offset + location->length > end)
+        {
+            end = location->offset + location->length;
+        }
+    }
+    // A rotation meanwhile seals the live segment with all its records
+    while (wal->segment == live && wal->written_length < end)
+    {
+        pthread_cond_wait(&wal->flushed, &wal->lock);
+    }
+    pthread_mutex_unlock(&wal->lock);
+
+    return 0;
+}
+
+// Descriptor of a segment for reading, the live one may be sealed meanwhile
+static int open_segment(wal_t *wal, uint32_t segment)
+{
+    pthread_mutex_lock(&wal->lock);
+    int fd = segment == wal->segment ? dup(wal->fd) : -1;
+    pthread_mutex_unlock(&wal->lock);
+    if (fd < 0)
+    {
+        char sealed[1024];
+        segment_path(wal, segment, sealed, sizeof(sealed));
+        fd = open(sealed, O_RDONLY);
+    }
+    return fd;
+}
+
+// Send exactly the spans of a range to sockfd without copying them into the
+// process. Return 0 on success, -1 if the socket failed.
+int wal_range_send(wal_t *wal, wal_range_t *range, int sockfd)
+{
+    TRACE_SCOPE("wal_send_range");
+
+    int fd = -1;
+    for (int i = 0; i < range->count; i++)
+    {
+        // Consecutive spans of a segment share its descriptor
+        if (i == 0 || range->spans[i].segment != range->spans[i - 1].segment)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            fd = open_segment(wal, range->spans[i].segment);
+            if (fd < 0)
+            {
+                return -1;
+            }
+        }
+
+        off_t offset = range->spans[i].offset;
+        size_t count = range->spans[i].length;
+        while (count > 0)
+        {
+#ifdef __linux__
+            ssize_t n = sendfile(sockfd, fd, &offset, count);
+#else
+            char chunk[65536];
+            ssize_t n = pread(fd, chunk, count < sizeof(chunk) ? count : sizeof(chunk), offset);
+            if (n > 0)
+            {
+                n = write(sockfd, chunk, n);
+                offset += n > 0 ? n : 0;
+            }
+#endif
+            if (n <= 0)
+            {
+                close(fd);
+                return -1;
+            }
+            count -= n;
+        }
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    return 0;
+}
+
+void wal_range_close(wal_range_t *range)
+{
+    free(range->spans);
+    range->spans = NULL;
+    range->count = 0;
+}
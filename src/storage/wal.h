@@ -0,0 +1,102 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the definition of the block write-ahead log.
+ *
+ * Appended blocks are buffered and written by a single flusher thread, so
+ * every block appended while a flush is in progress shares the next
+ * fdatasync (group commit).
+ *
+ * Every snapshot rotates the log: the live file is sealed as a numbered
+ * segment and a new one is started, so a restart from the snapshot only
+ * replays the segments written after it. Sealed segments are kept, they
+ * still serve the raw records of their heights and let a node without a
+ * usable snapshot replay the whole chain.
+ *
+ * */
+
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "../blockchain/blockchain.h"
+
+#define WAL_PATH "blocks.wal"               // Default log file
+#define WAL_RECORD_HEADER_SIZE 8            // Block length and height before each record
+#define WAL_SYNC_INTERVAL_MS 10             // Default flush period of WAL_SYNC_INTERVAL
+#define WAL_REPLAY_BATCH 1024               // Records hashed in parallel on replay
+#define WAL_REPLAY_CHUNK (1 << 20)          // Bytes of the log read at a time on replay
+#define WAL_SIDE_BRANCH 0x80000000u         // Height flag of records of side branch blocks
+
+/***********************/
+/*   DATA STRUCTURES   */
+/***********************/
+
+typedef enum wal_sync_policy_t {
+    WAL_SYNC_ALWAYS,        // Appends wait until their block is on disk
+    WAL_SYNC_INTERVAL,      // Flush and sync every interval_ms, appends do not wait
+    WAL_SYNC_OFF            // Write without syncing, appends do not wait
+} wal_sync_policy_t;
+
+typedef struct wal_location_t {
+    uint64_t offset;                // Start of the record in its segment
+    uint32_t length;                // Bytes in the record, 0 if the height is not logged
+    uint32_t segment;               // Segment holding the record
+} wal_location_t;
+
+typedef struct wal_t {
+    char *path;                     // Live log file, sealed segments are <path>.<segment>
+    int fd;                         // Live log file descriptor
+    uint32_t segment;               // Number of the live segment
+    uint32_t replay_segment;        // First segment replayed (the one after the snapshot)
+    wal_sync_policy_t policy;       // Durability policy
+    int interval_ms;                // Flush period of WAL_SYNC_INTERVAL
+    char *buffer;                   // Records not yet handed to the flusher
+    size_t buffer_length;           // Bytes used in buffer
+    size_t buffer_capacity;         // Bytes allocated for buffer
+    uint64_t appended_seq;          // Sequence number of the last appended record
+    uint64_t durable_seq;           // Sequence number of the last record on disk
+    uint64_t appended_length;       // Live segment length including buffered records
+    uint64_t written_length;        // Live segment length handed to the kernel
+    wal_location_t *locations;      // Latest record of each height
+    int heights;                    // Slots allocated in locations
+    pthread_mutex_t lock;           // Guards buffer and sequence numbers
+    pthread_cond_t pending;         // Signalled when records are appended
+    pthread_cond_t flushed;         // Signalled when records become durable
+} wal_t;
+
+typedef struct wal_span_t {
+    uint64_t offset;                // Start of the span in its segment
+    uint64_t length;                // Bytes in the span
+    uint32_t segment;               // Segment holding the span
+} wal_span_t;
+
+typedef struct wal_range_t {
+    wal_span_t *spans;              // Spans of the log holding the records, in height order
+    int count;                      // Spans used
+    uint64_t length;                // Bytes in all spans
+} wal_range_t;
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+wal_sync_policy_t wal_parse_policy(const char *policy, int *interval_ms);   // "always", "off" or "interval:<ms>"
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+wal_t *wal_open(const char *path, wal_sync_policy_t policy, int interval_ms);   // Open log and start flusher
+uint64_t wal_append(wal_t *wal, block_t *block, int height, int side);          // Buffer a record, return its sequence number
+void wal_wait(wal_t *wal, uint64_t seq);                                        // Wait until a record is durable (per policy)
+int wal_durable_length(wal_t *wal, int length);                                 // Leading blocks of a chain whose records are durable
+int wal_replay(wal_t *wal, blockchain_t *blockchain);                           // Receive logged blocks the chain does not know, return count
+uint32_t wal_rotate(wal_t *wal, int length, wal_location_t **locations);         // Seal the live segment, copy locations of heights below length
+void wal_restore(wal_t *wal, uint32_t segment, wal_location_t *locations, int length); // Take locations from a snapshot, replay from segment on
+int wal_range_open(wal_t *wal, int from, int to, wal_range_t *range);          // Snapshot the records of heights from..to, -1 if not logged
+int wal_range_send(wal_t *wal, wal_range_t *range, int sockfd);                 // Send exactly the snapshot from the page cache
+void wal_range_close(wal_range_t *range);                                       // Free the snapshot
+
+#endif
@@ -0,0 +1,165 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the implementation of the hot-path tracer.
+ *
+ * Every thread records into a ring buffer taken from a fixed pool, so memory
+ * stays bounded even though the API server spawns a thread per connection.
+ * A buffer goes back to the pool when its thread exits and keeps its events
+ * until a new thread overwrites them.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "trace.h"
+
+typedef struct trace_buffer_t {
+    trace_event_t events[TRACE_BUFFER_EVENTS];  // Ring of recorded events
+    uint64_t count;                             // Total events ever written
+    int in_use;                                 // Owned by a live thread
+} trace_buffer_t;
+
+int trace_enabled = 0;
+
+static trace_buffer_t buffers[TRACE_MAX_BUFFERS];
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_key_once = PTHREAD_ONCE_INIT;
+static int next_tid = 1;
+static uint64_t dropped_events = 0;
+
+static __thread trace_buffer_t *thread_buffer = NULL;
+static __thread int thread_tid = 0;
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+
+// Monotonic time in microseconds
+uint64_t trace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Give the buffer back to the pool when its thread exits
+static void release_buffer(void *buffer)
+{
+    pthread_mutex_lock(&buffers_lock);
+    ((trace_buffer_t *) buffer)->in_use = 0;
+    pthread_mutex_unlock(&buffers_lock);
+}
+
+static void create_buffer_key()
+{
+    pthread_key_create(&buffer_key, release_buffer);
+}
+
+// Take a free ring buffer from the pool for the calling thread
+static trace_buffer_t *claim_buffer()
+{
+    pthread_once(&buffer_key_once, create_buffer_key);
+
+    trace_buffer_t *buffer = NULL;
+    pthread_mutex_lock(&buffers_lock);
+    for (int i = 0; i < TRACE_MAX_BUFFERS; i++)
+    {
+        if (!buffers[i].in_use)
+        {
+            buffer = &buffers[i];
+            buffer->in_use = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&buffers_lock);
+
+    if (buffer)
+    {
+        pthread_setspecific(buffer_key, buffer);
+    }
+    thread_tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
+    return buffer;
+}
+
+// Record a completed scope in the ring buffer of the calling thread
+void trace_record(const char *name, uint64_t start)
+{
+    uint64_t end = trace_now();
+
+    if (!thread_buffer)
+    {
+        thread_buffer = claim_buffer();
+        if (!thread_buffer)
+        {
+            // More live threads than buffers, drop the event
+            __atomic_fetch_add(&dropped_events, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    uint64_t count = thread_buffer->count;
+    trace_event_t *event = &thread_buffer->events[count % TRACE_BUFFER_EVENTS];
+    event->name = name;
+    event->start = start;
+    event->duration = end - start;
+    event->tid = thread_tid;
+    __atomic_store_n(&thread_buffer->count, count + 1, __ATOMIC_RELEASE);
+}
+
+// Dump all ring buffers as Chrome trace_event JSON.
+// Buffers are read while other threads may be writing, so the oldest events
+// of a busy buffer can be torn; this is acceptable for a diagnostic dump.
+char *trace_to_json()
+{
+    // Snapshot the event counts, each event takes well under 128 characters
+    uint64_t counts[TRACE_MAX_BUFFERS];
+    size_t events = 0;
+    for (int i = 0; i < TRACE_MAX_BUFFERS; i++)
+    {
+        counts[i] = __atomic_load_n(&buffers[i].count, __ATOMIC_ACQUIRE);
+        events += counts[i] > TRACE_BUFFER_EVENTS ? TRACE_BUFFER_EVENTS : counts[i];
+    }
+    char *json = malloc((events + TRACE_MAX_BUFFERS) * 128 + 128);
+    if (!json)
+    {
+        printf("Error allocating memory for trace\n");
+        exit(1);
+    }
+
+    size_t len = sprintf(json, "{\"traceEvents\":[");
+    int first = 1;
+    for (int i = 0; i < TRACE_MAX_BUFFERS; i++)
+    {
+        uint64_t count = counts[i];
+        uint64_t begin = count > TRACE_BUFFER_EVENTS ? count - TRACE_BUFFER_EVENTS : 0;
+        for (uint64_t j = begin; j < count; j++)
+        {
+            trace_event_t *event = &buffers[i].events[j % TRACE_BUFFER_EVENTS];
+            len += sprintf(json + len, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":1,\"tid\":%d}",
+                           first ? "" : ",", event->name,
+                           (unsigned long long) event->start, (unsigned long long) event->duration, event->tid);
+            first = 0;
+        }
+    }
+    sprintf(json + len, "],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":%llu}}",
+            (unsigned long long) __atomic_load_n(&dropped_events, __ATOMIC_RELAXED));
+
+    return json;
+}
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+
+// Start or stop recording
+void trace_set_enabled(int enabled)
+{
+    __atomic_store_n(&trace_enabled, enabled, __ATOMIC_RELAXED);
+}
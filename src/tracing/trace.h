@@ -0,0 +1,81 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the definition of the hot-path tracer.
+ *
+ * Trace scopes are compiled in only when TRACING is defined (see Makefile).
+ * When compiled in but disabled, a scope costs one relaxed load and a branch.
+ *
+ * */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_BUFFER_EVENTS 4096    // Events kept in each ring buffer
+#define TRACE_MAX_BUFFERS 64        // Ring buffers shared by all threads
+
+/***********************/
+/*   DATA STRUCTURES   */
+/***********************/
+
+typedef struct trace_event_t {
+    const char *name;       // Name of the scope (static string)
+    uint64_t start;         // Start time in microseconds
+    uint64_t duration;      // Duration in microseconds
+    int tid;                // Thread that recorded the event
+} trace_event_t;
+
+typedef struct trace_scope_t {
+    const char *name;       // Name of the scope, NULL if tracing was disabled
+    uint64_t start;         // Start time in microseconds
+} trace_scope_t;
+
+extern int trace_enabled;
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+uint64_t trace_now();                               // Monotonic time in microseconds
+void trace_record(const char *name, uint64_t start); // Record a completed scope
+char *trace_to_json();                              // Dump all ring buffers as Chrome trace_event JSON
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+void trace_set_enabled(int enabled);                // Start or stop recording
+
+static inline trace_scope_t trace_scope_begin(const char *name)
+{
+    trace_scope_t scope = {NULL, 0};
+    if (__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED))
+    {
+        scope.name = name;
+        scope.start = trace_now();
+    }
+    return scope;
+}
+
+static inline void trace_scope_end(trace_scope_t *scope)
+{
+    if (scope->name)
+    {
+        trace_record(scope->name, scope->start);
+    }
+}
+
+// TRACE_SCOPE("name") records the time until the end of the enclosing block
+#ifdef TRACING
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) \
+    trace_scope_t TRACE_CONCAT(trace_scope_, __LINE__) __attribute__((cleanup(trace_scope_end))) = trace_scope_begin(name)
+#else
+#define TRACE_SCOPE(name)
+#endif
+
+#endif
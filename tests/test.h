@@ -0,0 +1,30 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the check macro shared by the test programs.
+ *
+ * Every tests/test_*.c file is a program of its own, built against the node
+ * sources by 'make test'. A failed check prints where it failed and exits
+ * with status 1, which stops the run.
+ *
+ * */
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHECK(condition)                                                                    \
+    do                                                                                      \
+    {                                                                                       \
+        if (!(condition))                                                                   \
+        {                                                                                   \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);            \
+            exit(1);                                                                        \
+        }                                                                                   \
+    } while (0)
+
+#endif
@@ -0,0 +1,123 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the tests of the block tree: every ancestor found
+ * through the skip pointers is the one reached by walking parents, common
+ * ancestors of branches forked at any height are found, and orphans are
+ * refused.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/blockchain/block_tree.h"
+#include "test.h"
+
+#define TEST_LENGTH 600             // Blocks of the main chain
+#define TEST_BRANCH_LENGTH 40       // Blocks of each side branch
+#define TEST_FORK_STEP 37           // Heights between two side branches
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+
+// Mine a block on top of parent with a payload naming it
+static block_t *mine(block_t *parent, const char *branch, int height)
+{
+    char data[64];
+    sprintf(data, "%s %d", branch, height);
+    return mine_block(parent, strdup(data));
+}
+
+// Ancestor at height found by walking parent pointers
+static tree_node_t *walk(tree_node_t *node, int height)
+{
+    while (node && node->height > height)
+    {
+        node = node->parent;
+    }
+    return node;
+}
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+
+int main()
+{
+    // Linear chain
+    block_t **chain = (block_t **) malloc(sizeof(block_t *) * TEST_LENGTH);
+    CHECK(chain != NULL);
+    chain[0] = get_genesis_block();
+    for (int i = 1; i < TEST_LENGTH; i++)
+    {
+        chain[i] = mine(chain[i - 1], "main", i);
+    }
+    block_tree_t *tree = block_tree_create(chain, TEST_LENGTH);
+    CHECK(tree->count == TEST_LENGTH);
+    CHECK(tree->tips_count == 1);
+
+    // Nodes, heights and work of the chain
+    tree_node_t *tip = block_tree_find(tree, chain[TEST_LENGTH - 1]->hash);
+    CHECK(tip != NULL && tip->height == TEST_LENGTH - 1);
+    CHECK(tip->work == (uint64_t) TEST_LENGTH * BLOCK_TREE_BLOCK_WORK);
+    for (int i = 0; i < TEST_LENGTH; i++)
+    {
+        tree_node_t *node = block_tree_find(tree, chain[i]->hash);
+        CHECK(node != NULL && node->block == chain[i] && node->height == i);
+        CHECK(node->skip == NULL || node->skip->height < node->height);
+    }
+
+    // Skip pointers reach every ancestor of the tip
+    for (int height = 0; height < TEST_LENGTH; height++)
+    {
+        tree_node_t *ancestor = block_tree_ancestor(tip, height);
+        CHECK(ancestor == walk(tip, height));
+        CHECK(ancestor->block == chain[height]);
+    }
+
+    // Side branches forked along the chain
+    for (int fork = 0; fork < TEST_LENGTH - 1; fork += TEST_FORK_STEP)
+    {
+        char name[32];
+        sprintf(name, "side-%d", fork);
+        block_t *parent = chain[fork];
+        tree_node_t *node = NULL;
+        for (int i = 1; i <= TEST_BRANCH_LENGTH; i++)
+        {
+            block_t *block = mine(parent, name, fork + i);
+            node = block_tree_insert(tree, block);
+            CHECK(node != NULL && node->height == fork + i);
+            CHECK(node->work == (uint64_t) (fork + i + 1) * BLOCK_TREE_BLOCK_WORK);
+            parent = block;
+        }
+
+        // Fork point from either side, and ancestors along the branch
+        CHECK(block_tree_common_ancestor(node, tip)->block == chain[fork]);
+        CHECK(block_tree_common_ancestor(tip, node)->block == chain[fork]);
+        CHECK(block_tree_common_ancestor(node, node) == node);
+        for (int height = 0; height <= node->height; height++)
+        {
+            CHECK(block_tree_ancestor(node, height) == walk(node, height));
+        }
+
+        // Fork point of a node of the main chain below the fork
+        tree_node_t *below = block_tree_find(tree, chain[fork / 2]->hash);
+        CHECK(block_tree_common_ancestor(node, below) == below);
+    }
+    CHECK(tree->tips_count == 1 + (TEST_LENGTH - 2) / TEST_FORK_STEP + 1);
+
+    // Known blocks are found, orphans are refused
+    block_t *parentless = mine(chain[10], "orphan-parent", 11);
+    block_t *orphan = mine(parentless, "orphan", 12);
+    CHECK(block_tree_insert(tree, orphan) == NULL);
+    CHECK(block_tree_find(tree, orphan->hash) == NULL);
+    CHECK(block_tree_insert(tree, parentless) != NULL);
+    CHECK(block_tree_insert(tree, orphan) != NULL);
+
+    printf("test_block_tree: passed\n");
+    return 0;
+}
@@ -0,0 +1,97 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the tests of the HTTP request helpers: Accept and
+ * Accept-Encoding negotiation for GET /blocks, If-None-Match matching and
+ * the ETags of the different representations.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/networking/http_api.h"
+#include "test.h"
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+
+// Build a GET /blocks request carrying one header (none if NULL)
+static char *request_with(const char *header)
+{
+    static char request[1024];
+    sprintf(request, "GET /blocks HTTP/1.1\r\nHost: localhost\r\n%s%s\r\n", header ? header : "", header ? "\r\n" : "");
+    return request;
+}
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+
+int main()
+{
+    // Header lookup is case insensitive and trims leading spaces
+    char value[64];
+    CHECK(http_header_value(request_with("accept-ENCODING:   gzip"), "Accept-Encoding", value, sizeof(value)) == 1);
+    CHECK(strcmp(value, "gzip") == 0);
+    CHECK(http_header_value(request_with(NULL), "Accept-Encoding", value, sizeof(value)) == 0);
+    CHECK(http_header_value(request_with("Accept-Encodings: gzip"), "Accept-Encoding", value, sizeof(value)) == 0);
+
+    // Accept-Encoding: gzip over deflate, q=0 refuses a coding
+    CHECK(http_accept_encoding(request_with(NULL)) == HTTP_ENCODING_IDENTITY);
+    CHECK(http_accept_encoding(request_with("Accept-Encoding: gzip")) == HTTP_ENCODING_GZIP);
+    CHECK(http_accept_encoding(request_with("Accept-Encoding: deflate")) == HTTP_ENCODING_DEFLATE);
+    CHECK(http_accept_encoding(request_with("Accept-Encoding: deflate, gzip")) == HTTP_ENCODING_GZIP);
+    CHECK(http_accept_encoding(request_with("Accept-Encoding: gzip;q=0, deflate")) == HTTP_ENCODING_DEFLATE);
+    CHECK(http_accept_encoding(request_with("Accept-Encoding: gzip;q=0.0")) == HTTP_ENCODING_IDENTITY);
+    CHECK(http_accept_encoding(request_with("Accept-Encoding: br, identity")) == HTTP_ENCODING_IDENTITY);
+    CHECK(http_accept_encoding(request_with("Accept-Encoding: *")) == HTTP_ENCODING_GZIP);
+    CHECK(http_accept_encoding(request_with("Accept-Encoding: X-GZIP")) == HTTP_ENCODING_GZIP);
+
+    // Accept: binary only when preferred over JSON, wildcards do not count
+    CHECK(http_accept_format(request_with(NULL)) == HTTP_FORMAT_JSON);
+    CHECK(http_accept_format(request_with("Accept: */*")) == HTTP_FORMAT_JSON);
+    CHECK(http_accept_format(request_with("Accept: application/octet-stream")) == HTTP_FORMAT_BINARY);
+    CHECK(http_accept_format(request_with("Accept: application/json, application/octet-stream")) == HTTP_FORMAT_JSON);
+    CHECK(http_accept_format(request_with("Accept: application/json;q=0.5, application/octet-stream")) == HTTP_FORMAT_BINARY);
+    CHECK(http_accept_format(request_with("Accept: application/octet-stream;q=0.2, application/json;q=0.9")) == HTTP_FORMAT_JSON);
+    CHECK(http_accept_format(request_with("Accept: APPLICATION/OCTET-STREAM")) == HTTP_FORMAT_BINARY);
+    CHECK(strcmp(http_format_type(HTTP_FORMAT_BINARY), "application/octet-stream") == 0);
+    CHECK(strcmp(http_format_type(HTTP_FORMAT_JSON), "application/json") == 0);
+
+    // Every format and encoding has its own ETag
+    char etags[HTTP_FORMATS][HTTP_ENCODINGS][HTTP_ETAG_SIZE];
+    for (int format = 0; format < HTTP_FORMATS; format++)
+    {
+        for (int encoding = 0; encoding < HTTP_ENCODINGS; encoding++)
+        {
+            http_representation_etag("\"12-abcd\"", format, encoding, etags[format][encoding]);
+            CHECK(etags[format][encoding][0] == '"');
+            CHECK(etags[format][encoding][strlen(etags[format][encoding]) - 1] == '"');
+        }
+    }
+    CHECK(strcmp(etags[HTTP_FORMAT_JSON][HTTP_ENCODING_IDENTITY], "\"12-abcd\"") == 0);
+    CHECK(strcmp(etags[HTTP_FORMAT_JSON][HTTP_ENCODING_GZIP], "\"12-abcd-gzip\"") == 0);
+    CHECK(strcmp(etags[HTTP_FORMAT_BINARY][HTTP_ENCODING_DEFLATE], "\"12-abcd-bin-deflate\"") == 0);
+    for (int i = 0; i < HTTP_FORMATS * HTTP_ENCODINGS; i++)
+    {
+        for (int j = i + 1; j < HTTP_FORMATS * HTTP_ENCODINGS; j++)
+        {
+            CHECK(strcmp(etags[i / HTTP_ENCODINGS][i % HTTP_ENCODINGS], etags[j / HTTP_ENCODINGS][j % HTTP_ENCODINGS]) != 0);
+        }
+    }
+
+    // If-None-Match: lists, weak tags and * match, other representations do not
+    CHECK(http_etag_matches(request_with(NULL), "\"12-abcd\"") == 0);
+    CHECK(http_etag_matches(request_with("If-None-Match: \"12-abcd\""), "\"12-abcd\"") == 1);
+    CHECK(http_etag_matches(request_with("If-None-Match: \"1-x\", W/\"12-abcd-gzip\""), "\"12-abcd-gzip\"") == 1);
+    CHECK(http_etag_matches(request_with("If-None-Match: *"), "\"12-abcd\"") == 1);
+    CHECK(http_etag_matches(request_with("If-None-Match: \"12-abcd\""), "\"12-abcd-gzip\"") == 0);
+    CHECK(http_etag_matches(request_with("If-None-Match: \"12-abcd-gzip\""), "\"12-abcd\"") == 0);
+
+    printf("test_http_api: passed\n");
+    return 0;
+}
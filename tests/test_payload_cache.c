@@ -0,0 +1,205 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the tests of the payload cache: payloads come back
+ * through the LRU cache and from disk, a restart keeps the file and does not
+ * write a payload again for the same block, a torn record or a file of
+ * another format is dropped, and payloads replaced by reorgs are compacted
+ * away while readers keep reading.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "../src/storage/payload_cache.h"
+#include "test.h"
+
+#define TEST_HEIGHTS 64             // Heights put in the cache
+#define TEST_CAPACITY 4096          // Bytes of the LRU cache, far less than the payloads
+#define TEST_LARGE 65536            // Bytes of a payload rewritten by the reorgs
+#define TEST_READERS 4              // Threads reading while the file is compacted
+
+/***********************/
+/*   DATA STRUCTURES   */
+/***********************/
+
+typedef struct reader_t {
+    payload_cache_t *cache;         // Cache read from
+    int *versions;                  // Version of the payload of each height, at least
+    int stop;                       // Set to stop reading
+} reader_t;
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+
+// Payload of version of height, long ones padded to size bytes
+static char *payload(int height, int version, int size)
+{
+    char *data = malloc(size + 1);
+    CHECK(data != NULL);
+    int used = sprintf(data, "payload %d version %d ", height, version);
+    memset(data + used, 'x', size > used ? size - used : 0);
+    data[size > used ? size : used] = '\0';
+    return data;
+}
+
+// Block hash of version of height
+static void block_hash(int height, int version, char *hash)
+{
+    char buffer[PAYLOAD_HASH_SIZE + 1];
+    snprintf(buffer, sizeof(buffer), "%016d%016d", height, version);
+    memcpy(hash, buffer, PAYLOAD_HASH_SIZE);
+}
+
+// Put version of height
+static void put(payload_cache_t *cache, int height, int version, int size)
+{
+    char hash[PAYLOAD_HASH_SIZE];
+    block_hash(height, version, hash);
+    payload_cache_put(cache, height, payload(height, version, size), hash);
+}
+
+// Check that height reads back as version
+static void check(payload_cache_t *cache, int height, int version, int size)
+{
+    char *expected = payload(height, version, size);
+    char *data = payload_cache_get(cache, height);
+    CHECK(strcmp(data, expected) == 0);
+    free(data);
+    free(expected);
+}
+
+// Size of a file
+static long file_size(const char *path)
+{
+    struct stat st;
+    CHECK(stat(path, &st) == 0);
+    return (long) st.st_size;
+}
+
+// Reader thread: every payload read is one that was put for its height
+static void *reader_thread(void *arg)
+{
+    reader_t *reader = (reader_t *) arg;
+    int height = 0;
+    while (!__atomic_load_n(&reader->stop, __ATOMIC_ACQUIRE))
+    {
+        int version = __atomic_load_n(&reader->versions[height], __ATOMIC_ACQUIRE);
+        char *data = payload_cache_get(reader->cache, height);
+        int read_height, read_version;
+        CHECK(sscanf(data, "payload %d version %d", &read_height, &read_version) == 2);
+        CHECK(read_height == height && read_version >= version);
+        free(data);
+        height = (height + 1) % TEST_HEIGHTS;
+    }
+    return NULL;
+}
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+
+int main()
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/test_payload_cache_%d.dat", (int) getpid());
+    unlink(path);
+
+    // Payloads come back from the cache and, once evicted, from disk
+    payload_cache_t *cache = payload_cache_open(path, TEST_CAPACITY);
+    for (int height = 0; height < TEST_HEIGHTS; height++)
+    {
+        put(cache, height, 0, 100);
+    }
+    CHECK(cache->used <= TEST_CAPACITY && cache->evictions > 0);
+    for (int height = 0; height < TEST_HEIGHTS; height++)
+    {
+        check(cache, height, 0, 100);
+        CHECK(payload_cache_length(cache, height) == 100);
+    }
+    CHECK(cache->misses > 0);
+    check(cache, TEST_HEIGHTS - 1, 0, 100);
+    CHECK(cache->hits > 0);
+    long length = file_size(path);
+    CHECK(length == PAYLOAD_MAGIC_SIZE + TEST_HEIGHTS * (PAYLOAD_RECORD_HEADER_SIZE + 100));
+
+    // A restart keeps the file, the same blocks are not written again and a
+    // new block at a height is
+    cache = payload_cache_open(path, TEST_CAPACITY);
+    CHECK((long) cache->file_length == length);
+    for (int height = 0; height < TEST_HEIGHTS; height++)
+    {
+        put(cache, height, 0, 100);
+    }
+    CHECK(file_size(path) == length);
+    put(cache, 5, 1, 100);
+    CHECK(file_size(path) == length + PAYLOAD_RECORD_HEADER_SIZE + 100);
+    cache = payload_cache_open(path, TEST_CAPACITY);
+    check(cache, 5, 1, 100);
+    check(cache, 6, 0, 100);
+
+    // A torn record is dropped, the previous record of its height wins
+    CHECK(truncate(path, length + PAYLOAD_RECORD_HEADER_SIZE + 50) == 0);
+    cache = payload_cache_open(path, TEST_CAPACITY);
+    CHECK(file_size(path) == length);
+    check(cache, 5, 0, 100);
+
+    // A file of another format is started over
+    FILE *fp = fopen(path, "wb");
+    CHECK(fp != NULL && fwrite("not a payload file", 1, 18, fp) == 18);
+    fclose(fp);
+    cache = payload_cache_open(path, TEST_CAPACITY);
+    CHECK(file_size(path) == PAYLOAD_MAGIC_SIZE && cache->live_length == 0);
+
+    // Reorgs rewrite large payloads again and again while readers read: the
+    // file is compacted and stays bounded by the current records
+    int versions[TEST_HEIGHTS] = {0};
+    for (int height = 0; height < TEST_HEIGHTS; height++)
+    {
+        put(cache, height, 0, TEST_LARGE);
+    }
+    reader_t reader = {cache, versions, 0};
+    pthread_t readers[TEST_READERS];
+    for (int i = 0; i < TEST_READERS; i++)
+    {
+        CHECK(pthread_create(&readers[i], NULL, reader_thread, &reader) == 0);
+    }
+    for (int round = 1; round <= 4; round++)
+    {
+        for (int height = 0; height < TEST_HEIGHTS; height++)
+        {
+            put(cache, height, round, TEST_LARGE);
+            __atomic_store_n(&versions[height], round, __ATOMIC_RELEASE);
+            CHECK(cache->file_length - PAYLOAD_MAGIC_SIZE <= 2 * cache->live_length + PAYLOAD_COMPACT_MIN + PAYLOAD_RECORD_HEADER_SIZE + TEST_LARGE);
+        }
+    }
+    __atomic_store_n(&reader.stop, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < TEST_READERS; i++)
+    {
+        pthread_join(readers[i], NULL);
+    }
+    CHECK(cache->compactions > 0);
+    CHECK(file_size(path) == (long) cache->file_length);
+    for (int height = 0; height < TEST_HEIGHTS; height++)
+    {
+        check(cache, height, 4, TEST_LARGE);
+    }
+
+    // The compacted file reopens with the current records
+    cache = payload_cache_open(path, TEST_CAPACITY);
+    for (int height = 0; height < TEST_HEIGHTS; height++)
+    {
+        check(cache, height, 4, TEST_LARGE);
+    }
+
+    unlink(path);
+    printf("test_payload_cache: passed\n");
+    return 0;
+}
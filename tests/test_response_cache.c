@@ -0,0 +1,193 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the tests of the response cache of GET /blocks: every
+ * format and encoding decodes to the chain's own serialization with the
+ * chain's ETag, requests share one cached body instead of copying it, a tip
+ * change serves the new blocks while bodies still held stay readable, and
+ * requests racing with new blocks always get a body matching their ETag.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "../src/networking/response_cache.h"
+#include "test.h"
+
+#define TEST_BLOCKS 20              // Blocks of the chain before the requests
+#define TEST_READERS 4              // Threads requesting while blocks are added
+#define TEST_REQUESTS 300           // Requests of each of those threads
+
+/***********************/
+/*   DATA STRUCTURES   */
+/***********************/
+
+typedef struct reader_t {
+    blockchain_t *blockchain;       // Chain requested
+    int stop;                       // Set to stop requesting
+} reader_t;
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+
+// Decompress a gzip or zlib body, NUL terminated
+static char *inflate_body(response_body_t *body, size_t *length)
+{
+    size_t capacity = body->length * 20 + 1024;
+    char *plain = malloc(capacity);
+    CHECK(plain != NULL);
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    CHECK(inflateInit2(&stream, 15 + 32) == Z_OK);
+    stream.next_in = (Bytef *) body->data;
+    stream.avail_in = body->length;
+    stream.next_out = (Bytef *) plain;
+    stream.avail_out = capacity - 1;
+    CHECK(inflate(&stream, Z_FINISH) == Z_STREAM_END);
+    *length = stream.total_out;
+    plain[*length] = '\0';
+    inflateEnd(&stream);
+    return plain;
+}
+
+// Check that every encoding of a format decodes to the chain's serialization
+static void check_format(blockchain_t *blockchain, int format, int from, int to)
+{
+    char expected_etag[BLOCKCHAIN_ETAG_SIZE];
+    size_t expected_length;
+    char *expected;
+    if (format == HTTP_FORMAT_BINARY)
+    {
+        expected = blockchain_range_to_binary(blockchain, from, to, expected_etag, &expected_length);
+    }
+    else
+    {
+        expected = blockchain_range_to_json(blockchain, from, to, expected_etag);
+        expected_length = strlen(expected);
+    }
+
+    for (int encoding = 0; encoding < HTTP_ENCODINGS; encoding++)
+    {
+        char etag[BLOCKCHAIN_ETAG_SIZE];
+        response_body_t *body = response_cache_get(blockchain->responses, blockchain, from, to, format, encoding, etag);
+        CHECK(strcmp(etag, expected_etag) == 0);
+        if (encoding == HTTP_ENCODING_IDENTITY)
+        {
+            CHECK(body->length == expected_length && memcmp(body->data, expected, expected_length) == 0);
+        }
+        else
+        {
+            size_t length;
+            char *plain = inflate_body(body, &length);
+            CHECK(length == expected_length && memcmp(plain, expected, expected_length) == 0);
+            free(plain);
+        }
+        response_body_release(body);
+    }
+    free(expected);
+}
+
+// Requesting thread: every body is the chain up to the tip its ETag names
+static void *reader_thread(void *arg)
+{
+    reader_t *reader = (reader_t *) arg;
+    for (int i = 0; i < TEST_REQUESTS && !__atomic_load_n(&reader->stop, __ATOMIC_ACQUIRE); i++)
+    {
+        char etag[BLOCKCHAIN_ETAG_SIZE];
+        int encoding = i % HTTP_ENCODINGS;
+        response_body_t *body = response_cache_get(reader->blockchain->responses, reader->blockchain, 0, -1, HTTP_FORMAT_JSON, encoding, etag);
+        size_t length = body->length;
+        char *plain = encoding == HTTP_ENCODING_IDENTITY ? strndup(body->data, body->length) : inflate_body(body, &length);
+        response_body_release(body);
+
+        // ETags are "<tip height>-<tip hash>", the body ends with that tip
+        int height = atoi(etag + 1);
+        int blocks = 0;
+        for (char *c = strstr(plain, "\"timestamp\""); c; c = strstr(c + 1, "\"timestamp\""))
+        {
+            blocks++;
+        }
+        CHECK(blocks == height + 1);
+        char *hash = strchr(etag, '-') + 1;
+        CHECK(strstr(plain, hash) != NULL);
+        free(plain);
+    }
+    return NULL;
+}
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+
+int main()
+{
+    blockchain_t *blockchain = create_blockchain();
+    for (int i = 1; i < TEST_BLOCKS; i++)
+    {
+        char data[32];
+        sprintf(data, "block %d", i);
+        add_block(blockchain, strdup(data));
+    }
+    enable_response_cache(blockchain, response_cache_create());
+
+    // Every format and encoding, whole chain and a range
+    for (int format = 0; format < HTTP_FORMATS; format++)
+    {
+        check_format(blockchain, format, 0, -1);
+        check_format(blockchain, format, 3, 7);
+    }
+
+    // Requests share the cached body: one reference each, no copy
+    char etag[BLOCKCHAIN_ETAG_SIZE];
+    response_body_t *first = response_cache_get(blockchain->responses, blockchain, 0, -1, HTTP_FORMAT_JSON, HTTP_ENCODING_GZIP, etag);
+    response_body_t *second = response_cache_get(blockchain->responses, blockchain, 0, -1, HTTP_FORMAT_JSON, HTTP_ENCODING_GZIP, etag);
+    CHECK(first == second && first->references == 3);
+    response_body_release(second);
+
+    // A new tip serves the new blocks, the body still held stays readable
+    char old_etag[BLOCKCHAIN_ETAG_SIZE];
+    strcpy(old_etag, etag);
+    size_t old_length;
+    char *old_plain = inflate_body(first, &old_length);
+    add_block(blockchain, strdup("new tip"));
+    response_body_t *fresh = response_cache_get(blockchain->responses, blockchain, 0, -1, HTTP_FORMAT_JSON, HTTP_ENCODING_GZIP, etag);
+    CHECK(fresh != first && strcmp(etag, old_etag) != 0);
+    CHECK(first->references == 1);
+    size_t length;
+    char *plain = inflate_body(first, &length);
+    CHECK(length == old_length && memcmp(plain, old_plain, length) == 0 && strstr(plain, "new tip") == NULL);
+    free(plain);
+    plain = inflate_body(fresh, &length);
+    CHECK(strstr(plain, "new tip") != NULL);
+    free(plain);
+    free(old_plain);
+    response_body_release(first);
+    response_body_release(fresh);
+    check_format(blockchain, HTTP_FORMAT_BINARY, 0, -1);
+
+    // Requests racing with new blocks get bodies matching their ETags
+    reader_t reader = {blockchain, 0};
+    pthread_t readers[TEST_READERS];
+    for (int i = 0; i < TEST_READERS; i++)
+    {
+        CHECK(pthread_create(&readers[i], NULL, reader_thread, &reader) == 0);
+    }
+    for (int i = 0; i < 50; i++)
+    {
+        add_block(blockchain, strdup("racing block"));
+    }
+    __atomic_store_n(&reader.stop, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < TEST_READERS; i++)
+    {
+        pthread_join(readers[i], NULL);
+    }
+
+    printf("test_response_cache: passed\n");
+    return 0;
+}
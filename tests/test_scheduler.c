@@ -0,0 +1,140 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the tests of the mining scheduler: jobs are mined in
+ * the order they were queued and reported with their height and hash,
+ * higher priorities go first, only queued jobs can be cancelled, and
+ * crossing SNAPSHOT_INTERVAL writes a snapshot in the background that
+ * loads back.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../src/mining/scheduler.h"
+#include "../src/storage/snapshot.h"
+#include "../src/storage/wal.h"
+#include "test.h"
+
+#define TEST_JOBS (SNAPSHOT_INTERVAL + 10)  // Jobs mined, enough to cross one snapshot
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+
+// Submit a job, waiting for room in the queue
+static int submit(const char *data, int priority)
+{
+    int id;
+    while ((id = scheduler_submit(strdup(data), priority)) == -1)
+    {
+        usleep(1000);
+    }
+    return id;
+}
+
+// Whether the JSON of a job contains text, waiting up to wait_ms for it
+static int job_has(int id, int wait_ms, const char *text)
+{
+    char *json = scheduler_job_to_json(id, wait_ms);
+    CHECK(json != NULL);
+    int found = strstr(json, text) != NULL;
+    free(json);
+    return found;
+}
+
+// Wait until a job is mined and check the height it was mined at
+static void check_mined(blockchain_t *blockchain, int id, int height)
+{
+    char expected[64];
+    sprintf(expected, "\"state\":\"done\",\"priority\":0,\"height\":%d,", height);
+    CHECK(job_has(id, SCHEDULER_MAX_WAIT_MS, expected));
+
+    pthread_rwlock_rdlock(&blockchain->lock);
+    char *hash = get_ascii_hash(blockchain->chain[height]->hash);
+    pthread_rwlock_unlock(&blockchain->lock);
+    CHECK(job_has(id, 0, hash));
+    free(hash);
+}
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+
+int main()
+{
+    // Work in a directory of our own, snapshots go to SNAPSHOT_PATH
+    char directory[] = "/tmp/test_scheduler_XXXXXX";
+    CHECK(mkdtemp(directory) != NULL);
+    CHECK(chdir(directory) == 0);
+
+    blockchain_t *blockchain = create_blockchain();
+    blockchain->wal = wal_open("blocks.wal", WAL_SYNC_OFF, 0);
+    scheduler_init(blockchain);
+
+    // Unknown jobs
+    CHECK(scheduler_job_to_json(0, 0) == NULL);
+    CHECK(scheduler_job_to_json(12345, 0) == NULL);
+    CHECK(scheduler_cancel(12345) == -1);
+
+    // Jobs of the same priority are mined in order, one height each, and
+    // the snapshot interval is crossed on the way
+    int ids[TEST_JOBS];
+    for (int i = 0; i < TEST_JOBS; i++)
+    {
+        char data[32];
+        sprintf(data, "job %d", i);
+        ids[i] = submit(data, 0);
+    }
+    for (int i = 0; i < TEST_JOBS; i++)
+    {
+        check_mined(blockchain, ids[i], i + 1);
+    }
+    CHECK(blockchain->length == TEST_JOBS + 1);
+
+    // The snapshot was written in the background and loads back
+    snapshot_wait();
+    blockchain_t *loaded = snapshot_load(SNAPSHOT_PATH, NULL, NULL, NULL);
+    CHECK(loaded != NULL && loaded->length >= SNAPSHOT_INTERVAL && loaded->length <= TEST_JOBS + 1);
+    CHECK(memcmp(loaded->chain[loaded->length - 1]->hash, blockchain->chain[loaded->length - 1]->hash, BLOCK_HASH_LENGTH) == 0);
+
+    // Hold the chain so the miner stops on its next job, then queue more
+    pthread_rwlock_wrlock(&blockchain->lock);
+    int first = submit("held", 0);
+    while (!job_has(first, 0, "\"state\":\"mining\""))
+    {
+        usleep(1000);
+    }
+    int low = submit("low", 0);
+    int cancelled = submit("cancelled", 1);
+    int high = submit("high", 5);
+    CHECK(job_has(high, 0, "\"state\":\"queued\",\"priority\":5}"));
+
+    // Only queued jobs can be cancelled
+    CHECK(scheduler_cancel(first) == -2);
+    CHECK(scheduler_cancel(cancelled) == 0);
+    CHECK(scheduler_cancel(cancelled) == -2);
+    CHECK(job_has(cancelled, SCHEDULER_MAX_WAIT_MS, "\"state\":\"cancelled\""));
+
+    // Once released, the higher priority job is mined before the older one
+    pthread_rwlock_unlock(&blockchain->lock);
+    check_mined(blockchain, first, TEST_JOBS + 1);
+    CHECK(job_has(high, SCHEDULER_MAX_WAIT_MS, "\"state\":\"done\",\"priority\":5,\"height\":"));
+    check_mined(blockchain, low, TEST_JOBS + 3);
+    char *data = get_block_data(blockchain, TEST_JOBS + 2);
+    CHECK(strcmp(data, "high") == 0);
+    free(data);
+
+    unlink("blocks.wal");
+    unlink("blocks.wal.1");
+    unlink(SNAPSHOT_PATH);
+    unlink(SNAPSHOT_PATH ".sha256");
+    CHECK(chdir("/tmp") == 0);
+    rmdir(directory);
+    printf("test_scheduler: passed\n");
+    return 0;
+}
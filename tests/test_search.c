@@ -0,0 +1,161 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the tests of the block payload search index: token
+ * queries match every block holding all the tokens whatever their case,
+ * exact queries match whole payloads only, and after any number of
+ * truncations and re-adds the index answers as a scan of the payloads
+ * would. A reorg of a chain with search enabled drops the replaced blocks.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/search/search_index.h"
+#include "test.h"
+
+#define TEST_WORDS 16               // Distinct words of the generated payloads
+#define TEST_ROUNDS 200             // Truncations and re-adds
+#define TEST_MAX_HEIGHT 3000        // Blocks indexed at most, across several segments
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+
+// Payload of two words, chosen by seed
+static void payload(unsigned seed, char *data)
+{
+    sprintf(data, "W%u w%u", seed % TEST_WORDS, (seed / TEST_WORDS) % TEST_WORDS);
+}
+
+// Whether a payload made by payload() holds word
+static int holds(const char *data, int word)
+{
+    unsigned first, second;
+    sscanf(data, "W%u w%u", &first, &second);
+    return (int) first == word || (int) second == word;
+}
+
+// Check the results of every word against a scan of the payloads
+static void check_words(search_index_t *index, char payloads[][32], int length)
+{
+    for (int word = 0; word < TEST_WORDS; word++)
+    {
+        char query[16];
+        sprintf(query, "w%d", word);
+        int count;
+        int *heights = search_index_query(index, query, &count);
+        int expected = 0;
+        for (int height = 0; height < length; height++)
+        {
+            if (holds(payloads[height], word))
+            {
+                CHECK(expected < count && heights[expected] == height);
+                expected++;
+            }
+        }
+        CHECK(count == expected);
+        free(heights);
+    }
+}
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+
+int main()
+{
+    // Token queries: every token must match, case does not matter
+    search_index_t *index = search_index_create();
+    search_index_add(index, 0, "Hello, WORLD!");
+    search_index_add(index, 1, "hello there");
+    search_index_add(index, 2, "world of blocks, world again");
+    int count;
+    int *heights = search_index_query(index, "hello", &count);
+    CHECK(count == 2 && heights[0] == 0 && heights[1] == 1);
+    free(heights);
+    heights = search_index_query(index, "WORLD hello", &count);
+    CHECK(count == 1 && heights[0] == 0);
+    free(heights);
+    heights = search_index_query(index, "world", &count);
+    CHECK(count == 2 && heights[0] == 0 && heights[1] == 2);
+    free(heights);
+    heights = search_index_query(index, "hello missing", &count);
+    CHECK(count == 0);
+    free(heights);
+
+    // Exact queries: only whole payloads
+    heights = search_index_exact(index, "hello there", &count);
+    CHECK(count == 1 && heights[0] == 1);
+    free(heights);
+    heights = search_index_exact(index, "hello", &count);
+    CHECK(count == 0);
+    free(heights);
+
+    // Random truncations and re-adds agree with a scan of the payloads
+    static char payloads[TEST_MAX_HEIGHT][32];
+    index = search_index_create();
+    int length = 0;
+    srand(7);
+    for (int round = 0; round < TEST_ROUNDS; round++)
+    {
+        if (length > 0 && rand() % 3 == 0)
+        {
+            // Drop up to a segment and a half of blocks
+            int drop = 1 + rand() % (SEARCH_SEGMENT_BLOCKS + SEARCH_SEGMENT_BLOCKS / 2);
+            length = drop > length ? 0 : length - drop;
+            search_index_truncate(index, length);
+        }
+        int add = rand() % 100;
+        for (int i = 0; i < add && length < TEST_MAX_HEIGHT; i++, length++)
+        {
+            payload(rand(), payloads[length]);
+            search_index_add(index, length, payloads[length]);
+        }
+        CHECK(index->length == length);
+        check_words(index, payloads, length);
+    }
+
+    // Every exact payload is found where it is, and nowhere it was dropped
+    for (int height = 0; height < length; height += 97)
+    {
+        heights = search_index_exact(index, payloads[height], &count);
+        int found = 0;
+        for (int i = 0; i < count; i++)
+        {
+            CHECK(heights[i] < length && strcmp(payloads[heights[i]], payloads[height]) == 0);
+            found |= heights[i] == height;
+        }
+        CHECK(found);
+        free(heights);
+    }
+
+    // A reorg of a chain with search enabled drops the replaced blocks
+    blockchain_t *blockchain = create_blockchain();
+    enable_search(blockchain, search_index_create());
+    add_block(blockchain, strdup("common"));
+    add_block(blockchain, strdup("replaced one"));
+    char *json = search_to_json(blockchain->search, blockchain, "replaced", FALSE);
+    CHECK(strcmp(json, "{\"count\":1,\"heights\":[2]}") == 0);
+    free(json);
+    block_t *first = mine_block(blockchain->chain[1], strdup("branch one"));
+    block_t *second = mine_block(first, strdup("branch two"));
+    uint64_t seq;
+    CHECK(receive_block(blockchain, first, &seq) == BLOCK_SIDE);
+    CHECK(receive_block(blockchain, second, &seq) == BLOCK_ACCEPTED);
+    json = search_to_json(blockchain->search, blockchain, "replaced", FALSE);
+    CHECK(strcmp(json, "{\"count\":0,\"heights\":[]}") == 0);
+    free(json);
+    json = search_to_json(blockchain->search, blockchain, "branch", FALSE);
+    CHECK(strcmp(json, "{\"count\":2,\"heights\":[2,3]}") == 0);
+    free(json);
+    json = search_to_json(blockchain->search, blockchain, "branch two", TRUE);
+    CHECK(strcmp(json, "{\"count\":1,\"heights\":[3]}") == 0);
+    free(json);
+
+    printf("test_search: passed\n");
+    return 0;
+}
@@ -0,0 +1,228 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the tests of the server I/O backends: every request
+ * reaches the handler whole, the handler owns its connection and reads what
+ * the client sends after the request, requests in flight at once are served
+ * concurrently, and handlers run on a bounded set of reused workers. Both
+ * the default backend and the epoll fallback are tested.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "../src/networking/server.h"
+#include "test.h"
+
+#define TEST_SEQUENTIAL 500         // Requests sent one after the other
+#define TEST_CONCURRENT 32          // Requests held in the handler at once
+
+/***********************/
+/*   DATA STRUCTURES   */
+/***********************/
+
+typedef struct listener_t {
+    int sockfd;                     // Listening socket
+    int port;                       // Port it is bound to
+} listener_t;
+
+static __thread int thread_seen = 0;
+static int threads = 0;             // Threads that ran the handler
+static int holding = 0;             // Handlers waiting in "hold" requests
+static int released = 0;            // Set to let "hold" requests answer
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+
+// Handler: "echo" answers with the request, "more" with the next bytes the
+// client sends, "hold" waits until released
+static void handler(int client_sockfd, char *request, int length)
+{
+    pthread_mutex_lock(&lock);
+    if (!thread_seen)
+    {
+        thread_seen = 1;
+        threads++;
+    }
+    pthread_mutex_unlock(&lock);
+
+    char reply[SERVER_REQUEST_SIZE + 1];
+    int reply_length = length;
+    memcpy(reply, request, length);
+    if (strncmp(request, "more", 4) == 0)
+    {
+        reply_length = recv(client_sockfd, reply, SERVER_REQUEST_SIZE, 0);
+        CHECK(reply_length > 0);
+    }
+    else if (strncmp(request, "hold", 4) == 0)
+    {
+        pthread_mutex_lock(&lock);
+        holding++;
+        pthread_cond_broadcast(&changed);
+        while (!released)
+        {
+            pthread_cond_wait(&changed, &lock);
+        }
+        holding--;
+        pthread_mutex_unlock(&lock);
+    }
+    CHECK(send(client_sockfd, reply, reply_length, MSG_NOSIGNAL) == reply_length);
+    close(client_sockfd);
+}
+
+// Threads that ran the handler so far
+static int threads_seen()
+{
+    pthread_mutex_lock(&lock);
+    int seen = threads;
+    pthread_mutex_unlock(&lock);
+    return seen;
+}
+
+// Listening socket on a free port of the loopback interface
+static listener_t listen_any()
+{
+    listener_t listener;
+    listener.sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(listener.sockfd >= 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t size = sizeof(address);
+    CHECK(bind(listener.sockfd, (struct sockaddr *) &address, size) == 0);
+    CHECK(listen(listener.sockfd, 128) == 0);
+    CHECK(getsockname(listener.sockfd, (struct sockaddr *) &address, &size) == 0);
+    listener.port = ntohs(address.sin_port);
+    return listener;
+}
+
+// Serve the listener forever
+static void *serve(void *arg)
+{
+    listener_t *listener = (listener_t *) arg;
+    server_run(listener->sockfd, handler);
+    return NULL;
+}
+
+// Connected client socket
+static int connect_to(int port)
+{
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(sockfd >= 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    CHECK(connect(sockfd, (struct sockaddr *) &address, sizeof(address)) == 0);
+    return sockfd;
+}
+
+// Read until the server closes the connection
+static int read_reply(int sockfd, char *reply, int size)
+{
+    int length = 0;
+    int n;
+    while ((n = read(sockfd, reply + length, size - 1 - length)) > 0)
+    {
+        length += n;
+    }
+    reply[length] = '\0';
+    close(sockfd);
+    return length;
+}
+
+// Send a request and check the reply
+static void check_request(int port, const char *request, const char *expected)
+{
+    int sockfd = connect_to(port);
+    CHECK(write(sockfd, request, strlen(request)) == (ssize_t) strlen(request));
+    char reply[SERVER_REQUEST_SIZE + 1];
+    read_reply(sockfd, reply, sizeof(reply));
+    CHECK(strcmp(reply, expected) == 0);
+}
+
+// Run every check against the server on port
+static void check_backend(int port)
+{
+    // Requests come back whole
+    check_request(port, "echo hello", "echo hello");
+
+    // Bytes sent after the request are left to the handler
+    int sockfd = connect_to(port);
+    CHECK(write(sockfd, "more", 4) == 4);
+    usleep(50000);
+    CHECK(write(sockfd, "after the request", 17) == 17);
+    char reply[SERVER_REQUEST_SIZE + 1];
+    read_reply(sockfd, reply, sizeof(reply));
+    CHECK(strcmp(reply, "after the request") == 0);
+
+    // Requests one after the other reuse the same few workers
+    int before = threads_seen();
+    for (int i = 0; i < TEST_SEQUENTIAL; i++)
+    {
+        char request[32];
+        sprintf(request, "echo %d", i);
+        check_request(port, request, request);
+    }
+    CHECK(threads_seen() - before < TEST_SEQUENTIAL / 10);
+
+    // Requests held in the handler at once are all served concurrently
+    int clients[TEST_CONCURRENT];
+    pthread_mutex_lock(&lock);
+    released = 0;
+    pthread_mutex_unlock(&lock);
+    for (int i = 0; i < TEST_CONCURRENT; i++)
+    {
+        clients[i] = connect_to(port);
+        CHECK(write(clients[i], "hold", 4) == 4);
+    }
+    pthread_mutex_lock(&lock);
+    while (holding < TEST_CONCURRENT)
+    {
+        pthread_cond_wait(&changed, &lock);
+    }
+    released = 1;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+    for (int i = 0; i < TEST_CONCURRENT; i++)
+    {
+        read_reply(clients[i], reply, sizeof(reply));
+        CHECK(strcmp(reply, "hold") == 0);
+    }
+    CHECK(threads_seen() <= SERVER_MAX_WORKERS);
+}
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+
+int main()
+{
+    // Default backend (io_uring where available)
+    unsetenv("IO_BACKEND");
+    listener_t first = listen_any();
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, serve, &first) == 0);
+    check_backend(first.port);
+
+    // Epoll fallback, on the workers already started
+    setenv("IO_BACKEND", "epoll", 1);
+    listener_t second = listen_any();
+    CHECK(pthread_create(&thread, NULL, serve, &second) == 0);
+    check_backend(second.port);
+
+    printf("test_server: passed (%d workers)\n", threads_seen());
+    return 0;
+}
@@ -0,0 +1,188 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the tests of chain snapshots: a saved chain loads back
+ * with a working hash index and pruned payloads, a trusted checkpoint must
+ * agree with it, and a snapshot that is missing, corrupt, truncated or breaks
+ * the chain is refused (NULL) so the node falls back to replaying the WAL.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <openssl/evp.h>
+#include "../src/blockchain/blockchain.h"
+#include "../src/storage/payload_cache.h"
+#include "../src/storage/snapshot.h"
+#include "test.h"
+
+#define TEST_BLOCKS 50              // Blocks of the saved chain
+#define TEST_BROKEN_HEIGHT 20       // Block whose link is broken
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+
+// Read a whole file
+static char *slurp(const char *path, size_t *length)
+{
+    FILE *fp = fopen(path, "rb");
+    CHECK(fp != NULL);
+    fseek(fp, 0, SEEK_END);
+    *length = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *buffer = malloc(*length);
+    CHECK(buffer != NULL && fread(buffer, 1, *length, fp) == *length);
+    fclose(fp);
+    return buffer;
+}
+
+// Write a whole file
+static void spill(const char *path, const char *buffer, size_t length)
+{
+    FILE *fp = fopen(path, "wb");
+    CHECK(fp != NULL && fwrite(buffer, 1, length, fp) == length);
+    fclose(fp);
+}
+
+// Write a snapshot and a checksum that matches it, as the node would
+static void reseal(const char *path, const char *checksum_path, const char *buffer, size_t length, int height)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length;
+    CHECK(EVP_Digest(buffer, length, digest, &digest_length, EVP_sha256(), NULL) == 1);
+    char checksum[128];
+    int used = sprintf(checksum, "%d ", height);
+    for (unsigned int i = 0; i < digest_length; i++)
+    {
+        used += sprintf(checksum + used, "%02x", digest[i]);
+    }
+    checksum[used++] = '\n';
+    spill(path, buffer, length);
+    spill(checksum_path, checksum, used);
+}
+
+// Offset of the block at height in a snapshot
+static size_t block_offset(const char *buffer, int height)
+{
+    size_t offset = SNAPSHOT_HEADER_SIZE;
+    for (int i = 0; i < height; i++)
+    {
+        uint32_t data_length;
+        memcpy(&data_length, buffer + offset + SNAPSHOT_LOCATION_SIZE + BLOCK_HEADER_SIZE - 4, 4);
+        offset += SNAPSHOT_LOCATION_SIZE + BLOCK_HEADER_SIZE + ntohl(data_length);
+    }
+    return offset;
+}
+
+// Checkpoint naming the hash of the block at height as the one at pinned
+static void checkpoint(blockchain_t *blockchain, int pinned, int height, char *out)
+{
+    char *hash = get_ascii_hash(blockchain->chain[height]->hash);
+    sprintf(out, "%d %s", pinned, hash);
+    free(hash);
+}
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+
+int main()
+{
+    char path[64], checksum_path[80], payload_path[80];
+    snprintf(path, sizeof(path), "/tmp/test_snapshot_%d.dat", (int) getpid());
+    snprintf(checksum_path, sizeof(checksum_path), "%s.sha256", path);
+    snprintf(payload_path, sizeof(payload_path), "%s.payloads", path);
+
+    // Nothing to load yet
+    CHECK(snapshot_load(path, NULL, NULL, NULL) == NULL);
+
+    // Save a chain
+    blockchain_t *original = create_blockchain();
+    for (int i = 1; i < TEST_BLOCKS; i++)
+    {
+        char data[32];
+        sprintf(data, "block %d", i);
+        add_block(original, strdup(data));
+    }
+    CHECK(snapshot_save(original, path) == 0);
+
+    // It loads back whole, and the rebuilt index finds every block
+    blockchain_t *loaded = snapshot_load(path, NULL, NULL, NULL);
+    CHECK(loaded != NULL && loaded->length == TEST_BLOCKS);
+    for (int i = 0; i < TEST_BLOCKS; i++)
+    {
+        CHECK(memcmp(loaded->chain[i]->hash, original->chain[i]->hash, BLOCK_HASH_LENGTH) == 0);
+        CHECK(strcmp(loaded->chain[i]->data, original->chain[i]->data) == 0);
+        CHECK(blockchain_find(loaded, original->chain[i]->hash) == i);
+    }
+    CHECK(is_chain_valid(loaded->chain, loaded->length) == TRUE);
+
+    // Blocks added after the load extend the restored chain
+    CHECK(add_block(loaded, strdup("after load")) != NULL);
+    CHECK(blockchain_find(loaded, loaded->chain[TEST_BLOCKS]->hash) == TEST_BLOCKS);
+
+    // With a payload cache only the headers stay in memory
+    unlink(payload_path);
+    payload_cache_t *payloads = payload_cache_open(payload_path, 64);
+    blockchain_t *pruned = snapshot_load(path, payloads, NULL, NULL);
+    CHECK(pruned != NULL && pruned->length == TEST_BLOCKS);
+    for (int i = 1; i < TEST_BLOCKS; i++)
+    {
+        CHECK(pruned->chain[i]->data == NULL);
+        char *data = get_block_data(pruned, i);
+        CHECK(strcmp(data, original->chain[i]->data) == 0);
+        free(data);
+    }
+
+    // A checkpoint on the chain is accepted, any other one refuses it
+    char pin[128];
+    checkpoint(original, TEST_BLOCKS / 2, TEST_BLOCKS / 2, pin);
+    CHECK(snapshot_load(path, NULL, pin, NULL) != NULL);
+    checkpoint(original, TEST_BLOCKS / 2, TEST_BLOCKS / 2 + 1, pin);
+    CHECK(snapshot_load(path, NULL, pin, NULL) == NULL);
+    CHECK(snapshot_load(path, NULL, "not a checkpoint", NULL) == NULL);
+
+    size_t length;
+    char *saved = slurp(path, &length);
+    char *copy = malloc(length);
+    CHECK(copy != NULL);
+
+    // A flipped byte no longer matches the checksum
+    memcpy(copy, saved, length);
+    copy[length / 2] ^= 1;
+    spill(path, copy, length);
+    CHECK(snapshot_load(path, NULL, NULL, NULL) == NULL);
+
+    // A broken link is refused even with a matching checksum
+    memcpy(copy, saved, length);
+    copy[block_offset(copy, TEST_BROKEN_HEIGHT) + SNAPSHOT_LOCATION_SIZE + 4] ^= 1;
+    reseal(path, checksum_path, copy, length, TEST_BLOCKS);
+    CHECK(snapshot_load(path, NULL, NULL, NULL) == NULL);
+
+    // So is a truncated snapshot
+    reseal(path, checksum_path, saved, block_offset(saved, TEST_BLOCKS - 1) + 10, TEST_BLOCKS);
+    CHECK(snapshot_load(path, NULL, NULL, NULL) == NULL);
+
+    // And one whose last block is not the tip it names
+    memcpy(copy, saved, block_offset(saved, TEST_BLOCKS - 1));
+    uint32_t height = htonl(TEST_BLOCKS - 1);
+    memcpy(copy + 8, &height, 4);
+    reseal(path, checksum_path, copy, block_offset(saved, TEST_BLOCKS - 1), TEST_BLOCKS - 1);
+    CHECK(snapshot_load(path, NULL, NULL, NULL) == NULL);
+
+    // The untouched snapshot still loads
+    reseal(path, checksum_path, saved, length, TEST_BLOCKS);
+    CHECK(snapshot_load(path, NULL, NULL, NULL) != NULL);
+
+    unlink(path);
+    unlink(checksum_path);
+    unlink(payload_path);
+    printf("test_snapshot: passed\n");
+    return 0;
+}
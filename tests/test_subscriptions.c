@@ -0,0 +1,258 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the tests of the block subscription streams: a stream
+ * resumes from ?from= or Last-Event-ID and then pushes every new block once,
+ * a reorg is announced with its fork height before the blocks of the new
+ * branch, WebSocket clients get the accept key, text frames and their Ping
+ * and Close answered, and a stream ends when its client leaves.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "../src/networking/subscriptions.h"
+#include "test.h"
+
+#define TEST_BLOCKS 5               // Blocks of the chain before the streams start
+#define TEST_EVENT_SIZE 4096        // Room for one event
+#define TEST_TIMEOUT_S 5            // Wait for an event before failing
+
+/***********************/
+/*   DATA STRUCTURES   */
+/***********************/
+
+typedef struct stream_t {
+    blockchain_t *blockchain;       // Chain streamed
+    int sockfd;                     // Server end of the connection
+    char path[64];                  // Path of the request
+    char request[256];              // Whole request
+    pthread_t thread;               // Thread serving the stream
+} stream_t;
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+
+// Serve a stream, closing the connection once it ends
+static void *serve(void *arg)
+{
+    stream_t *stream = (stream_t *) arg;
+    subscriptions_serve(stream->blockchain->subscriptions, stream->blockchain, stream->sockfd, stream->path, stream->request);
+    close(stream->sockfd);
+    return NULL;
+}
+
+// Start a stream for a request and return the client end of its connection
+static int subscribe(stream_t *stream, blockchain_t *blockchain, const char *path, const char *headers)
+{
+    int sockets[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+    struct timeval timeout = {TEST_TIMEOUT_S, 0};
+    CHECK(setsockopt(sockets[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == 0);
+
+    stream->blockchain = blockchain;
+    stream->sockfd = sockets[1];
+    snprintf(stream->path, sizeof(stream->path), "%s", path);
+    snprintf(stream->request, sizeof(stream->request), "GET %s HTTP/1.1\r\n%s\r\n", path, headers);
+    CHECK(pthread_create(&stream->thread, NULL, serve, stream) == 0);
+    return sockets[0];
+}
+
+// Read exactly length bytes
+static void read_exactly(int sockfd, char *buffer, size_t length)
+{
+    size_t used = 0;
+    while (used < length)
+    {
+        ssize_t n = read(sockfd, buffer + used, length - used);
+        CHECK(n > 0);
+        used += n;
+    }
+}
+
+// Read up to and including end, NUL terminated
+static void read_until(int sockfd, char *buffer, const char *end)
+{
+    size_t used = 0;
+    size_t end_length = strlen(end);
+    while (used < end_length || memcmp(buffer + used - end_length, end, end_length) != 0)
+    {
+        CHECK(used < TEST_EVENT_SIZE - 1);
+        read_exactly(sockfd, buffer + used, 1);
+        used++;
+    }
+    buffer[used] = '\0';
+}
+
+// Read the next SSE event, skipping keepalives, and check its type and id
+static void read_event(int sockfd, char *event, const char *type, int id)
+{
+    do
+    {
+        read_until(sockfd, event, "\n\n");
+    } while (event[0] == ':');
+
+    char expected[64];
+    if (id >= 0)
+    {
+        sprintf(expected, "id: %d\nevent: %s\ndata: ", id, type);
+    }
+    else
+    {
+        sprintf(expected, "event: %s\ndata: ", type);
+    }
+    CHECK(strncmp(event, expected, strlen(expected)) == 0);
+}
+
+// Read the next block event and check its height and payload
+static void read_block(int sockfd, int height, const char *data)
+{
+    char event[TEST_EVENT_SIZE];
+    read_event(sockfd, event, "block", height);
+    char expected[64];
+    sprintf(expected, "\"height\":%d,", height);
+    CHECK(strstr(event, expected) != NULL);
+    CHECK(strstr(event, data) != NULL);
+}
+
+// Read the next WebSocket frame, return its opcode
+static int read_frame(int sockfd, char *payload, size_t *length)
+{
+    unsigned char header[2];
+    read_exactly(sockfd, (char *) header, 2);
+    CHECK((header[1] & 0x80) == 0);
+    *length = header[1] & 0x7f;
+    if (*length == 126)
+    {
+        unsigned char extended[2];
+        read_exactly(sockfd, (char *) extended, 2);
+        *length = ((size_t) extended[0] << 8) | extended[1];
+    }
+    CHECK(*length < TEST_EVENT_SIZE);
+    read_exactly(sockfd, payload, *length);
+    payload[*length] = '\0';
+    return header[0] & 0x0f;
+}
+
+// Send a masked WebSocket control frame, as clients must
+static void send_frame(int sockfd, int opcode, const char *payload, size_t length)
+{
+    unsigned char frame[6 + 125];
+    unsigned char mask[4] = {0x12, 0x34, 0x56, 0x78};
+    frame[0] = (unsigned char) (0x80 | opcode);
+    frame[1] = (unsigned char) (0x80 | length);
+    memcpy(frame + 2, mask, 4);
+    for (size_t i = 0; i < length; i++)
+    {
+        frame[6 + i] = payload[i] ^ mask[i % 4];
+    }
+    CHECK(write(sockfd, frame, 6 + length) == (ssize_t) (6 + length));
+}
+
+// Streams being served
+static int subscribers(blockchain_t *blockchain)
+{
+    pthread_mutex_lock(&blockchain->subscriptions->lock);
+    int count = blockchain->subscriptions->subscribers;
+    pthread_mutex_unlock(&blockchain->subscriptions->lock);
+    return count;
+}
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+
+int main()
+{
+    blockchain_t *blockchain = create_blockchain();
+    blockchain->subscriptions = subscriptions_create();
+    for (int i = 1; i < TEST_BLOCKS; i++)
+    {
+        char data[32];
+        sprintf(data, "block %d", i);
+        add_block(blockchain, strdup(data));
+    }
+
+    // ?from= resumes from a height, then new blocks follow
+    stream_t from_stream;
+    int from = subscribe(&from_stream, blockchain, "/blocks/subscribe?from=2", "");
+    char event[TEST_EVENT_SIZE];
+    read_until(from, event, "\r\n\r\n");
+    CHECK(strncmp(event, "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\n", 49) == 0);
+    read_block(from, 2, "block 2");
+    read_block(from, 3, "block 3");
+    read_block(from, 4, "block 4");
+
+    // Without a start only new blocks are sent; Last-Event-ID resumes after it
+    stream_t new_stream;
+    int new = subscribe(&new_stream, blockchain, "/blocks/subscribe", "");
+    read_until(new, event, "\r\n\r\n");
+    stream_t resumed_stream;
+    int resumed = subscribe(&resumed_stream, blockchain, "/blocks/subscribe", "Last-Event-ID: 3\r\n");
+    read_until(resumed, event, "\r\n\r\n");
+    read_block(resumed, 4, "block 4");
+    while (subscribers(blockchain) < 3)
+    {
+        usleep(1000);
+    }
+    usleep(100000); // Let the new stream settle on the tip before adding
+    add_block(blockchain, strdup("block 5"));
+    read_block(from, 5, "block 5");
+    read_block(new, 5, "block 5");
+    read_block(resumed, 5, "block 5");
+
+    // A reorg from height 3 is announced, then the new branch is streamed
+    block_t *first = mine_block(blockchain->chain[3], strdup("branch 4"));
+    block_t *second = mine_block(first, strdup("branch 5"));
+    block_t *third = mine_block(second, strdup("branch 6"));
+    uint64_t seq;
+    CHECK(receive_block(blockchain, first, &seq) == BLOCK_SIDE);
+    CHECK(receive_block(blockchain, second, &seq) == BLOCK_SIDE);
+    CHECK(receive_block(blockchain, third, &seq) == BLOCK_ACCEPTED);
+    wait_block_durable(blockchain, seq);
+    read_event(from, event, "reorg", -1);
+    CHECK(strstr(event, "{\"type\":\"reorg\",\"fork_height\":3}") != NULL);
+    read_block(from, 4, "branch 4");
+    read_block(from, 5, "branch 5");
+    read_block(from, 6, "branch 6");
+
+    // Streams end once their client leaves
+    close(from);
+    close(new);
+    close(resumed);
+    pthread_join(from_stream.thread, NULL);
+    pthread_join(new_stream.thread, NULL);
+    pthread_join(resumed_stream.thread, NULL);
+    CHECK(subscribers(blockchain) == 0);
+
+    // WebSocket: accept key of RFC 6455, blocks as text frames, Ping and
+    // Close answered
+    stream_t websocket_stream;
+    int websocket = subscribe(&websocket_stream, blockchain, "/blocks/subscribe?from=6",
+                              "Upgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n");
+    read_until(websocket, event, "\r\n\r\n");
+    CHECK(strncmp(event, "HTTP/1.1 101 Switching Protocols\r\n", 34) == 0);
+    CHECK(strstr(event, "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n") != NULL);
+    size_t length;
+    CHECK(read_frame(websocket, event, &length) == 0x1);
+    CHECK(strstr(event, "{\"type\":\"block\",\"height\":6,") == event && strstr(event, "branch 6") != NULL);
+    send_frame(websocket, 0x9, "ping", 4);
+    CHECK(read_frame(websocket, event, &length) == 0xA && length == 4 && strcmp(event, "ping") == 0);
+    send_frame(websocket, 0x8, "\x03\xe8", 2);
+    CHECK(read_frame(websocket, event, &length) == 0x8 && length == 2 && memcmp(event, "\x03\xe8", 2) == 0);
+    pthread_join(websocket_stream.thread, NULL);
+    CHECK(read(websocket, event, 1) == 0);
+    close(websocket);
+    CHECK(subscribers(blockchain) == 0);
+
+    printf("test_subscriptions: passed\n");
+    return 0;
+}
@@ -0,0 +1,150 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the stress test of the work-stealing thread pool.
+ *
+ * Trees of nested tasks are forked at once from pool workers (tasks forking
+ * tasks) and from threads outside the pool (the shared queue), while the main
+ * thread runs parallel loops. Every task bumps its own counter, so a task
+ * lost or run twice by a steal shows up as a counter other than one.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../src/pool/thread_pool.h"
+#include "test.h"
+
+#define TEST_WORKERS 4              // Pool workers
+#define TEST_THREADS 4              // Threads outside the pool forking trees
+#define TEST_BRANCHING 4            // Children of every task
+#define TEST_DEPTH 6                // Levels below the root of a tree
+#define TEST_ROUNDS 20              // Times the whole run is repeated
+#define TEST_LOOP_LENGTH 100000     // Heights of each parallel loop
+
+// Tasks in one tree: 1 + B + B^2 + ... + B^DEPTH
+#define TEST_TREE_SIZE 5461
+
+/***********************/
+/*   DATA STRUCTURES   */
+/***********************/
+
+typedef struct tree_task_t {
+    int *counts;                    // Runs of every task of the tree
+    int id;                         // Index of this task, children are id * B + 1..B
+    int depth;                      // Levels left below this task
+} tree_task_t;
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+
+// Count this task, then fork its children and join them
+static void run_tree(void *arg)
+{
+    tree_task_t *task = (tree_task_t *) arg;
+    __atomic_add_fetch(&task->counts[task->id], 1, __ATOMIC_RELAXED);
+    if (task->depth == 0)
+    {
+        return;
+    }
+
+    tree_task_t children[TEST_BRANCHING];
+    pool_group_t group;
+    pool_group_init(&group);
+    for (int i = 0; i < TEST_BRANCHING; i++)
+    {
+        children[i].counts = task->counts;
+        children[i].id = task->id * TEST_BRANCHING + i + 1;
+        children[i].depth = task->depth - 1;
+        pool_fork(&group, run_tree, &children[i]);
+    }
+    pool_join(&group);
+}
+
+// Thread outside the pool: fork a whole tree through the shared queue
+static void *external_thread(void *arg)
+{
+    tree_task_t root = {(int *) arg, 0, TEST_DEPTH};
+    pool_group_t group;
+    pool_group_init(&group);
+    pool_fork(&group, run_tree, &root);
+    pool_join(&group);
+    return NULL;
+}
+
+// Parallel loop body: count every height once
+static void count_range(int from, int to, void *arg)
+{
+    int *counts = (int *) arg;
+    for (int i = from; i < to; i++)
+    {
+        __atomic_add_fetch(&counts[i], 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Check that every counter is exactly one
+static void check_once(int *counts, int length)
+{
+    for (int i = 0; i < length; i++)
+    {
+        if (counts[i] != 1)
+        {
+            printf("Task %d ran %d times\n", i, counts[i]);
+            exit(1);
+        }
+    }
+}
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+
+int main()
+{
+    thread_pool_init(TEST_WORKERS);
+    CHECK(thread_pool_workers() > 0);
+
+    for (int round = 0; round < TEST_ROUNDS; round++)
+    {
+        // Trees forked by outside threads
+        int *trees[TEST_THREADS];
+        pthread_t threads[TEST_THREADS];
+        for (int i = 0; i < TEST_THREADS; i++)
+        {
+            trees[i] = (int *) calloc(TEST_TREE_SIZE, sizeof(int));
+            CHECK(trees[i] != NULL);
+            CHECK(pthread_create(&threads[i], NULL, external_thread, trees[i]) == 0);
+        }
+
+        // Meanwhile a tree whose tasks fork from workers, and a parallel loop
+        // on this thread
+        int *worker_tree = (int *) calloc(TEST_TREE_SIZE, sizeof(int));
+        int *loop = (int *) calloc(TEST_LOOP_LENGTH, sizeof(int));
+        CHECK(worker_tree != NULL && loop != NULL);
+        tree_task_t root = {worker_tree, 0, TEST_DEPTH};
+        pool_group_t group;
+        pool_group_init(&group);
+        pool_fork(&group, run_tree, &root);
+        pool_parallel_for(0, TEST_LOOP_LENGTH, 64, count_range, loop);
+        pool_join(&group);
+
+        for (int i = 0; i < TEST_THREADS; i++)
+        {
+            pthread_join(threads[i], NULL);
+            check_once(trees[i], TEST_TREE_SIZE);
+            free(trees[i]);
+        }
+        check_once(worker_tree, TEST_TREE_SIZE);
+        check_once(loop, TEST_LOOP_LENGTH);
+        free(worker_tree);
+        free(loop);
+    }
+
+    printf("test_thread_pool: %d rounds passed\n", TEST_ROUNDS);
+    return 0;
+}
@@ -0,0 +1,192 @@
+/**
+ *
+ * Author: Filippo Scaramuzza
+ * License: MIT
+ *
+ * This file contains the tests of the block write-ahead log: a record torn
+ * by a crash is dropped and truncated on replay, the blocks before it come
+ * back in order, and side branch records rebuild the block tree. A snapshot
+ * rotates the log, a restart from it replays only the new segment, and raw
+ * ranges still send the records of sealed segments.
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "../src/blockchain/blockchain.h"
+#include "../src/blockchain/block_tree.h"
+#include "../src/storage/snapshot.h"
+#include "../src/storage/wal.h"
+#include "test.h"
+
+#define TEST_BLOCKS 10              // Blocks logged before the crash
+#define TEST_AFTER_SNAPSHOT 3       // Blocks logged after the snapshot
+
+/***********************/
+/*  UTILITY FUNCTIONS  */
+/***********************/
+
+// Size of a file, -1 if missing
+static long file_size(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? (long) st.st_size : -1;
+}
+
+// Fresh chain with its blocks replayed from the log at path
+static blockchain_t *reopen(const char *path, int *replayed)
+{
+    blockchain_t *blockchain = create_blockchain();
+    wal_t *wal = wal_open(path, WAL_SYNC_ALWAYS, 0);
+    *replayed = wal_replay(wal, blockchain);
+    blockchain->wal = wal;
+    return blockchain;
+}
+
+// Add a block with the given payload and wait until it is durable
+static block_t *add(blockchain_t *blockchain, const char *data)
+{
+    return add_block(blockchain, strdup(data));
+}
+
+// Append length bytes of the file at path from offset to buffer
+static void read_span(const char *path, uint64_t offset, uint64_t length, char *buffer)
+{
+    int fd = open(path, O_RDONLY);
+    CHECK(fd >= 0);
+    CHECK(pread(fd, buffer, length, offset) == (ssize_t) length);
+    close(fd);
+}
+
+/***********************/
+/*    CORE FUNCTIONS   */
+/***********************/
+
+int main()
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/test_wal_%d.wal", (int) getpid());
+    unlink(path);
+
+    // Log a few blocks
+    int replayed;
+    blockchain_t *original = reopen(path, &replayed);
+    CHECK(replayed == 0);
+    long sizes[TEST_BLOCKS + 1];
+    sizes[0] = file_size(path);
+    for (int i = 1; i <= TEST_BLOCKS; i++)
+    {
+        char data[32];
+        sprintf(data, "block %d", i);
+        add(original, data);
+        sizes[i] = file_size(path);
+        CHECK(sizes[i] > sizes[i - 1]);
+    }
+
+    // Tear the last record in its data, then in its header
+    long torn[] = {sizes[TEST_BLOCKS] - 3, sizes[TEST_BLOCKS - 1] + 5};
+    for (int t = 0; t < 2; t++)
+    {
+        CHECK(truncate(path, torn[t]) == 0);
+        blockchain_t *restored = reopen(path, &replayed);
+        CHECK(replayed == TEST_BLOCKS - 1);
+        CHECK(restored->length == TEST_BLOCKS);
+        CHECK(file_size(path) == sizes[TEST_BLOCKS - 1]);
+        for (int i = 0; i < restored->length; i++)
+        {
+            CHECK(memcmp(restored->chain[i]->hash, original->chain[i]->hash, BLOCK_HASH_LENGTH) == 0);
+            CHECK(strcmp(restored->chain[i]->data, original->chain[i]->data) == 0);
+        }
+    }
+
+    // The log keeps going after the truncation
+    blockchain_t *restored = reopen(path, &replayed);
+    add(restored, "after crash");
+    block_t *side = mine_block(restored->chain[3], strdup("side"));
+    uint64_t seq;
+    CHECK(receive_block(restored, side, &seq) == BLOCK_SIDE);
+    CHECK(seq > 0);
+    wait_block_durable(restored, seq);
+
+    // A restart rebuilds the same chain and the side branch
+    blockchain_t *again = reopen(path, &replayed);
+    CHECK(replayed == TEST_BLOCKS + 1);
+    CHECK(again->length == TEST_BLOCKS + 1);
+    CHECK(strcmp(again->chain[TEST_BLOCKS]->data, "after crash") == 0);
+    tree_node_t *node = block_tree_find(again->tree, side->hash);
+    CHECK(node != NULL && node->height == 4);
+    CHECK(blockchain_find(again, side->hash) == -1);
+
+    // Ranges cover the active records only, never the side record
+    wal_range_t range;
+    CHECK(wal_range_open(again->wal, 1, TEST_BLOCKS - 1, &range) == 0);
+    CHECK(range.count == 1 && (long) range.length == sizes[TEST_BLOCKS - 1] - sizes[0]);
+    wal_range_close(&range);
+    CHECK(wal_range_open(again->wal, 4, 4, &range) == 0);
+    CHECK(range.count == 1 && (long) range.spans[0].offset == sizes[3] && (long) range.length == sizes[4] - sizes[3]);
+    wal_range_close(&range);
+
+    // A snapshot seals the log as segment 1 and starts an empty one
+    char sealed[80], snapshot[80], checksum[96];
+    snprintf(sealed, sizeof(sealed), "%s.1", path);
+    snprintf(snapshot, sizeof(snapshot), "%s.snapshot", path);
+    snprintf(checksum, sizeof(checksum), "%s.sha256", snapshot);
+    long logged = file_size(path);
+    CHECK(snapshot_save(again, snapshot) == 0);
+    CHECK(file_size(sealed) == logged && file_size(path) == 0);
+    for (int i = 0; i < TEST_AFTER_SNAPSHOT; i++)
+    {
+        add(again, "after snapshot");
+    }
+    int length = again->length;
+
+    // A restart from the snapshot replays only the new segment
+    wal_t *wal = wal_open(path, WAL_SYNC_ALWAYS, 0);
+    blockchain_t *restored_snapshot = snapshot_load(snapshot, NULL, NULL, wal);
+    CHECK(restored_snapshot != NULL && restored_snapshot->length == TEST_BLOCKS + 1);
+    CHECK(wal_replay(wal, restored_snapshot) == TEST_AFTER_SNAPSHOT);
+    restored_snapshot->wal = wal;
+    CHECK(restored_snapshot->length == length);
+
+    // Raw records span both segments and are sent byte for byte
+    CHECK(wal_range_open(wal, 1, length - 1, &range) == 0);
+    CHECK(range.count == 2 && range.spans[0].segment == 1 && range.spans[1].segment == 2);
+    CHECK(range.spans[0].offset == 0 && (long) range.spans[0].length < logged);
+    CHECK(range.spans[1].offset == 0 && (long) range.spans[1].length == file_size(path));
+    char *expected = malloc(range.length);
+    CHECK(expected != NULL);
+    read_span(sealed, range.spans[0].offset, range.spans[0].length, expected);
+    read_span(path, range.spans[1].offset, range.spans[1].length, expected + range.spans[0].length);
+    int sockets[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+    CHECK(wal_range_send(wal, &range, sockets[0]) == 0);
+    char *sent = malloc(range.length);
+    CHECK(sent != NULL);
+    uint64_t received = 0;
+    while (received < range.length)
+    {
+        ssize_t n = read(sockets[1], sent + received, range.length - received);
+        CHECK(n > 0);
+        received += n;
+    }
+    CHECK(memcmp(sent, expected, range.length) == 0);
+    wal_range_close(&range);
+
+    // Without the snapshot every segment is replayed
+    blockchain_t *full = reopen(path, &replayed);
+    CHECK(replayed == TEST_BLOCKS + 1 + TEST_AFTER_SNAPSHOT);
+    CHECK(full->length == length);
+    CHECK(memcmp(full->chain[length - 1]->hash, again->chain[length - 1]->hash, BLOCK_HASH_LENGTH) == 0);
+
+    unlink(path);
+    unlink(sealed);
+    unlink(snapshot);
+    unlink(checksum);
+    printf("test_wal: passed\n");
+    return 0;
+}